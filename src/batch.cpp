@@ -0,0 +1,253 @@
+#include "batch.hpp"
+#include "context.hpp"
+#include "host.hpp"
+#include "process.hpp"
+#include <random>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+/**
+ * Removes the status markers from the stderr of a batch, and writes
+ * everything else to the real stderr. A marker is the nonce, a space, the
+ * exit status and a newline. Only used on the host's event loop until the
+ * process has finished.
+ */
+struct MarkerFilter {
+    std::string marker;         // nonce followed by a space
+    int fd;
+    std::string pending;        // data that might be the start of a marker
+    std::vector<int> statuses;
+
+    void input(const char* data, size_t len);
+
+    /**
+     * Writes out anything still held back, at the end of the output
+     */
+    void flush();
+
+private:
+    void forward(size_t begin, size_t end);
+    size_t partialMarkerStart(size_t begin) const;
+};
+
+void MarkerFilter::input(const char* data, size_t len)
+{
+    pending.append(data, len);
+
+    size_t begin = 0;
+    while (true) {
+        size_t pos = pending.find(marker, begin);
+        if (pos == std::string::npos)
+            break;
+
+        size_t end = pending.find('\n', pos);
+        if (end == std::string::npos)
+            break;      // the rest of the marker is still to come
+
+        std::string num = pending.substr(pos + marker.size(), end - pos - marker.size());
+        char* numEnd;
+        long status = strtol(num.c_str(), &numEnd, 10);
+        if (num.empty() || *numEnd != '\0') {
+            // the nonce followed by something else, not one of ours
+            forward(begin, pos + marker.size());
+            begin = pos + marker.size();
+            continue;
+        }
+
+        forward(begin, pos);
+        statuses.push_back(status);
+        begin = end + 1;
+    }
+
+    size_t keep = partialMarkerStart(begin);
+    forward(begin, keep);
+    pending.erase(0, keep);
+}
+
+void MarkerFilter::flush()
+{
+    forward(0, pending.size());
+    pending.clear();
+}
+
+void MarkerFilter::forward(size_t begin, size_t end)
+{
+    const char* p = pending.data() + begin;
+    size_t left = end - begin;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n <= 0)
+            return;
+        p += n;
+        left -= n;
+    }
+}
+
+/**
+ * Returns where the data that may still turn out to be a marker starts, or
+ * the end of the data if there is none
+ */
+size_t MarkerFilter::partialMarkerStart(size_t begin) const
+{
+    size_t pos = pending.find(marker, begin);
+    if (pos != std::string::npos)
+        return pos;
+
+    // the longest tail that is a prefix of the marker
+    size_t maxLen = std::min(marker.size() - 1, pending.size() - begin);
+    for (size_t len = maxLen; len > 0; len--) {
+        if (pending.compare(pending.size() - len, len, marker, 0, len) == 0)
+            return pending.size() - len;
+    }
+    return pending.size();
+}
+
+static std::string makeNonce()
+{
+    static const char hex[] = "0123456789abcdef";
+    std::random_device rd;
+    std::string nonce = "flassh-";
+    for (int i = 0; i < 16; i++)
+        nonce.push_back(hex[rd() % 16]);
+    return nonce;
+}
+
+
+
+BatchCommand::BatchCommand(const std::vector<SimpleCommand*>& cmds) : cmds(cmds) {}
+
+BatchCommand::~BatchCommand()
+{
+    for (auto cmd : cmds)
+        delete cmd;
+}
+
+std::string BatchCommand::buildScript(const std::string& nonce) const
+{
+    // the nonce is printed in two halves, so it doesn't show up in the
+    // output if the shell echoes the commands, e.g. with `set -x`
+    size_t half = nonce.size() / 2;
+    std::string printStatus = "printf '%s%s %d\\n' " + nonce.substr(0, half) + " " +
+                              nonce.substr(half) + " $? >&2\n";
+
+    // the parenthesis gets its own line, so a `#` in the command can't
+    // comment it out
+    std::string script;
+    for (auto cmd : cmds) {
+        script += "(\n" + cmd->getBatchLine() + "\n)\n";
+        script += printStatus;
+    }
+    return script;
+}
+
+void BatchCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
+{
+    c->whenHostsReady({ cmds[0]->getHost() }, [this, c, redirs, onFinish] () {
+        run(c, redirs, onFinish);
+    });
+}
+
+void BatchCommand::run(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
+{
+    statuses.clear();
+
+    Host* h;
+    try {
+        h = c->getHost(cmds[0]->getHost());
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "flassh: %s\n", e.what());
+        onFinish(1);
+        return;
+    }
+
+    // with a timeout, every command needs its own channel to be stopped
+    if (!h->getInfo().batch || h->getInfo().timeout > 0) {
+        startOneByOne(c, redirs, 0, onFinish);
+        return;
+    }
+
+    std::string nonce = makeNonce();
+    auto filter = new MarkerFilter;
+    filter->marker = nonce + " ";
+    filter->fd = STDERR_FILENO;
+    for (auto& r : redirs) {
+        if (r.newfd == STDERR_FILENO)
+            filter->fd = r.oldfd;
+    }
+
+    auto proc = new RemoteProcess(h, c, { buildScript(nonce) });
+    for (auto& r : redirs)
+        proc->redirectIo(r.oldfd, r.newfd);
+    proc->setStderrFilter([filter] (const char* data, size_t len) { filter->input(data, len); });
+
+    size_t numCmds = cmds.size();
+    proc->start([this, c, proc, filter, numCmds, onFinish] (int status) {
+        // like SimpleCommand, clean up on the main event loop, once the
+        // process is done calling us
+        c->getEvtLoop()->enqueueTask([this, proc, filter, numCmds, onFinish, status] () {
+            filter->flush();
+            statuses = filter->statuses;
+            delete filter;
+            delete proc;
+
+            int exitStatus = status != 0 ? status : 1;
+            if (statuses.size() == numCmds)
+                exitStatus = statuses.back();
+            onFinish(exitStatus);
+        }, "batch finished");
+    });
+}
+
+void BatchCommand::startOneByOne(Context* c, const std::vector<IoRedir>& redirs, size_t i, ProcessFinishedCallback onFinish)
+{
+    cmds[i]->start(c, redirs, [this, c, redirs, i, onFinish] (int status) {
+        c->getEvtLoop()->enqueueTask([this, c, redirs, i, onFinish, status] () {
+            statuses.push_back(status);
+            if (i + 1 == cmds.size())
+                onFinish(status);
+            else
+                startOneByOne(c, redirs, i + 1, onFinish);
+        }, "batched command finished");
+    });
+}
+
+void BatchCommand::prepare(Context* c)
+{
+    // the whole batch only needs one channel
+    cmds[0]->prepare(c);
+}
+
+
+
+std::vector<Command*> batchCommands(const std::vector<Command*>& cmds)
+{
+    std::vector<Command*> ret;
+    std::vector<SimpleCommand*> run;
+
+    auto endRun = [&ret, &run] () {
+        if (run.size() >= 2)
+            ret.push_back(new BatchCommand(run));
+        else if (run.size() == 1)
+            ret.push_back(run[0]);
+        run.clear();
+    };
+
+    for (auto cmd : cmds) {
+        auto simple = dynamic_cast<SimpleCommand*>(cmd);
+        if (simple == nullptr || simple->getBatchLine().empty()) {
+            endRun();
+            ret.push_back(cmd);
+            continue;
+        }
+
+        if (!run.empty() && run[0]->getHost() != simple->getHost())
+            endRun();
+        run.push_back(simple);
+    }
+    endRun();
+
+    return ret;
+}
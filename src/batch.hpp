@@ -0,0 +1,51 @@
+#pragma once
+
+#include "command.hpp"
+#include <vector>
+
+/**
+ * Consecutive remote commands for the same host, run as one script over a
+ * single channel instead of one channel and exec each.
+ *
+ * Every command runs in a subshell, so e.g. `cd` or `exit` in one of them
+ * doesn't affect the others, just like when they have their own channels.
+ * After each command the script writes a marker with its exit status to
+ * stderr, which is filtered out of the output. The batch finishes with the
+ * status of the last command, like the commands would have one by one.
+ *
+ * The script needs a POSIX compatible login shell. On hosts with `batch=no`
+ * or a `timeout=`, the commands are run one by one instead.
+ */
+class BatchCommand : public Command {
+public:
+    /**
+     * Takes ownership of the commands, which must all be for the same host
+     * and have a batch line
+     */
+    BatchCommand(const std::vector<SimpleCommand*>& cmds);
+    ~BatchCommand();
+
+    void start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish);
+    void prepare(Context* c);
+
+    /**
+     * Returns the exit status of each command of the last run. Commands that
+     * didn't get to run are missing.
+     */
+    const std::vector<int>& getStatuses() const { return statuses; }
+
+private:
+    std::vector<SimpleCommand*> cmds;
+    std::vector<int> statuses;
+
+    std::string buildScript(const std::string& nonce) const;
+    void run(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish);
+    void startOneByOne(Context* c, const std::vector<IoRedir>& redirs, size_t i, ProcessFinishedCallback onFinish);
+};
+
+/**
+ * Replaces runs of two or more consecutive remote commands for the same host
+ * with a BatchCommand. Takes ownership of the commands, and returns the ones
+ * to run instead.
+ */
+std::vector<Command*> batchCommands(const std::vector<Command*>& cmds);
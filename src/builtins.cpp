@@ -0,0 +1,39 @@
+#include "builtins.hpp"
+#include "multicast.hpp"
+#include "deltaPush.hpp"
+#include "inventory.hpp"
+#include "stats.hpp"
+#include <map>
+#include <functional>
+
+typedef std::function<Process*(Context*, const std::vector<std::string>&)> BuiltinFactory;
+
+template <class T>
+static Process* create(Context* ctx, const std::vector<std::string>& args)
+{
+    return new T(ctx, args);
+}
+
+static const std::map<std::string, BuiltinFactory> builtins = {
+    { "distribute", create<MulticastProcess> },
+    { "inventory", create<InventoryProcess> },
+    { "push", create<DeltaPushProcess> },
+    { "stats", create<StatsProcess> },
+};
+
+Process* createBuiltin(Context* ctx, const std::vector<std::string>& args)
+{
+    if (args.empty())
+        return nullptr;
+
+    auto it = builtins.find(args[0]);
+    if (it == builtins.end())
+        return nullptr;
+
+    return it->second(ctx, args);
+}
+
+bool isBuiltin(const std::string& name)
+{
+    return builtins.find(name) != builtins.end();
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+class Process;
+class Context;
+
+/**
+ * Creates the process for a builtin command. Builtins only exist on the local
+ * host and run on the event loop thread.
+ *
+ * @return the new process, or `nullptr` if `args` does not name a builtin
+ */
+Process* createBuiltin(Context* ctx, const std::vector<std::string>& args);
+
+/**
+ * Returns true if `name` is a builtin command
+ */
+bool isBuiltin(const std::string& name);
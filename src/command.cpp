@@ -1,47 +1,510 @@
 #include "command.hpp"
 #include "process.hpp"
 #include "context.hpp"
+#include "builtins.hpp"
+#include "remoteFile.hpp"
+#include "host.hpp"
+#include "resultCache.hpp"
+#include "objectPool.hpp"
+#include "units.hpp"
+#include "expansion.hpp"
+#include "execChannel.hpp"
 #include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <algorithm>
 
 NopCommand::NopCommand(ProcessFinishedCallback onFinish)
     : additionalOnFinish(onFinish) {}
 
 void NopCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
 {
+    int status = c->getLastStatus();
     if (additionalOnFinish)
-        additionalOnFinish(0);
+        additionalOnFinish(status);
 
     if (onFinish)
-        onFinish(0);
+        onFinish(status);
+}
+
+
+
+bool CommandModifiers::set(const std::string& name, const std::string& value)
+{
+    if (name == "cache") {
+        return parseDuration(value, cacheTtl) && cacheTtl > 0;
+    }
+    else if (name == "timeout") {
+        return parseDuration(value, timeout) && timeout > 0;
+    }
+    else if (name == "retry") {
+        return parseCount(value, retries) && retries > 0;
+    }
+    return false;
+}
+
+std::vector<std::pair<std::string, std::string>> CommandModifiers::options() const
+{
+    std::vector<std::pair<std::string, std::string>> ret;
+    if (cacheTtl > 0)
+        ret.push_back({ "cache", std::to_string(cacheTtl) });
+    if (timeout > 0)
+        ret.push_back({ "timeout", std::to_string(timeout) });
+    if (retries > 0)
+        ret.push_back({ "retry", std::to_string(retries) });
+    return ret;
+}
+
+
+
+SimpleCommand::SimpleCommand(HostId host, const std::vector<StringTable::Id>& args,
+                             const std::vector<FileRedir>& fileRedirs, const CommandModifiers& modifiers)
+    : host(host), args(args), fileRedirs(fileRedirs), modifiers(modifiers)
+{
+    for (auto a : args)
+        expands = expands || Expansion::hasExpansions(StringTable::args().get(a));
+    for (auto& r : fileRedirs)
+        expands = expands || Expansion::hasExpansions(r.path);
 }
 
+/**
+ * Everything that belongs to a single run of a SimpleCommand. Deleted once the
+ * process has finished and all of its output has been written to files. Lives
+ * on the main event loop, except for remote files, which live on the event
+ * loops of their hosts.
+ */
+struct SimpleCmdState : Pooled<SimpleCmdState> {
+    Process* proc = nullptr;
+    ProcessFinishedCallback onFinish;
+
+    // local files and our ends of pipes, closed when the process finishes
+    std::vector<int> fds;
+    std::vector<RemoteFile*> remoteFiles;
+
+    int pendingPumps = 0;
+    bool procDone = false;
+    int status = 0;
+
+    // set up before the process is created
+    std::vector<StringTable::Id> args;  // only if redirections are added
+    std::vector<IoRedir> redirs;
+    std::vector<int> remoteFds;         // FDs in the process of remoteFiles
+    int pendingOpens = 0;
+    std::string openError;
+    bool cacheable = false;
+
+    // set if the stdout of a successful run goes into the result cache
+    std::string cacheKey;
+    std::string output;
+
+    // arguments of an expanded command, which the process may point into
+    std::vector<std::string> words;
+
+    ~SimpleCmdState()
+    {
+        for (int fd : fds)
+            close(fd);
+        for (auto f : remoteFiles) {
+            if (f != nullptr)
+                f->getHost()->getEvtLoop()->enqueueTask([f] () { delete f; }, "delete RemoteFile");
+        }
+        delete proc;
+    }
 
+    void tryFinish()
+    {
+        if (!procDone || pendingPumps > 0)
+            return;
+
+        auto cb = onFinish;
+        int exitStatus = status;
+        delete this;
+        cb(exitStatus);
+    }
+};
+
+/**
+ * Returns the operator of a redirection in shell syntax, with its FD if that
+ * isn't the operator's default
+ */
+static std::string redirOperator(const FileRedir& r)
+{
+    const char* op;
+    int defaultFd = STDOUT_FILENO;
+    switch (r.mode) {
+    case FileRedir::READ:
+        op = "<";
+        defaultFd = STDIN_FILENO;
+        break;
+    case FileRedir::APPEND:
+        op = ">>";
+        break;
+    default:
+        op = ">";
+        break;
+    }
+    return r.fd == defaultFd ? op : std::to_string(r.fd) + op;
+}
+
+static int openLocalFile(const FileRedir& r)
+{
+    int flags = O_CLOEXEC;
+    switch (r.mode) {
+    case FileRedir::READ:
+        flags |= O_RDONLY;
+        break;
+    case FileRedir::WRITE:
+        flags |= O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    case FileRedir::APPEND:
+        flags |= O_WRONLY | O_CREAT | O_APPEND;
+        break;
+    }
 
-SimpleCommand::SimpleCommand(const std::string& hostAlias, const std::vector<std::string>& args) 
-    : hostAlias(hostAlias), args(args) {}
+    int fd = open(r.path.c_str(), flags, 0666);
+    if (fd == -1) {
+        throw std::runtime_error(r.path + ": " + strerror(errno));
+    }
+    return fd;
+}
 
 void SimpleCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
 {
-    auto p = c->createPocess(hostAlias, args, redirs);
-    p->start([c, p, onFinish] (int status) {
-        onFinish(status);
+    if (!expands) {
+        startExpanded(c, redirs, nullptr, onFinish);
+        return;
+    }
+
+    // paths are expanded along with the arguments, after them
+    std::vector<std::string> words = StringTable::args().get(args);
+    for (auto& r : fileRedirs)
+        words.push_back(r.path);
+
+    Expansion::expand(c, words, redirs, [this, c, redirs, onFinish] (std::vector<std::string>& words, int) {
+        auto exp = std::make_shared<Expanded>();
+        exp->args.assign(words.begin(), words.begin() + args.size());
+        exp->fileRedirs = fileRedirs;
+        for (size_t i = 0; i < fileRedirs.size(); i++)
+            exp->fileRedirs[i].path = words[args.size() + i];
+        startExpanded(c, redirs, exp, onFinish);
+    });
+}
+
+/**
+ * Starts the command with its words expanded, or with `exp` null if it has
+ * nothing to expand
+ */
+void SimpleCommand::startExpanded(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, ProcessFinishedCallback onFinish)
+{
+    if (modifiers.retries > 0)
+        retry(c, redirs, exp, 0, onFinish);
+    else
+        startOnce(c, redirs, exp, onFinish);
+}
+
+/**
+ * Runs the command, and again after a growing delay if it fails with an SSH
+ * error, e.g. because its host lost the connection, and retries are left
+ */
+void SimpleCommand::retry(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, unsigned attempt, ProcessFinishedCallback onFinish)
+{
+    startOnce(c, redirs, exp, [this, c, redirs, exp, attempt, onFinish] (int status) {
+        if (status != Process::sshErrorStatus || attempt >= modifiers.retries) {
+            onFinish(status);
+            return;
+        }
+
+        // this callback could be in any thread, and timers belong to a loop
+        c->getEvtLoop()->enqueueTask([this, c, redirs, exp, attempt, onFinish] () {
+            uint64_t delay = 1000000ull << std::min(attempt, 5u);
+            fprintf(stderr, "flassh: retrying %s in %llus (%u of %u)\n",
+                    exp ? exp->args[0].c_str() : StringTable::args().get(args[0]).c_str(),
+                    (unsigned long long)delay / 1000000, attempt + 1, modifiers.retries);
+            c->getEvtLoop()->addTimer(delay, [this, c, redirs, exp, attempt, onFinish] () {
+                retry(c, redirs, exp, attempt + 1, onFinish);
+            }, "retry command");
+        }, "retry command");
+    });
+}
+
+/**
+ * Waits for the hosts of the command, then runs it
+ */
+void SimpleCommand::startOnce(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, ProcessFinishedCallback onFinish)
+{
+    std::vector<HostId> hosts;
+    if (host != localHost)
+        hosts.push_back(host);
+    for (auto& r : fileRedirs) {
+        if (r.host != localHost)
+            hosts.push_back(r.host);
+    }
+
+    // builtins take host aliases as arguments
+    if (host == localHost && !args.empty() && isBuiltin(exp ? exp->args[0] : StringTable::args().get(args[0]))) {
+        for (auto& a : exp ? exp->args : StringTable::args().get(args)) {
+            HostId id = StringTable::hostAliases().find(a);
+            if (id != StringTable::notFound)
+                hosts.push_back(id);
+        }
+    }
+
+    // skips queuing a task in the common case
+    if (c->hostsReady(hosts)) {
+        run(c, redirs, exp, onFinish);
+        return;
+    }
+
+    c->whenHostsReady(hosts, [this, c, redirs, exp, onFinish] () {
+        run(c, redirs, exp, onFinish);
+    });
+}
+
+/**
+ * Starts the command once its hosts are ready. Files on remote hosts are
+ * opened on the event loops of their hosts first, since that takes SFTP
+ * round trips.
+ */
+void SimpleCommand::run(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, ProcessFinishedCallback onFinish)
+{
+    auto st = new SimpleCmdState;
+    st->onFinish = onFinish;
+    st->redirs = redirs;
+    if (exp)
+        st->words = exp->args;
+
+    // only remote commands are cached, and only if we see all of their output
+    st->cacheable = modifiers.cacheTtl > 0 && host != localHost;
+
+    std::vector<const FileRedir*> remoteRedirs;
+    try {
+        for (auto& r : exp ? exp->fileRedirs : fileRedirs) {
+            if (host != localHost && r.host == host) {
+                // the file is on the same remote host, so let the remote shell
+                // handle it and the data never has to leave that host. The
+                // path is quoted, so the remote shell opens the same file that
+                // a local redirection would.
+                if (exp) {
+                    st->words.push_back(redirOperator(r));
+                    st->words.push_back(shellQuotePath(r.path));
+                }
+                else {
+                    if (st->args.empty())
+                        st->args = args;
+                    st->args.push_back(StringTable::args().intern(redirOperator(r)));
+                    st->args.push_back(StringTable::args().intern(shellQuotePath(r.path)));
+                }
+                st->cacheable = false;
+            }
+            else if (host != localHost && r.fd > STDERR_FILENO) {
+                throw std::runtime_error("only the stdio of a remote command can be redirected to another host");
+            }
+            else if (r.host == localHost) {
+                int fd = openLocalFile(r);
+                st->fds.push_back(fd);
+                st->redirs.push_back({ fd, r.fd });
+            }
+            else {
+                c->getHost(r.host);     // throws if there is none
+                remoteRedirs.push_back(&r);
+            }
+        }
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "flassh: %s\n", e.what());
+        delete st;
+        onFinish(1);
+        return;
+    }
+
+    if (remoteRedirs.empty()) {
+        launch(c, st, exp);
+        return;
+    }
+
+    st->remoteFiles.resize(remoteRedirs.size(), nullptr);
+    st->pendingOpens = remoteRedirs.size();
+    for (size_t i = 0; i < remoteRedirs.size(); i++) {
+        const FileRedir& r = *remoteRedirs[i];
+        Host* h = c->getHost(r.host);
+        st->remoteFds.push_back(r.fd);
+        h->getEvtLoop()->enqueueTask([this, c, st, exp, h, i, path = r.path, mode = r.mode] () {
+            RemoteFile* f = nullptr;
+            std::string error;
+            try {
+                f = new RemoteFile(h, path, mode);
+            }
+            catch (std::exception& e) {
+                error = e.what();
+            }
+
+            c->getEvtLoop()->enqueueTask([this, c, st, exp, i, f, error] () {
+                st->remoteFiles[i] = f;
+                if (!error.empty() && st->openError.empty())
+                    st->openError = error;
+                if (--st->pendingOpens > 0)
+                    return;
+
+                if (!st->openError.empty()) {
+                    fprintf(stderr, "flassh: %s\n", st->openError.c_str());
+                    auto cb = st->onFinish;
+                    delete st;
+                    cb(1);
+                    return;
+                }
+                launch(c, st, exp);
+            }, "remote file opened");
+        }, "open remote file");
+    }
+}
+
+/**
+ * Creates and starts the process, once all files are open
+ */
+void SimpleCommand::launch(Context* c, SimpleCmdState* st, ExpandedPtr exp)
+{
+    // remote files with their end of a pipe
+    std::vector<std::pair<RemoteFile*, int>> pumps;
+    try {
+        ResultCache::Entry cached;
+        if (st->cacheable) {
+            st->cacheKey = ResultCache::key(c->getHost(host)->getInfo(), exp ? exp->args : StringTable::args().get(args));
+            if (ResultCache::lookup(st->cacheKey, modifiers.cacheTtl, cached)) {
+                // replay the stored result without opening a channel
+                st->cacheKey.clear();
+                st->proc = new CachedProcess(cached);
+                st->proc->redirectIo(st->redirs);
+            }
+        }
+
+        if (st->proc == nullptr) {
+            if (exp)
+                st->proc = c->createPocess(host, st->words, st->redirs);
+            else
+                st->proc = c->createPocess(host, st->args.empty() ? args : st->args, st->redirs);
+            if (modifiers.timeout > 0 && !st->proc->setTimeout(modifiers.timeout))
+                throw std::runtime_error("@timeout only works for remote commands");
+            if (!st->cacheKey.empty() && !st->proc->captureStdout(&st->output))
+                st->cacheKey.clear();
+        }
+
+        for (size_t i = 0; i < st->remoteFiles.size(); i++) {
+            RemoteFile* f = st->remoteFiles[i];
+            int fdProc = st->remoteFds[i];
+            bool isOutput = f->getMode() != FileRedir::READ;
+            if (isOutput && st->proc->redirectToRemoteFile(f, fdProc))
+                continue;
+
+            // the process can't access the file itself, pump it through a pipe
+            // on the event loop of the file's host
+            int fds[2];
+            if (pipe2(fds, O_CLOEXEC) == -1)
+                throw std::runtime_error(std::string("pipe2 failed: ") + strerror(errno));
+            int pumpFd = isOutput ? fds[0] : fds[1];
+            int procFd = isOutput ? fds[1] : fds[0];
+            st->fds.push_back(procFd);
+            st->proc->redirectIo(procFd, fdProc);
 
-        // Since the process must have a reference to this lambda, deleting
-        // the process would delete this lambda while it's still running.
-        // Therefore, we must make sure it gets deleted later
-        c->getEvtLoop()->enqueueTask([p](){ delete p; });
+            pumps.push_back({ f, pumpFd });
+        }
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "flassh: %s\n", e.what());
+        for (auto& pump : pumps)
+            close(pump.second);
+        auto cb = st->onFinish;
+        delete st;
+        cb(1);
+        return;
+    }
+
+    // started only once nothing can fail anymore, so they never outlive st
+    for (auto& pump : pumps) {
+        RemoteFile* f = pump.first;
+        int pumpFd = pump.second;
+        std::function<void()> onDone;
+        if (f->getMode() != FileRedir::READ) {
+            ++st->pendingPumps;
+            onDone = [c, st] () {
+                c->getEvtLoop()->enqueueTask([st] () {
+                    --st->pendingPumps;
+                    st->tryFinish();
+                }, "output pump finished");
+            };
+        }
+        f->getHost()->getEvtLoop()->enqueueTask([f, pumpFd, onDone] () {
+            f->startPump(pumpFd, onDone);
+        }, "start RemoteFile pump");
+    }
+
+    st->proc->start([c, st] (int status) {
+        // this callback could be in any thread, so wrap in enqueueTask. This
+        // also makes sure the process isn't deleted while it's still running
+        // this lambda.
+        c->getEvtLoop()->enqueueTask([st, status] () {
+            st->status = status;
+            st->procDone = true;
+
+            // failures may be transient, so only successful runs are stored
+            if (!st->cacheKey.empty() && status == 0)
+                ResultCache::store(st->cacheKey, { status, st->output });
+
+            // closing our copies of the pipes lets output pumps see EOF
+            for (int fd : st->fds)
+                close(fd);
+            st->fds.clear();
 
-        // might work without the event loop if it's the last statement in the
-        // function, but this feels sketchy
-        //delete p;
+            st->tryFinish();
+        }, "process finished");
     });
 }
 
+std::string SimpleCommand::getBatchLine() const
+{
+    if (host == localHost || !modifiers.options().empty() || expands)
+        return "";
+
+    // the same way RemoteProcess builds its command
+    std::string line;
+    for (auto& a : StringTable::args().get(args))
+        line += a + " ";
+    for (auto& r : fileRedirs) {
+        if (r.host != host)
+            return "";
+        line += redirOperator(r) + " " + shellQuotePath(r.path) + " ";
+    }
+    return line;
+}
+
+/**
+ * Opens the channel of a remote command ahead of time, so starting it only
+ * waits for the exec
+ */
+void SimpleCommand::prepare(Context* c)
+{
+    if (prepared || host == localHost)
+        return;
+
+    // nullptr if defined by a command that hasn't run yet
+    Host* h = c->findHost(host);
+    if (h == nullptr || !h->isReady())
+        return;     // still connecting, try again later
+
+    h->getEvtLoop()->enqueueTask([h] () { h->prefetchChannel(); }, "prefetch channel");
+    prepared = true;
+}
+
 
 
 PipeCommand::PipeCommand(Command* left, Command* right)
     : leftCmd(left), rightCmd(right) {}
 
+void PipeCommand::prepare(Context* c)
+{
+    leftCmd->prepare(c);
+    rightCmd->prepare(c);
+}
+
 void PipeCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
 {
     struct PipeCmdState {
@@ -74,23 +537,86 @@ void PipeCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessF
     leftRedirs.push_back({ state->pipefd[1], STDOUT_FILENO });
     rightRedirs.push_back({ state->pipefd[0], STDIN_FILENO });
 
-    leftCmd->start(c, leftRedirs, [state, onFinish] (int status) {
-        state->leftDone = true;
-        close(state->pipefd[1]);
-        if (state->rightDone) {
-            int retStatus = state->rightStatus;
-            delete state;
-            onFinish(retStatus);
-        }
+    // the two sides may finish on different threads, so only touch the state
+    // on the main event loop
+    EventLoop* loop = c->getEvtLoop();
+
+    leftCmd->start(c, leftRedirs, [state, c, loop, onFinish] (int status) {
+        loop->enqueueTask([state, c, onFinish] () {
+            state->leftDone = true;
+            close(state->pipefd[1]);
+            if (state->rightDone) {
+                int retStatus = state->rightStatus;
+                delete state;
+                c->setLastStatus(retStatus);
+                onFinish(retStatus);
+            }
+        }, "pipe left side finished");
     });
 
-    rightCmd->start(c, rightRedirs, [state, onFinish] (int status) {
-        state->rightDone = true;
-        close(state->pipefd[0]);
-        if (state->leftDone) {
-            delete state;
-            onFinish(status);
-        }
+    rightCmd->start(c, rightRedirs, [state, c, loop, onFinish] (int status) {
+        loop->enqueueTask([state, c, status, onFinish] () {
+            state->rightDone = true;
+            state->rightStatus = status;
+            close(state->pipefd[0]);
+            if (state->leftDone) {
+                delete state;
+                c->setLastStatus(status);
+                onFinish(status);
+            }
+        }, "pipe right side finished");
+    });
+}
+
+
+
+AndOrCommand::AndOrCommand(Command* left, Command* right, Op op)
+    : leftCmd(left), rightCmd(right), op(op) {}
+
+AndOrCommand::~AndOrCommand()
+{
+    delete leftCmd;
+    delete rightCmd;
+}
+
+void AndOrCommand::prepare(Context* c)
+{
+    // the right side may be skipped, so don't open a channel for it yet
+    leftCmd->prepare(c);
+}
+
+void AndOrCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
+{
+    leftCmd->start(c, redirs, [this, c, redirs, onFinish] (int status) {
+        c->getEvtLoop()->enqueueTask([this, c, redirs, onFinish, status] () {
+            // `$?` on the right side is the status of the left side
+            c->setLastStatus(status);
+            if ((status == 0) != (op == AND)) {
+                onFinish(status);
+                return;
+            }
+            rightCmd->start(c, redirs, onFinish);
+        }, "and-or left side finished");
+    });
+}
+
+
+
+AssignCommand::AssignCommand(StringTable::Id name, StringTable::Id value)
+    : name(name), value(value) {}
+
+void AssignCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
+{
+    const std::string& str = StringTable::args().get(value);
+    if (!Expansion::hasExpansions(str)) {
+        c->setVariable(name, str);
+        onFinish(0);
+        return;
+    }
+
+    Expansion::expand(c, { str }, redirs, [this, c, onFinish] (std::vector<std::string>& words, int status) {
+        c->setVariable(name, words[0]);
+        onFinish(status == -1 ? 0 : status);
     });
 }
 
@@ -101,6 +627,13 @@ NewHostCommand::NewHostCommand(const std::string& alias, const HostInfo& info) :
 
 void NewHostCommand::start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish)
 {
-    c->addHost(alias, hostInfo);
+    try {
+        c->addHost(alias, hostInfo);
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "flassh: %s\n", e.what());
+        onFinish(1);
+        return;
+    }
     onFinish(0);
 }
@@ -8,6 +8,7 @@
 #include <functional>
 
 class Context;
+struct SimpleCmdState;
 
 /**
  * Represents a linked-list of command trees
@@ -38,10 +39,19 @@ public:
      *                  called on any thread.
      */
     virtual void start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish) = 0;
+
+    /**
+     * Called on the main event loop while the command waits in the queue
+     * behind a running one. May start work that makes `start()` faster, but
+     * nothing with visible side effects, since the command may never run.
+     * Can be called several times.
+     */
+    virtual void prepare(Context* c) {}
 };
 
 /**
- * A command that does nothing
+ * A command that does nothing. It finishes with the status of the command
+ * before it, so it doesn't change `$?`.
  */
 class NopCommand : public Command {
 public:
@@ -57,18 +67,83 @@ private:
     ProcessFinishedCallback additionalOnFinish;
 };
 
+/**
+ * Modifiers written in front of a simple command, e.g. `@cache 1h`
+ */
+struct CommandModifiers {
+    uint64_t cacheTtl = 0;      // seconds, 0 if the result isn't cached
+    uint64_t timeout = 0;       // seconds, 0 for the host's timeout
+    unsigned retries = 0;       // runs again after SSH errors
+
+    /**
+     * Sets the modifier `@name value`
+     *
+     * @return false if the modifier or value is invalid
+     */
+    bool set(const std::string& name, const std::string& value);
+
+    /**
+     * Returns the modifiers that aren't at their default, as `set()` takes
+     * them
+     */
+    std::vector<std::pair<std::string, std::string>> options() const;
+};
+
 /**
  * A simple command
  */
 class SimpleCommand : public Command {
 public:
-    SimpleCommand(const std::string& hostAlias, const std::vector<std::string>& args);
+    /**
+     * @param host  ID in `StringTable::hostAliases()`
+     * @param args  IDs in `StringTable::args()`
+     */
+    SimpleCommand(HostId host, const std::vector<StringTable::Id>& args,
+                  const std::vector<FileRedir>& fileRedirs = {},
+                  const CommandModifiers& modifiers = {});
 
     void start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish);
+    void prepare(Context* c);
+
+    HostId getHost() const { return host; }
+    const std::vector<StringTable::Id>& getArgs() const { return args; }
+    const std::vector<FileRedir>& getFileRedirs() const { return fileRedirs; }
+    const CommandModifiers& getModifiers() const { return modifiers; }
+
+    /**
+     * Returns true if arguments or redirections have variables or command
+     * substitutions, which are expanded each time the command starts
+     */
+    bool hasExpansions() const { return expands; }
+
+    /**
+     * Returns the line that runs this command in the remote shell, or an
+     * empty string if it can't be part of a batch, i.e. if it is local, has
+     * modifiers, expansions, or redirections that aren't done by the remote
+     * shell
+     */
+    std::string getBatchLine() const;
 
 private:
-    std::string hostAlias;
-    std::vector<std::string> args;
+    // the words of one run after expansion, shared by its retries
+    struct Expanded {
+        std::vector<std::string> args;
+        std::vector<FileRedir> fileRedirs;
+    };
+    typedef std::shared_ptr<const Expanded> ExpandedPtr;
+
+    void startExpanded(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, ProcessFinishedCallback onFinish);
+    void startOnce(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, ProcessFinishedCallback onFinish);
+    void retry(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, unsigned attempt, ProcessFinishedCallback onFinish);
+    void run(Context* c, const std::vector<IoRedir>& redirs, ExpandedPtr exp, ProcessFinishedCallback onFinish);
+    void launch(Context* c, SimpleCmdState* st, ExpandedPtr exp);
+
+    HostId host;
+    std::vector<StringTable::Id> args;
+    std::vector<FileRedir> fileRedirs;
+    CommandModifiers modifiers;
+    bool expands = false;
+    bool prepared = false;
 };
 
 class PipeCommand : public Command {
@@ -76,6 +151,10 @@ public:
     PipeCommand(Command* left, Command* right);
 
     void start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish);
+    void prepare(Context* c);
+
+    Command* getLeft() const { return leftCmd; }
+    Command* getRight() const { return rightCmd; }
 
 private:
     Command* leftCmd;
@@ -83,7 +162,59 @@ private:
 };
 
 /**
- * Opens a new connection to a host
+ * `left && right` or `left || right`. The right side only runs if the left
+ * one succeeded, or failed, respectively; otherwise it is skipped as a whole,
+ * without opening any channels. Finishes with the status of the last side
+ * that ran.
+ */
+class AndOrCommand : public Command {
+public:
+    enum Op {
+        AND,    // &&
+        OR      // ||
+    };
+
+    AndOrCommand(Command* left, Command* right, Op op);
+    ~AndOrCommand();
+
+    void start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish);
+    void prepare(Context* c);
+
+    Command* getLeft() const { return leftCmd; }
+    Command* getRight() const { return rightCmd; }
+    Op getOp() const { return op; }
+
+private:
+    Command* leftCmd;
+    Command* rightCmd;
+    Op op;
+};
+
+/**
+ * `NAME=value`, sets a variable of the Context. Finishes with the status of
+ * the last command substitution in the value, or 0 if there is none.
+ */
+class AssignCommand : public Command {
+public:
+    /**
+     * @param name   ID in `StringTable::variables()`
+     * @param value  ID in `StringTable::args()`
+     */
+    AssignCommand(StringTable::Id name, StringTable::Id value);
+
+    void start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish);
+
+    StringTable::Id getName() const { return name; }
+    StringTable::Id getValue() const { return value; }
+
+private:
+    StringTable::Id name;
+    StringTable::Id value;
+};
+
+/**
+ * Defines a host, which connects in the background. Commands that use the
+ * host wait for it, so this finishes right away.
  */
 class NewHostCommand : public Command {
 public:
@@ -91,6 +222,9 @@ public:
 
     void start(Context* c, const std::vector<IoRedir>& redirs, ProcessFinishedCallback onFinish);
 
+    const std::string& getAlias() const { return alias; }
+    const HostInfo& getHostInfo() const { return hostInfo; }
+
 private:
     std::string alias;
     HostInfo hostInfo;
@@ -0,0 +1,302 @@
+#include "compiledScript.hpp"
+#include "command.hpp"
+#include "resultCache.hpp"
+#include "trace.hpp"
+#include "md5.hpp"
+#include "parser/parser.hpp"
+#include <fstream>
+#include <sstream>
+#include <cstring>
+#include <unistd.h>
+
+// bump when the instructions change, old files are then parsed again
+static const char magic[] = "flassh-ir 4\n";
+
+CompiledScript CompiledScript::compile(const std::vector<Command*>& cmds)
+{
+    CompiledScript cs;
+    for (auto cmd : cmds)
+        cs.lower(cmd);
+    return cs;
+}
+
+uint32_t CompiledScript::intern(const std::string& str)
+{
+    auto it = stringIds.find(str);
+    if (it != stringIds.end())
+        return it->second;
+    strings.push_back(str);
+    stringIds[str] = strings.size() - 1;
+    return strings.size() - 1;
+}
+
+void CompiledScript::lower(Command* cmd)
+{
+    if (auto simple = dynamic_cast<SimpleCommand*>(cmd)) {
+        auto& aliases = StringTable::hostAliases();
+        for (auto& a : StringTable::args().get(simple->getArgs()))
+            code.push_back({ ARG, 0, 0, intern(a), 0 });
+        for (auto& r : simple->getFileRedirs())
+            code.push_back({ REDIR, (uint8_t)r.fd, (uint8_t)r.mode, intern(aliases.get(r.host)), intern(r.path) });
+        for (auto& m : simple->getModifiers().options())
+            code.push_back({ MODIFIER, 0, 0, intern(m.first), intern(m.second) });
+        code.push_back({ SIMPLE, 0, 0, intern(aliases.get(simple->getHost())), (uint32_t)simple->getArgs().size() });
+    }
+    else if (auto pipe = dynamic_cast<PipeCommand*>(cmd)) {
+        lower(pipe->getLeft());
+        lower(pipe->getRight());
+        code.push_back({ PIPE, 0, 0, 0, 0 });
+    }
+    else if (auto andOr = dynamic_cast<AndOrCommand*>(cmd)) {
+        lower(andOr->getLeft());
+        lower(andOr->getRight());
+        code.push_back({ AND_OR, 0, (uint8_t)andOr->getOp(), 0, 0 });
+    }
+    else if (auto def = dynamic_cast<NewHostCommand*>(cmd)) {
+        for (auto& o : def->getHostInfo().options())
+            code.push_back({ HOST_OPTION, 0, 0, intern(o.first), intern(o.second) });
+        code.push_back({ NEW_HOST, 0, 0, intern(def->getAlias()), intern(def->getHostInfo().toString()) });
+    }
+    else if (auto assign = dynamic_cast<AssignCommand*>(cmd)) {
+        code.push_back({ ASSIGN, 0, 0, intern(StringTable::variables().get(assign->getName())),
+                         intern(StringTable::args().get(assign->getValue())) });
+    }
+    else {
+        throw std::runtime_error("can't compile command");
+    }
+}
+
+std::vector<Command*> CompiledScript::instantiate() const
+{
+    // the string table of the script becomes IDs in the shared ones, each
+    // string is only looked up once
+    std::vector<StringTable::Id> argIds(strings.size(), StringTable::notFound);
+    std::vector<HostId> hostIds(strings.size(), StringTable::notFound);
+    auto argId = [&] (uint32_t i) {
+        if (argIds[i] == StringTable::notFound)
+            argIds[i] = StringTable::args().intern(strings[i]);
+        return argIds[i];
+    };
+    auto hostId = [&] (uint32_t i) {
+        if (hostIds[i] == StringTable::notFound)
+            hostIds[i] = StringTable::hostAliases().intern(strings[i]);
+        return hostIds[i];
+    };
+
+    std::vector<Command*> stack;
+    std::vector<StringTable::Id> args;
+    std::vector<FileRedir> redirs;
+    CommandModifiers modifiers;
+    HostInfo info;
+
+    for (auto& in : code) {
+        switch (in.op) {
+        case ARG:
+            args.push_back(argId(in.a));
+            break;
+        case REDIR:
+            redirs.push_back({ in.fd, (FileRedir::Mode)in.mode, hostId(in.a), strings[in.b] });
+            break;
+        case MODIFIER:
+            modifiers.set(strings[in.a], strings[in.b]);
+            break;
+        case HOST_OPTION:
+            info.setOption(strings[in.a], strings[in.b]);
+            break;
+        case SIMPLE:
+            stack.push_back(new SimpleCommand(hostId(in.a), args, redirs, modifiers));
+            args.clear();
+            redirs.clear();
+            modifiers = CommandModifiers();
+            break;
+        case PIPE: {
+            Command* right = stack.back();
+            stack.pop_back();
+            Command* left = stack.back();
+            stack.back() = new PipeCommand(left, right);
+            break;
+        }
+        case AND_OR: {
+            Command* right = stack.back();
+            stack.pop_back();
+            Command* left = stack.back();
+            stack.back() = new AndOrCommand(left, right, (AndOrCommand::Op)in.mode);
+            break;
+        }
+        case NEW_HOST:
+            info.parse(strings[in.b]);
+            stack.push_back(new NewHostCommand(strings[in.a], info));
+            info = HostInfo();
+            break;
+        case ASSIGN:
+            stack.push_back(new AssignCommand(StringTable::variables().intern(strings[in.a]), argId(in.b)));
+            break;
+        }
+    }
+    return stack;
+}
+
+std::string CompiledScript::serialize() const
+{
+    std::string out = magic;
+    auto put32 = [&out] (uint32_t v) { out.append((const char*)&v, sizeof(v)); };
+
+    put32(strings.size());
+    for (auto& s : strings) {
+        put32(s.size());
+        out += s;
+    }
+
+    put32(code.size());
+    for (auto& in : code) {
+        out.push_back(in.op);
+        out.push_back(in.fd);
+        out.push_back(in.mode);
+        put32(in.a);
+        put32(in.b);
+    }
+    return out;
+}
+
+bool CompiledScript::deserialize(const std::string& data)
+{
+    size_t pos = strlen(magic);
+    if (data.compare(0, pos, magic) != 0)
+        return false;
+
+    auto get32 = [&data, &pos] (uint32_t& v) {
+        if (data.size() - pos < sizeof(v))
+            return false;
+        memcpy(&v, data.data() + pos, sizeof(v));
+        pos += sizeof(v);
+        return true;
+    };
+
+    uint32_t n;
+    if (!get32(n))
+        return false;
+    strings.clear();
+    for (uint32_t i = 0; i < n; i++) {
+        uint32_t len;
+        if (!get32(len) || data.size() - pos < len)
+            return false;
+        strings.push_back(data.substr(pos, len));
+        pos += len;
+    }
+
+    // check everything instantiate() relies on, so a damaged file is a miss
+    if (!get32(n))
+        return false;
+    code.clear();
+    size_t depth = 0;
+    uint32_t numArgs = 0;
+    for (uint32_t i = 0; i < n; i++) {
+        Instr in;
+        if (data.size() - pos < 3)
+            return false;
+        in.op = (Op)data[pos];
+        in.fd = data[pos + 1];
+        in.mode = data[pos + 2];
+        pos += 3;
+        if (!get32(in.a) || !get32(in.b))
+            return false;
+        bool usesA = in.op != PIPE && in.op != AND_OR;
+        bool usesB = in.op == REDIR || in.op == MODIFIER || in.op == HOST_OPTION || in.op == NEW_HOST ||
+                     in.op == ASSIGN;
+        if ((usesA && in.a >= strings.size()) || (usesB && in.b >= strings.size()))
+            return false;
+
+        switch (in.op) {
+        case ARG:
+            numArgs++;
+            break;
+        case REDIR:
+            if (in.mode > FileRedir::APPEND)
+                return false;
+            break;
+        case MODIFIER:
+        case HOST_OPTION:
+            break;
+        case SIMPLE:
+            if (in.b != numArgs)
+                return false;
+            numArgs = 0;
+            depth++;
+            break;
+        case AND_OR:
+            if (in.mode > AndOrCommand::OR)
+                return false;
+            // fall through
+        case PIPE:
+            if (depth < 2)
+                return false;
+            depth--;
+            break;
+        case NEW_HOST:
+        case ASSIGN:
+            depth++;
+            break;
+        default:
+            return false;
+        }
+        code.push_back(in);
+    }
+    return pos == data.size() && numArgs == 0;
+}
+
+
+
+/**
+ * Returns the path of the compiled form of a script, or an empty string if
+ * there is no cache directory
+ */
+static std::string compiledPath(const std::string& script)
+{
+    std::string dir = cacheDirectory();
+    if (dir.empty())
+        return "";
+    return dir + "/script-" + Md5::hash(script.data(), script.size());
+}
+
+LoadResult loadScript(const std::string& script, std::vector<Command*>& cmds)
+{
+    TraceSpan span("loadScript");
+    std::string path = compiledPath(script);
+
+    if (!path.empty()) {
+        std::ifstream f(path, std::ios::binary);
+        std::stringstream data;
+        data << f.rdbuf();
+        CompiledScript cs;
+        if (f && cs.deserialize(data.str())) {
+            cmds = cs.instantiate();
+            return LOADED;
+        }
+    }
+
+    Parser p;
+    p.parse(script);
+    if (p.hadSyntaxError())
+        return SYNTAX_ERROR;
+    if (!p.isComplete())
+        return UNEXPECTED_EOF;
+    for (Command* c = p.popCommand(); c != nullptr; c = p.popCommand())
+        cmds.push_back(c);
+    if (path.empty())
+        return LOADED;
+
+    // written to a temporary file and renamed, like result cache entries
+    std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+    std::string data = CompiledScript::compile(cmds).serialize();
+    {
+        std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+        f.write(data.data(), data.size());
+        if (!f) {
+            unlink(tmpPath.c_str());
+            return LOADED;
+        }
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        unlink(tmpPath.c_str());
+    return LOADED;
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <cstdint>
+
+class Command;
+
+/**
+ * A parsed script lowered to a flat array of instructions, with every string
+ * stored once in a string table. It can be written to disk and read back, so
+ * running an unchanged script again skips lexing and parsing.
+ *
+ * The instructions are in postfix order and build the commands on a stack:
+ * arguments, redirections and options are collected until the instruction
+ * of the command that takes them, and a pipe or `&&`/`||` takes the two
+ * commands before it. What is left on the stack at the end are the script's commands.
+ */
+class CompiledScript {
+public:
+    /**
+     * Lowers parsed commands. They must come straight from the parser, not
+     * be batched yet.
+     */
+    static CompiledScript compile(const std::vector<Command*>& cmds);
+
+    /**
+     * Builds new commands from the instructions. Ownership is transferred to
+     * the caller.
+     */
+    std::vector<Command*> instantiate() const;
+
+    std::string serialize() const;
+
+    /**
+     * @return false if `data` isn't a compiled script of this version
+     */
+    bool deserialize(const std::string& data);
+
+private:
+    enum Op : uint8_t {
+        ARG,            // a: string
+        REDIR,          // fd, mode, a: host alias, b: path
+        MODIFIER,       // a: name, b: value
+        HOST_OPTION,    // a: name, b: value
+        SIMPLE,         // a: host alias, b: number of arguments
+        PIPE,
+        AND_OR,         // mode: AndOrCommand::Op
+        NEW_HOST,       // a: alias, b: [user@]host[:port]
+        ASSIGN,         // a: variable name, b: value
+    };
+
+    struct Instr {
+        Op op;
+        uint8_t fd;
+        uint8_t mode;
+        uint32_t a;
+        uint32_t b;
+    };
+
+    std::vector<Instr> code;
+    std::vector<std::string> strings;
+    std::unordered_map<std::string, uint32_t> stringIds;    // only while compiling
+
+    uint32_t intern(const std::string& str);
+    void lower(Command* cmd);
+};
+
+enum LoadResult {
+    LOADED,
+    UNEXPECTED_EOF,     // the script ends in the middle of a command
+    SYNTAX_ERROR,       // already reported, there are no commands
+};
+
+/**
+ * Returns the commands of a script, parsing it or, if the same script has
+ * been parsed before, loading it from the cache. Scripts with syntax errors
+ * are not cached. Ownership of the commands is transferred to the caller.
+ */
+LoadResult loadScript(const std::string& script, std::vector<Command*>& cmds);
@@ -2,31 +2,62 @@
 #include "host.hpp"
 #include "process.hpp"
 #include "command.hpp"
+#include "builtins.hpp"
+#include "trace.hpp"
 #include <thread>
 #include <mutex>
 #include <condition_variable>
+#include <algorithm>
+#include <memory>
+#include <unistd.h>
 
-Context::Context()
+Context::Context(unsigned numEvtLoops)
 {
-    evtLoopThread = new std::thread([this] () { evtLoop.run(); });
+    // libssh has to be initialized explicitly before sessions are used from
+    // several threads
+    ssh_init();
+
+    if (numEvtLoops == 0)
+        numEvtLoops = std::max(1u, std::thread::hardware_concurrency());
+
+    for (unsigned i = 0; i < numEvtLoops; i++) {
+        auto loop = new EventLoop();
+        evtLoops.push_back(loop);
+        evtLoopThreads.push_back(new std::thread([loop, i] () {
+            Trace::setThreadName(i == 0 ? "main event loop" : "event loop " + std::to_string(i));
+            loop->run();
+        }));
+    }
+    scheduler = new Scheduler(evtLoops[0]);
 }
 
 Context::~Context()
 {
-    evtLoop.stop();
-    evtLoopThread->join();
+    for (size_t i = 0; i < evtLoops.size(); i++) {
+        evtLoops[i]->stop();
+        evtLoopThreads[i]->join();
+        delete evtLoopThreads[i];
+    }
 
     // TODO: cleanup hosts
+
+    for (auto loop : evtLoops)
+        delete loop;
+    delete scheduler;
+
+    ssh_finalize();
 }
 
 void Context::enqueueCommand(Command* cmd)
 {
-    evtLoop.enqueueTask([this, cmd] () {
+    getEvtLoop()->enqueueTask([this, cmd] () {
         cmdQueue.push_back(cmd);
 
         if (!cmdExecuting)
             execNextCommand();
-    });
+        else if (cmdQueue.size() <= lookahead)
+            cmd->prepare(this);
+    }, "enqueueCommand");
 }
 
 void Context::flushCmdQueue()
@@ -47,48 +78,214 @@ void Context::flushCmdQueue()
     }
 }
 
+void Context::setStdio(int in, int out, int err)
+{
+    getEvtLoop()->runSync([this, in, out, err] () {
+        stdioRedirs = { { in, STDIN_FILENO }, { out, STDOUT_FILENO }, { err, STDERR_FILENO } };
+    });
+}
+
+void Context::releaseHosts()
+{
+    getEvtLoop()->runSync([this] () {
+        for (auto h : hosts) {
+            if (h != nullptr)
+                idleHosts.insert({ h->getInfo().key(), h });
+        }
+        hosts.clear();
+    });
+}
+
+void Context::clearVariables()
+{
+    getEvtLoop()->runSync([this] () { variables.clear(); });
+}
+
+/**
+ * Returns an idle host that can be used for `info`, or nullptr if there is
+ * none. Idle hosts whose connection has dropped are freed.
+ */
+Host* Context::takeIdleHost(const HostInfo& info)
+{
+    auto range = idleHosts.equal_range(info.key());
+    for (auto it = range.first; it != range.second; ) {
+        Host* h = it->second;
+        it = idleHosts.erase(it);
+
+        bool alive = false;
+        h->getEvtLoop()->runSync([h, &alive] () {
+            alive = h->isAlive();
+            if (!alive && h->isReady())
+                h->getEvtLoop()->removeSession(h->getSession());
+        });
+        if (alive)
+            return h;
+
+        // its timers belong to its loop
+        h->getEvtLoop()->enqueueTask([h] () { delete h; }, "delete Host");
+    }
+    return nullptr;
+}
+
 Host* Context::addHost(const std::string& alias, const HostInfo& info)
 {
-    if (hosts.find(alias) != hosts.end()) {
+    HostId id = StringTable::hostAliases().intern(alias);
+    if (findHost(id) != nullptr) {
         throw std::runtime_error("Host with name " + alias + " already exists");
     }
+    if (id >= hosts.size())
+        hosts.resize(id + 1, nullptr);
+
+    Host* idle = takeIdleHost(info);
+    if (idle != nullptr) {
+        hosts[id] = idle;
+        return idle;
+    }
+
+    // connecting runs on the host's loop, and commands for the host wait for
+    // it with whenHostsReady()
+    Host* h = new Host(pickHostLoop(), info, scheduler);
+    hosts[id] = h;
+    h->getEvtLoop()->enqueueTask([h] () { h->startConnect(); }, "Host::startConnect");
+
+    // a host that can't be reached fails its commands, not all of flassh.
+    // This is registered first, so the host is gone by the time any command
+    // waiting for it looks it up.
+    h->whenReady([this, id, h] (const std::string& error) {
+        if (error.empty())
+            return;
+        getEvtLoop()->enqueueTask([this, id, h, error] () {
+            fprintf(stderr, "flassh: %s\n", error.c_str());
+            if (findHost(id) == h)
+                removeHost(id);
+        }, "host failed");
+    });
+    return h;
+}
+
+void Context::removeHost(HostId id)
+{
+    Host* h = findHost(id);
+    if (h == nullptr)
+        return;
+
+    hosts[id] = nullptr;
+    h->getEvtLoop()->enqueueTask([h] () { delete h; }, "delete Host");
+}
+
+void Context::whenHostsReady(const std::vector<HostId>& ids, EventLoop::Task task)
+{
+    std::vector<Host*> pending;
+    for (HostId id : ids) {
+        Host* h = findHost(id);
+        if (h != nullptr && !h->isReady() &&
+            std::find(pending.begin(), pending.end(), h) == pending.end())
+        {
+            pending.push_back(h);
+        }
+    }
+
+    if (pending.empty()) {
+        task();
+        return;
+    }
 
-    Host* h = new Host();
-    h->connect(info);
-    hosts[alias] = h;
-    evtLoop.addSession(h->getSession());
+    // only touched on the main event loop; the task is shared since the
+    // ready callbacks are copied
+    auto left = std::make_shared<size_t>(pending.size());
+    auto shared = std::make_shared<EventLoop::Task>(std::move(task));
+    for (Host* h : pending) {
+        h->whenReady([this, left, shared] (const std::string&) {
+            getEvtLoop()->enqueueTask([left, shared] () {
+                if (--*left == 0)
+                    (*shared)();
+            }, "host ready");
+        });
+    }
+}
+
+bool Context::hostsReady(const std::vector<HostId>& ids) const
+{
+    for (HostId id : ids) {
+        Host* h = findHost(id);
+        if (h != nullptr && !h->isReady())
+            return false;
+    }
+    return true;
+}
+
+Host* Context::getHost(HostId id)
+{
+    Host* h = findHost(id);
+    if (h == nullptr) {
+        throw std::runtime_error("No host with alias " + StringTable::hostAliases().get(id));
+    }
     return h;
 }
 
 Host* Context::getHost(const std::string& alias)
 {
-    auto it = hosts.find(alias);
-    if (it == hosts.end()) {
+    HostId id = StringTable::hostAliases().find(alias);
+    if (id == StringTable::notFound || findHost(id) == nullptr) {
         throw std::runtime_error("No host with alias " + alias);
     }
-    return it->second;
+    return hosts[id];
 }
 
-Process* Context::createPocess(const std::string& hostAlias, const std::vector<std::string>& args, const std::vector<IoRedir>& redirs)
+Process* Context::createPocess(HostId host, const std::vector<StringTable::Id>& args, const std::vector<IoRedir>& redirs)
 {
     Process* p;
 
-    if (hostAlias.empty()) {
-        p = new LocalProcess(args);
+    if (host == localHost) {
+        p = nullptr;
+        if (!args.empty() && isBuiltin(StringTable::args().get(args[0])))
+            p = createBuiltin(this, StringTable::args().get(args));
+        if (p == nullptr)
+            p = new LocalProcess(args);
     }
     else {
-        Host* h = getHost(hostAlias);
-        p = new RemoteProcess(h->getSession(), this, args);
+        Host* h = getHost(host);
+        p = new RemoteProcess(h, this, StringTable::args().get(args));
     }
 
-    // TODO: just pass the vector
-    for (auto& r : redirs) {
-        p->redirectIo(r.oldfd, r.newfd);
+    p->redirectIo(redirs);
+    return p;
+}
+
+Process* Context::createPocess(HostId host, const std::vector<std::string>& args, const std::vector<IoRedir>& redirs)
+{
+    Process* p;
+
+    if (host == localHost) {
+        p = nullptr;
+        if (!args.empty() && isBuiltin(args[0]))
+            p = createBuiltin(this, args);
+        if (p == nullptr)
+            p = new LocalProcess(args);
+    }
+    else {
+        Host* h = getHost(host);
+        p = new RemoteProcess(h, this, args);
     }
 
+    p->redirectIo(redirs);
     return p;
 }
 
+const std::string* Context::getVariable(StringTable::Id name) const
+{
+    if (name >= variables.size() || !variables[name])
+        return nullptr;
+    return &*variables[name];
+}
+
+void Context::setVariable(StringTable::Id name, const std::string& value)
+{
+    if (name >= variables.size())
+        variables.resize(name + 1);
+    variables[name] = value;
+}
+
 void Context::execNextCommand()
 {
     if (cmdQueue.empty())
@@ -98,13 +295,41 @@ void Context::execNextCommand()
     cmdQueue.pop_front();
     cmdExecuting = true;
     Context* ctx = this;    // for clarity
-    cmd->start(this, {}, [ctx, cmd] (int exitStatus) {
+    cmd->start(this, stdioRedirs, [ctx, cmd] (int exitStatus) {
         // this callback could be in any thread, so wrap in enqueueTask
-        ctx->evtLoop.enqueueTask([ctx, cmd, exitStatus] () {
+        ctx->getEvtLoop()->enqueueTask([ctx, cmd, exitStatus] () {
             ctx->cmdExecuting = false;
+            ctx->lastStatus = exitStatus;
             delete cmd;
-            // TODO: set exit status variable `$?`
             ctx->execNextCommand();
-        });
+        }, "command finished");
     });
+
+    // started after the running command, so on a shared event loop its own
+    // channel is opened first
+    prepareQueued();
+}
+
+/**
+ * Prepares the commands that run next, e.g. opens their channels while the
+ * current command runs. They still start in order, one at a time.
+ */
+void Context::prepareQueued()
+{
+    for (size_t i = 0; i < cmdQueue.size() && i < lookahead; i++)
+        cmdQueue[i]->prepare(this);
+}
+
+/**
+ * Assigns a new host to an event loop, round robin. The main loop only gets
+ * hosts if there is no other loop.
+ */
+EventLoop* Context::pickHostLoop()
+{
+    if (evtLoops.size() == 1)
+        return evtLoops[0];
+
+    EventLoop* loop = evtLoops[1 + nextHostLoop % (evtLoops.size() - 1)];
+    ++nextHostLoop;
+    return loop;
 }
@@ -1,24 +1,35 @@
 #pragma once
 
 #include "eventLoop.hpp"
+#include "process.hpp"
+#include "scheduler.hpp"
 #include <map>
 #include <string>
 #include <vector>
 #include <deque>
+#include <atomic>
+#include <optional>
 
 class Host;
 struct HostInfo;
 class Process;
 class Command;
 namespace std { class thread; }
-struct IoRedir;
 
 /**
  * Manages connections, variables, etc
+ *
+ * Runs several event loops, each on its own thread. The main loop runs the
+ * command queue, builtins and local processes, and every host is assigned to
+ * one of the loops, so SSH crypto and channel I/O for many hosts is spread
+ * over all cores. Work is handed between loops with `enqueueTask()`.
  */
 class Context {
 public:
-    Context();
+    /**
+     * @param numEvtLoops  Number of event loop threads, or 0 for one per core
+     */
+    Context(unsigned numEvtLoops = 0);
     ~Context();
 
     /**
@@ -31,23 +42,132 @@ public:
      */
     void flushCmdQueue();
 
-    // the rest of these methods MUST be called on the event loop thread
+    /**
+     * Sets the stdin, stdout and stderr of commands enqueued from now on, in
+     * place of the ones of this process. Must be called while the command
+     * queue is empty.
+     */
+    void setStdio(int in, int out, int err);
+
+    /**
+     * Forgets all host aliases, so the next script can define its own. The
+     * hosts stay connected, and `addHost()` reuses an idle one with the same
+     * `HostInfo::key()` instead of connecting again. Must be called while the
+     * command queue is empty.
+     */
+    void releaseHosts();
+
+    /**
+     * Returns the exit status of the last command that finished, i.e. `$?`
+     */
+    int getLastStatus() const { return lastStatus; }
+
+    /**
+     * Sets `$?`, e.g. to 0 before a new script runs. Must be called while the
+     * command queue is empty.
+     */
+    void setLastStatus(int status) { lastStatus = status; }
+
+    /**
+     * Unsets all variables, so the next script starts without them. Must be
+     * called while the command queue is empty.
+     */
+    void clearVariables();
+
+    // the rest of these methods MUST be called on the main event loop thread
 
+    /**
+     * Defines a host, which connects in the background. Use
+     * `Host::whenReady()` before running anything on it.
+     */
     Host* addHost(const std::string& alias, const HostInfo& info);
+
+    /**
+     * Returns the host with this alias ID. Throws if there is none.
+     */
+    Host* getHost(HostId id);
     Host* getHost(const std::string& alias);
 
-    Process* createPocess(const std::string& hostAlias, const std::vector<std::string>& args, const std::vector<IoRedir>& redirs);
+    /**
+     * Returns the host with this alias ID, or nullptr if there is none
+     */
+    Host* findHost(HostId id) const { return id < hosts.size() ? hosts[id] : nullptr; }
+
+    /**
+     * Forgets a host and frees it. Nothing may be using it anymore.
+     */
+    void removeHost(HostId id);
+
+    /**
+     * Runs `task` on the main event loop once the hosts with these alias IDs
+     * are ready or have failed. IDs of no host are ignored, so the task can
+     * report them.
+     */
+    void whenHostsReady(const std::vector<HostId>& ids, EventLoop::Task task);
+
+    /**
+     * Returns true if none of the hosts with these alias IDs is still
+     * connecting, so `whenHostsReady()` would run its task right away
+     */
+    bool hostsReady(const std::vector<HostId>& ids) const;
+
+    Process* createPocess(HostId host, const std::vector<StringTable::Id>& args, const std::vector<IoRedir>& redirs);
+
+    /**
+     * Creates a process from arguments that aren't interned, e.g. expanded
+     * ones. They must stay valid until the process is deleted.
+     */
+    Process* createPocess(HostId host, const std::vector<std::string>& args, const std::vector<IoRedir>& redirs);
+
+    /**
+     * Returns the value of a variable, or nullptr if it isn't set
+     *
+     * @param name  ID in `StringTable::variables()`
+     */
+    const std::string* getVariable(StringTable::Id name) const;
+    void setVariable(StringTable::Id name, const std::string& value);
+
+    /**
+     * Returns the main event loop
+     */
+    EventLoop* getEvtLoop() { return evtLoops[0]; }
+
+    const std::vector<EventLoop*>& getEvtLoops() const { return evtLoops; }
+
+    /**
+     * Returns the connection and bandwidth limits shared by all hosts. Can be
+     * called from any thread.
+     */
+    Scheduler* getScheduler() { return scheduler; }
+
+    /**
+     * Returns the hosts indexed by alias ID, with nullptr for IDs that aren't
+     * defined
+     */
+    const std::vector<Host*>& getHosts() const { return hosts; }
 
-    EventLoop* getEvtLoop() { return &evtLoop; }
-    
 private:
-    EventLoop evtLoop;
-    std::thread* evtLoopThread;
+    std::vector<EventLoop*> evtLoops;
+    std::vector<std::thread*> evtLoopThreads;
+    size_t nextHostLoop = 0;
+    Scheduler* scheduler;
+
+    // number of queued commands that are prepared while another one runs
+    static constexpr size_t lookahead = 2;
 
     std::deque<Command*> cmdQueue;
     bool cmdExecuting = false;
+    std::atomic<int> lastStatus{0};
+
+    std::vector<Host*> hosts;       // by alias ID
+    std::multimap<std::string, Host*> idleHosts;    // by HostInfo::key()
+    std::vector<IoRedir> stdioRedirs;
 
-    std::map<std::string, Host*> hosts;
+    // by ID in StringTable::variables()
+    std::vector<std::optional<std::string>> variables;
 
     void execNextCommand();
+    void prepareQueued();
+    EventLoop* pickHostLoop();
+    Host* takeIdleHost(const HostInfo& info);
 };
@@ -0,0 +1,273 @@
+#include "daemon.hpp"
+#include "command.hpp"
+#include "batch.hpp"
+#include "compiledScript.hpp"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <cstring>
+#include <cstdlib>
+#include <stdexcept>
+
+// sent by the client with its stdin, stdout, stderr and working directory
+// attached, and followed by the script. The daemon answers with the exit
+// status as an int32_t.
+struct RunRequest {
+    uint32_t magic;
+    uint32_t scriptLen;
+};
+
+static const uint32_t requestMagic = 0x666c6131;    // "fla1"
+static const uint32_t maxScriptLen = 16 << 20;
+
+std::string daemonSocketPath()
+{
+    const char* path = getenv("FLASSH_SOCKET");
+    if (path != nullptr && path[0] != '\0')
+        return path;
+
+    const char* runtimeDir = getenv("XDG_RUNTIME_DIR");
+    if (runtimeDir != nullptr && runtimeDir[0] != '\0')
+        return std::string(runtimeDir) + "/flasshd.sock";
+
+    return "/tmp/flasshd-" + std::to_string(getuid()) + ".sock";
+}
+
+static bool makeAddr(const std::string& path, sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(addr.sun_path))
+        return false;
+    strcpy(addr.sun_path, path.c_str());
+    return true;
+}
+
+static bool writeAll(int fd, const void* buf, size_t len)
+{
+    auto p = (const char*)buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+static bool readAll(int fd, void* buf, size_t len)
+{
+    auto p = (char*)buf;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+
+int runInDaemon(const std::string& socketPath, const std::string& script)
+{
+    sockaddr_un addr;
+    if (!makeAddr(socketPath, addr)) {
+        fprintf(stderr, "flassh: socket path too long: %s\n", socketPath.c_str());
+        return 1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1 || connect(fd, (sockaddr*)&addr, sizeof(addr)) == -1) {
+        fprintf(stderr, "flassh: can't reach flasshd at %s: %s\n", socketPath.c_str(), strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return 1;
+    }
+
+    // attach our stdio and working directory to the request
+    int cwdFd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cwdFd == -1) {
+        fprintf(stderr, "flassh: can't open working directory: %s\n", strerror(errno));
+        close(fd);
+        return 1;
+    }
+    RunRequest req = { requestMagic, (uint32_t)script.size() };
+    int fds[4] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO, cwdFd };
+
+    iovec iov = { &req, sizeof(req) };
+    char control[CMSG_SPACE(sizeof(fds))];
+    memset(control, 0, sizeof(control));
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    int32_t status;
+    if (script.size() > maxScriptLen ||
+        sendmsg(fd, &msg, 0) != sizeof(req) ||
+        !writeAll(fd, script.data(), script.size()) ||
+        !readAll(fd, &status, sizeof(status)))
+    {
+        fprintf(stderr, "flassh: lost connection to flasshd\n");
+        close(cwdFd);
+        close(fd);
+        return 1;
+    }
+
+    close(cwdFd);
+    close(fd);
+    return status;
+}
+
+
+
+DaemonServer::DaemonServer(const std::string& socketPath) : socketPath(socketPath)
+{
+    sockaddr_un addr;
+    if (!makeAddr(socketPath, addr))
+        throw std::runtime_error("socket path too long: " + socketPath);
+
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listenFd == -1)
+        throw std::runtime_error(std::string("socket failed: ") + strerror(errno));
+
+    // a socket file left behind by a daemon that died can be replaced, but
+    // not one that another daemon is still listening on
+    if (connect(listenFd, (sockaddr*)&addr, sizeof(addr)) == 0) {
+        close(listenFd);
+        throw std::runtime_error("flasshd is already running on " + socketPath);
+    }
+    close(listenFd);
+    unlink(socketPath.c_str());
+
+    // only the owner may connect, since clients can run anything as us
+    listenFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    mode_t oldMask = umask(0077);
+    int rc = bind(listenFd, (sockaddr*)&addr, sizeof(addr));
+    umask(oldMask);
+    if (rc == -1 || listen(listenFd, 16) == -1) {
+        std::string err = strerror(errno);
+        close(listenFd);
+        throw std::runtime_error(socketPath + ": " + err);
+    }
+}
+
+DaemonServer::~DaemonServer()
+{
+    close(listenFd);
+    unlink(socketPath.c_str());
+}
+
+void DaemonServer::run()
+{
+    while (!stopped) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd == -1) {
+            if (errno != EINTR)
+                fprintf(stderr, "flasshd: accept failed: %s\n", strerror(errno));
+            continue;
+        }
+
+        serveClient(fd);
+        close(fd);
+    }
+}
+
+void DaemonServer::stop()
+{
+    stopped = 1;
+}
+
+/**
+ * Receives a script and the client's stdio, and runs it to completion
+ */
+void DaemonServer::serveClient(int fd)
+{
+    RunRequest req;
+    int fds[4] = { -1, -1, -1, -1 };
+
+    iovec iov = { &req, sizeof(req) };
+    char control[CMSG_SPACE(sizeof(fds))];
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    if (n == 0)
+        return;     // e.g. another flasshd checking if we're alive
+    cmsghdr* cmsg = n == sizeof(req) ? CMSG_FIRSTHDR(&msg) : nullptr;
+    if (cmsg != nullptr && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+        cmsg->cmsg_len == CMSG_LEN(sizeof(fds)))
+    {
+        memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    }
+
+    std::string script;
+    bool ok = fds[0] != -1 && req.magic == requestMagic && req.scriptLen <= maxScriptLen;
+    if (ok) {
+        script.resize(req.scriptLen);
+        ok = readAll(fd, &script[0], script.size());
+    }
+    if (!ok) {
+        fprintf(stderr, "flasshd: bad request\n");
+        for (int f : fds) {
+            if (f != -1)
+                close(f);
+        }
+        return;
+    }
+    script += "\n";     // newline required to end commands
+
+    int32_t status = 0;
+    ctx.setStdio(fds[0], fds[1], fds[2]);
+    ctx.setLastStatus(0);
+    ctx.clearVariables();
+    try {
+        // only one script runs at a time, so it can have the whole process
+        if (fchdir(fds[3]) == -1)
+            throw std::runtime_error(std::string("can't change directory: ") + strerror(errno));
+
+        std::vector<Command*> cmds;
+        LoadResult loaded = loadScript(script, cmds);
+        if (loaded == LOADED) {
+            for (auto c : batchCommands(cmds))
+                ctx.enqueueCommand(c);
+            ctx.flushCmdQueue();
+            status = ctx.getLastStatus();
+        }
+        else {
+            if (loaded == UNEXPECTED_EOF)
+                dprintf(fds[2], "flassh: Unexpected EOF\n");
+            status = 2;
+        }
+    }
+    catch (std::exception& e) {
+        dprintf(fds[2], "flassh: %s\n", e.what());
+        status = 2;
+    }
+
+    // the aliases belong to this script, the connections are kept
+    ctx.releaseHosts();
+    for (int f : fds)
+        close(f);
+
+    writeAll(fd, &status, sizeof(status));
+}
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "context.hpp"
+#include <string>
+#include <csignal>
+
+/**
+ * flasshd keeps hosts connected between flassh runs. `flassh --daemon`
+ * sends the script over a Unix socket, along with its stdin, stdout, stderr
+ * and working directory, and the daemon runs it with those. Local commands
+ * get the environment of the daemon.
+ * Hosts defined by the script are kept connected afterwards, and a later
+ * script defining a host with the same connection info reuses the session,
+ * so a run only pays for opening channels.
+ *
+ * Scripts are run one at a time, in the order the clients connect.
+ */
+
+/**
+ * Returns the path of the daemon socket: `$FLASSH_SOCKET` if set, otherwise
+ * `flasshd.sock` in `$XDG_RUNTIME_DIR`, or in `/tmp` with the user ID in the
+ * name.
+ */
+std::string daemonSocketPath();
+
+/**
+ * Runs a script in the daemon, with the stdio of this process
+ *
+ * @return The exit status of the script, or 1 if the daemon could not be
+ *         reached
+ */
+int runInDaemon(const std::string& socketPath, const std::string& script);
+
+class DaemonServer {
+public:
+    /**
+     * Starts listening on `socketPath`, replacing a stale socket file
+     */
+    DaemonServer(const std::string& socketPath);
+    ~DaemonServer();
+
+    /**
+     * Serves clients until `stop()` is called
+     */
+    void run();
+
+    /**
+     * Makes `run()` return once the current client is done. Safe to call
+     * from a signal handler.
+     */
+    void stop();
+
+    /**
+     * Returns the limits of the daemon's connections, which must be set
+     * before `run()`
+     */
+    Scheduler* getScheduler() { return ctx.getScheduler(); }
+
+private:
+    std::string socketPath;
+    int listenFd = -1;
+    volatile sig_atomic_t stopped = 0;
+    Context ctx;
+
+    void serveClient(int fd);
+};
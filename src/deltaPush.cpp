@@ -0,0 +1,334 @@
+#include "deltaPush.hpp"
+#include "execChannel.hpp"
+#include "context.hpp"
+#include "host.hpp"
+#include "md5.hpp"
+#include "units.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cstring>
+
+DeltaPushProcess::DeltaPushProcess(Context* ctx, const std::vector<std::string>& args)
+    : ctx(ctx), args(args) {}
+
+DeltaPushProcess::~DeltaPushProcess()
+{
+    delete hashChannel;
+    delete patchChannel;
+
+    if (srcFd != -1)
+        close(srcFd);
+}
+
+void DeltaPushProcess::start(ProcessFinishedCallback onFinish)
+{
+    this->onFinish = onFinish;
+
+    if (!parseArgs()) {
+        printError("usage: push [-v] [-b BLOCK_SIZE] SRC DEST HOST");
+        finish(2);
+        return;
+    }
+
+    srcFd = open(srcPath.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (srcFd == -1 || fstat(srcFd, &st) == -1) {
+        printError(srcPath + ": " + strerror(errno));
+        finish(1);
+        return;
+    }
+    srcSize = st.st_size;
+    numBlocks = (srcSize + blockSize - 1) / blockSize;
+
+    try {
+        host = ctx->getHost(hostAlias);
+    }
+    catch (std::exception& e) {
+        printError(e.what());
+        finish(1);
+        return;
+    }
+
+    host->getEvtLoop()->enqueueTask([this] () { startHashing(); }, "push");
+}
+
+void DeltaPushProcess::startHashing()
+{
+    // hash the remote file one block at a time, printing one line per block
+    std::string cmd =
+        "f=" + shellQuotePath(destPath) + "; "
+        "if [ -f \"$f\" ]; then split -b " + std::to_string(blockSize) + " --filter=md5sum \"$f\"; fi";
+
+    try {
+        hashChannel = new ExecChannel(host, cmd);
+        hashChannel->onData = [this] (const char* data, size_t len, bool isStderr) {
+            bytesReceived += len;
+            if (!isStderr)
+                hashOutput.append(data, len);
+        };
+        hashChannel->onFinish = [this] (int status) {
+            // can't open another channel from inside a libssh callback
+            host->getEvtLoop()->enqueueTask([this, status] () { onHashesReceived(status); }, "push");
+        };
+        hashChannel->exec();
+    }
+    catch (std::exception& e) {
+        printError(e.what());
+        finish(1);
+    }
+}
+
+bool DeltaPushProcess::parseArgs()
+{
+    std::vector<std::string> positional;
+    for (size_t i = 1; i < args.size(); i++) {
+        if (args[i] == "-v") {
+            verbose = true;
+        }
+        else if (args[i] == "-b" && i + 1 < args.size()) {
+            unsigned n;
+            if (!parseCount(args[++i], n) || n == 0)
+                return false;
+            blockSize = n;
+        }
+        else {
+            positional.push_back(args[i]);
+        }
+    }
+
+    if (positional.size() != 3)
+        return false;
+
+    srcPath = positional[0];
+    destPath = positional[1];
+    hostAlias = positional[2];
+    return true;
+}
+
+void DeltaPushProcess::onHashesReceived(int status)
+{
+    delete hashChannel;
+    hashChannel = nullptr;
+
+    if (status != 0) {
+        // most likely no GNU split on the remote host, fall back to sending
+        // everything
+        if (verbose)
+            printError(hostAlias + ": could not hash remote file, sending all blocks");
+        hashOutput.clear();
+    }
+
+    // each line of md5sum output is "<32 hex digits>  -"
+    size_t pos = 0;
+    while (pos < hashOutput.size()) {
+        size_t end = hashOutput.find('\n', pos);
+        if (end == std::string::npos)
+            end = hashOutput.size();
+        remoteHashes.push_back(hashOutput.substr(pos, std::min<size_t>(32, end - pos)));
+        pos = end + 1;
+    }
+    hashOutput.clear();
+
+    compareBlocks();
+}
+
+/**
+ * Hashes the next batch of blocks of the local file, and adds the ones that
+ * differ from `remoteHashes` to `ranges`. Queues itself again until the whole
+ * file is hashed, then starts patching.
+ */
+void DeltaPushProcess::compareBlocks()
+{
+    uint64_t end = std::min<uint64_t>(numBlocks, nextBlock + std::max<size_t>(1, hashBatchSize / blockSize));
+    std::vector<char> buf(blockSize);
+    for (; nextBlock < end; nextBlock++) {
+        size_t len = 0;
+        while (len < blockSize) {
+            ssize_t n = read(srcFd, buf.data() + len, blockSize - len);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0) {
+                printError(srcPath + ": " + strerror(errno));
+                finish(1);
+                return;
+            }
+            if (n == 0)
+                break;
+            len += n;
+        }
+
+        wholeHash.update(buf.data(), len);
+        if (nextBlock < remoteHashes.size() && Md5::hash(buf.data(), len) == remoteHashes[nextBlock])
+            continue;
+
+        // extend the previous run if it ends right before this block
+        ++numChanged;
+        if (!ranges.empty() && ranges.back().first + ranges.back().second == nextBlock)
+            ++ranges.back().second;
+        else
+            ranges.push_back({ nextBlock, 1 });
+    }
+
+    if (nextBlock < numBlocks) {
+        host->getEvtLoop()->enqueueTask([this] () { compareBlocks(); }, "push");
+        return;
+    }
+    fileHash = wholeHash.hexDigest();
+
+    // a longer remote file still has to be truncated
+    if (ranges.empty() && remoteHashes.size() != numBlocks)
+        ranges.push_back({ 0, 0 });
+
+    startPatching();
+}
+
+void DeltaPushProcess::startPatching()
+{
+    if (ranges.empty()) {
+        // identical blocks and block count means identical files
+        onPatchFinished(0);
+        return;
+    }
+
+    // Receive the changed blocks as "<first block> <length>\n" followed by the
+    // data. `read` never consumes more than one line of stdin, and `head -c`
+    // exactly <length> bytes, so the loop always stays in sync.
+    std::string bs = std::to_string(blockSize);
+    std::string cmd =
+        "set -e; "
+        "f=" + shellQuotePath(destPath) + "; t=\"$f.flassh-push\"; "
+        "if [ -f \"$f\" ]; then cp -p \"$f\" \"$t\"; else : > \"$t\"; fi; "
+        "while read -r blk len; do "
+            "head -c \"$len\" | dd of=\"$t\" bs=" + bs + " seek=\"$blk\" conv=notrunc 2>/dev/null; "
+        "done; "
+        "truncate -s " + std::to_string(srcSize) + " \"$t\"; "
+        "if [ \"$(md5sum < \"$t\")\" != \"" + fileHash + "  -\" ]; then "
+            "rm -f \"$t\"; echo \"checksum mismatch, $f not modified\" >&2; exit 1; "
+        "fi; "
+        "mv -f \"$t\" \"$f\"";
+
+    int errFd = getRedirectedFd(STDERR_FILENO);
+    try {
+        patchChannel = new ExecChannel(host, cmd);
+        patchChannel->onData = [this, errFd] (const char* data, size_t len, bool isStderr) {
+            bytesReceived += len;
+            write(errFd, data, len);
+        };
+        patchChannel->onWritable = [this] () { sendBlocks(); };
+        patchChannel->onFinish = [this] (int status) {
+            // the channel is deleted in finish(), which can't happen inside
+            // its own callback
+            host->getEvtLoop()->enqueueTask([this, status] () { onPatchFinished(status); }, "push");
+        };
+        patchChannel->exec();
+    }
+    catch (std::exception& e) {
+        printError(e.what());
+        finish(1);
+        return;
+    }
+
+    sendBlocks();
+}
+
+/**
+ * Writes changed blocks to the patch channel until its window is full
+ */
+void DeltaPushProcess::sendBlocks()
+{
+    while (true) {
+        if (pendingPos == pending.size() && !nextPiece()) {
+            if (!eofSent) {
+                patchChannel->sendEof();
+                eofSent = true;
+            }
+            return;
+        }
+
+        size_t len = patchChannel->write(pending.data() + pendingPos, pending.size() - pendingPos);
+        if (len == 0)
+            return;
+
+        pendingPos += len;
+        bytesSent += len;
+    }
+}
+
+/**
+ * Loads the next header or piece of block data into `pending`. Returns false
+ * once everything has been sent.
+ */
+bool DeltaPushProcess::nextPiece()
+{
+    pending.clear();
+    pendingPos = 0;
+    if (nextRange == ranges.size())
+        return false;
+
+    auto& r = ranges[nextRange];
+    uint64_t start = r.first * blockSize;
+    uint64_t len = std::min<uint64_t>(r.second * blockSize, srcSize - std::min(start, srcSize));
+    if (rangeSent == 0)
+        pending = std::to_string(r.first) + " " + std::to_string(len) + "\n";
+
+    size_t n = std::min<uint64_t>(len - rangeSent, pieceSize);
+    size_t hdrLen = pending.size();
+    pending.resize(hdrLen + n);
+    size_t got = 0;
+    while (got < n) {
+        ssize_t rc = pread(srcFd, &pending[hdrLen + got], n - got, start + rangeSent + got);
+        if (rc < 0 && errno == EINTR)
+            continue;
+        if (rc <= 0) {
+            // the remote checksum will fail and leave the file untouched
+            printError(srcPath + ": read failed");
+            pending.resize(hdrLen + got);
+            nextRange = ranges.size();
+            return !pending.empty();
+        }
+        got += rc;
+    }
+
+    rangeSent += n;
+    if (rangeSent == len) {
+        ++nextRange;
+        rangeSent = 0;
+    }
+    return true;
+}
+
+void DeltaPushProcess::onPatchFinished(int status)
+{
+    if (verbose) {
+        printError(hostAlias + ": sent " + std::to_string(bytesSent) + " bytes for " +
+                   std::to_string(numChanged) + " of " + std::to_string(numBlocks) +
+                   " blocks, received " + std::to_string(bytesReceived) + " bytes (file is " +
+                   std::to_string(srcSize) + " bytes)");
+    }
+    finish(status == 0 ? 0 : 1);
+}
+
+void DeltaPushProcess::finish(int status)
+{
+    // the channels belong to the host's event loop, so they can't wait for
+    // the destructor
+    delete hashChannel;
+    hashChannel = nullptr;
+    delete patchChannel;
+    patchChannel = nullptr;
+
+    if (srcFd != -1) {
+        close(srcFd);
+        srcFd = -1;
+    }
+
+    if (onFinish)
+        onFinish(status);
+}
+
+void DeltaPushProcess::printError(const std::string& msg)
+{
+    std::string line = "push: " + msg + "\n";
+    write(getRedirectedFd(STDERR_FILENO), line.data(), line.size());
+}
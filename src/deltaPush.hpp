@@ -0,0 +1,96 @@
+#pragma once
+
+#include "process.hpp"
+#include "md5.hpp"
+#include <cstdint>
+#include <utility>
+
+class ExecChannel;
+class Host;
+
+/**
+ * Builtin `push [-v] [-b BLOCK_SIZE] SRC DEST HOST`
+ *
+ * Copies the local file SRC to DEST on HOST, sending only the blocks that
+ * differ from what is already there:
+ *
+ *  1. The remote host hashes DEST block by block with `split` and `md5sum`
+ *  2. Blocks whose hash differs from the local block are sent to a small
+ *     remote shell loop, which patches them into a copy of DEST with `dd`
+ *  3. The copy is truncated, checked against the MD5 of the whole local
+ *     file, and moved over DEST
+ *
+ * Blocks are compared at the same offsets, so this works best for files that
+ * are modified in place (binaries, databases, configs that keep their size).
+ * Requires GNU coreutils on the remote host; if the hashes can't be computed
+ * the whole file is sent.
+ *
+ * After the arguments are checked, everything runs on the event loop of the
+ * host.
+ */
+class DeltaPushProcess : public Process {
+public:
+    DeltaPushProcess(Context* ctx, const std::vector<std::string>& args);
+    ~DeltaPushProcess();
+
+    void start(ProcessFinishedCallback onFinish);
+
+    static constexpr size_t defaultBlockSize = 64 * 1024;
+    static constexpr size_t pieceSize = 1 << 20;
+    static constexpr size_t hashBatchSize = 1 << 20;
+
+private:
+    Context* ctx;
+    std::vector<std::string> args;
+    ProcessFinishedCallback onFinish;
+
+    // options
+    bool verbose = false;
+    size_t blockSize = defaultBlockSize;
+    std::string srcPath;
+    std::string destPath;
+    std::string hostAlias;
+    Host* host = nullptr;
+
+    int srcFd = -1;
+    uint64_t srcSize = 0;
+    uint64_t numBlocks = 0;
+
+    ExecChannel* hashChannel = nullptr;
+    ExecChannel* patchChannel = nullptr;
+    std::string hashOutput;
+    std::vector<std::string> remoteHashes;
+
+    // the local file is hashed in batches of about `hashBatchSize` bytes, one
+    // task each, so the event loop isn't blocked for the whole file
+    uint64_t nextBlock = 0;
+    Md5 wholeHash;
+
+    // runs of changed blocks as (first block, number of blocks)
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    uint64_t numChanged = 0;
+    std::string fileHash;
+
+    // state for sending the changed blocks
+    size_t nextRange = 0;
+    uint64_t rangeSent = 0;
+    std::string pending;
+    size_t pendingPos = 0;
+    bool eofSent = false;
+
+    // statistics for -v
+    uint64_t bytesSent = 0;
+    uint64_t bytesReceived = 0;
+
+    bool parseArgs();
+    void startHashing();
+    void onHashesReceived(int status);
+    void compareBlocks();
+    void startPatching();
+    void sendBlocks();
+    bool nextPiece();
+    void onPatchFinished(int status);
+    void finish(int status);
+
+    void printError(const std::string& msg);
+};
@@ -1,9 +1,14 @@
 #include "eventLoop.hpp"
+#include "stallDetector.hpp"
 #include <poll.h>
+#include <climits>
 #include <fcntl.h>
 #include <stdexcept>
+#include <condition_variable>
 
-EventLoop::EventLoop()
+static thread_local EventLoop* currentLoop = nullptr;
+
+EventLoop::EventLoop() : timers(monotonicUs() / 1000)
 {
     if (pipe2(pipefd, O_CLOEXEC) != 0) {
         throw std::runtime_error("pipe() failed");
@@ -23,9 +28,13 @@ EventLoop::~EventLoop()
 
 void EventLoop::run()
 {
+    threadId = std::this_thread::get_id();
+    currentLoop = this;
     exit = false;
     while (!exit) {
-        ssh_event_dopoll(evt, -1);
+        ssh_event_dopoll(evt, pollTimeout());
+        stats.wakeups.add();
+        runTimers();
     }
 }
 
@@ -44,26 +53,131 @@ void EventLoop::removeSession(ssh_session session)
     ssh_event_remove_session(evt, session);
 }
 
-void EventLoop::addFdRead(int fd, ssh_event_callback callback, void* user)
+void EventLoop::addFdRead(int fd, ssh_event_callback callback, void* user, const char* origin)
 {
-    ssh_event_add_fd(evt, fd, POLLIN, callback, user);
+    addFd(fd, POLLIN, callback, user, origin);
 }
 
 void EventLoop::removeFdRead(int fd)
+{
+    removeFd(fd);
+}
+
+void EventLoop::addFdWrite(int fd, ssh_event_callback callback, void* user, const char* origin)
+{
+    addFd(fd, POLLOUT, callback, user, origin);
+}
+
+void EventLoop::removeFdWrite(int fd)
+{
+    removeFd(fd);
+}
+
+void EventLoop::addFd(int fd, short events, ssh_event_callback callback, void* user, const char* origin)
+{
+    // map nodes don't move, so the handler can be passed as userdata
+    auto& h = fdHandlers[fd];
+    h = { callback, user, origin };
+    ssh_event_add_fd(evt, fd, events, &EventLoop::onFdEvent, &h);
+}
+
+void EventLoop::removeFd(int fd)
 {
     ssh_event_remove_fd(evt, fd);
+    fdHandlers.erase(fd);
+}
+
+EventLoop* EventLoop::current()
+{
+    return currentLoop;
 }
 
-void EventLoop::enqueueTask(EventLoop::Task t)
+void EventLoop::enqueueTask(EventLoop::Task t, const char* origin)
 {
     std::lock_guard lck(taskQueueMtx);
-    taskQueue.push_back(t);
+    taskQueue.push_back({ std::move(t), origin });
+    stats.maxQueueDepth.max(taskQueue.size());
 
     // interrupt the event loop
     char c = 0;
     write(pipefd[1], &c, 1);
 }
 
+void EventLoop::runSync(EventLoop::Task t)
+{
+    if (isLoopThread()) {
+        t();
+        return;
+    }
+
+    std::mutex mtx;
+    std::unique_lock lck(mtx);
+    std::condition_variable cv;
+    bool done = false;
+    std::exception_ptr error;
+
+    enqueueTask([&] () {
+        try {
+            t();
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+
+        std::lock_guard lg(mtx);
+        done = true;
+        cv.notify_all();
+    }, "runSync");
+
+    while (!done) {
+        cv.wait(lck);
+    }
+
+    if (error)
+        std::rethrow_exception(error);
+}
+
+EventLoop::TimerId EventLoop::addTimer(uint64_t delayUs, Task task, const char* origin)
+{
+    uint64_t expiry = (monotonicUs() + delayUs + 999) / 1000;
+    return timers.add(expiry, std::move(task), origin);
+}
+
+void EventLoop::cancelTimer(TimerId id)
+{
+    timers.cancel(id);
+}
+
+/**
+ * Returns how many milliseconds poll() may wait before a timer is due, or -1
+ * if there are none
+ */
+int EventLoop::pollTimeout() const
+{
+    uint64_t next = timers.nextExpiry();
+    if (next == UINT64_MAX)
+        return -1;
+
+    uint64_t now = monotonicUs() / 1000;
+    if (next <= now)
+        return 0;
+    return next - now < INT_MAX ? next - now : INT_MAX;
+}
+
+void EventLoop::runTimers()
+{
+    uint64_t now = monotonicUs() / 1000;
+    Task task;
+    const char* origin;
+    while (timers.popExpired(now, task, origin)) {
+        {
+            StallTimer timer(origin);
+            task();
+        }
+        stats.tasksRun.add();
+    }
+}
+
 int EventLoop::onPollFd(socket_t fd, int revents, void* userdata)
 {
     // clear pipe
@@ -76,14 +190,29 @@ int EventLoop::onPollFd(socket_t fd, int revents, void* userdata)
     return SSH_OK;  // ???
 }
 
+int EventLoop::onFdEvent(socket_t fd, int revents, void* userdata)
+{
+    // the callback may remove the handler, so copy it first
+    FdHandler h = *(FdHandler*)userdata;
+    StallTimer timer(h.origin);
+    return h.callback(fd, revents, h.user);
+}
+
 void EventLoop::runTasks()
 {
-    std::unique_lock lck(taskQueueMtx);
-    while (!taskQueue.empty()) {
-        auto tsk = taskQueue.front();
-        taskQueue.pop_front();
-        lck.unlock();
-        tsk();
-        lck.lock();
+    // tasks queued from here on run after the next poll, so a task that
+    // requeues itself to split up long work doesn't hold up I/O
+    std::deque<QueuedTask> tasks;
+    {
+        std::lock_guard lck(taskQueueMtx);
+        tasks.swap(taskQueue);
+    }
+
+    for (auto& tsk : tasks) {
+        {
+            StallTimer timer(tsk.origin);
+            tsk.task();
+        }
+        stats.tasksRun.add();
     }
 }
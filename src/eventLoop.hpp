@@ -2,8 +2,13 @@
 
 #include <functional>
 #include <libssh/libssh.h>
+#include "stats.hpp"
+#include "smallFunction.hpp"
+#include "timerWheel.hpp"
 #include <mutex>
 #include <deque>
+#include <map>
+#include <thread>
 
 /**
  * Wrapper around the libssh event loop to make asynchronous stuff easier.
@@ -19,31 +24,108 @@ public:
     void addSession(ssh_session session);
     void removeSession(ssh_session session);
 
-    void addFdRead(int fd, ssh_event_callback callback, void* user);
+    /**
+     * Calls `callback` when the FD becomes readable/writable. `origin` names
+     * the callback in stall reports and must be a string literal.
+     */
+    void addFdRead(int fd, ssh_event_callback callback, void* user, const char* origin = "fd callback");
     void removeFdRead(int fd);
 
+    void addFdWrite(int fd, ssh_event_callback callback, void* user, const char* origin = "fd callback");
+    void removeFdWrite(int fd);
+
+    /**
+     * Calls `callback` when the FD has any of the poll `events`, for FDs that
+     * wait for both directions at once. `removeFd()` stops watching it.
+     */
+    void addFd(int fd, short events, ssh_event_callback callback, void* user, const char* origin = "fd callback");
+    void removeFd(int fd);
+
+    /**
+     * A task that should be run on the event loop thread. Tasks that capture
+     * little are queued without allocating.
+     */
+    typedef SmallFunction<void()> Task;
+
+    /**
+     * Executes the task on the event loop thread. `origin` names the task in
+     * stall reports and must be a string literal.
+     */
+    void enqueueTask(Task t, const char* origin = "task");
+
+    /**
+     * Executes the task on the event loop thread and waits for it to finish.
+     * Exceptions thrown by the task are rethrown in the calling thread. Runs
+     * the task directly if called on the event loop thread.
+     *
+     * Must never be called from a task on another event loop that this one
+     * might be waiting for, or the two will deadlock.
+     */
+    void runSync(Task t);
+
+    typedef TimerWheel::TimerId TimerId;
+
     /**
-     * A task that should be run on the event loop thread
+     * Runs `task` on the event loop thread once `delayUs` microseconds have
+     * passed, rounded up to the millisecond. Must be called on the event loop
+     * thread, like `cancelTimer()`.
+     * `origin` names the task in stall reports and must be a string literal.
+     *
+     * @return an ID for `cancelTimer()`, never 0
      */
-    typedef std::function<void()> Task;
+    TimerId addTimer(uint64_t delayUs, Task task, const char* origin = "timer");
 
     /**
-     * Executes the task on the event loop thread
+     * Stops a timer from firing. Does nothing if it already has, or for 0.
      */
-    void enqueueTask(Task t);
+    void cancelTimer(TimerId id);
+
+    /**
+     * Returns true if called on the thread running this event loop
+     */
+    bool isLoopThread() const { return std::this_thread::get_id() == threadId; }
+
+    /**
+     * Returns the event loop running on the calling thread, if any
+     */
+    static EventLoop* current();
+
+    EvtLoopStats& getStats() { return stats; }
 
 private:
     ssh_event evt;
     bool exit = true;
+    std::thread::id threadId;
+    EvtLoopStats stats;
 
-    std::deque<Task> taskQueue;
+    struct QueuedTask {
+        Task task;
+        const char* origin;
+    };
+
+    std::deque<QueuedTask> taskQueue;
     std::mutex taskQueueMtx;
 
     // pipe used to interrupt the event loop when we get a new task
     int pipefd[2];
 
+    // ticks are milliseconds of monotonicUs(), and poll() waits until the
+    // next one is due
+    TimerWheel timers;
+
+    // FD callbacks go through onFdEvent(), so they can be timed
+    struct FdHandler {
+        ssh_event_callback callback;
+        void* user;
+        const char* origin;
+    };
+    std::map<int, FdHandler> fdHandlers;
+
     static int onPollFd(socket_t fd, int revents, void* userdata);
+    static int onFdEvent(socket_t fd, int revents, void* userdata);
+    int pollTimeout() const;
+    void runTimers();
 
-    // runs all queued tasks
+    // runs the tasks that are queued when it is called
     void runTasks();
 };
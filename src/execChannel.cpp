@@ -0,0 +1,168 @@
+#include "execChannel.hpp"
+#include "host.hpp"
+#include "eventLoop.hpp"
+#include "stallDetector.hpp"
+#include <stdexcept>
+#include <cstring>
+
+std::string shellQuote(const std::string& str)
+{
+    // inside single quotes everything is literal, except the single quote
+    // itself, which has to be written as '\''
+    std::string ret = "'";
+    for (char c : str) {
+        if (c == '\'')
+            ret += "'\\''";
+        else
+            ret.push_back(c);
+    }
+    ret += "'";
+    return ret;
+}
+
+std::string shellQuotePath(const std::string& path)
+{
+    if (path.compare(0, 2, "~/") == 0)
+        return "~/" + shellQuote(path.substr(2));
+    return shellQuote(path);
+}
+
+
+
+ExecChannel::ExecChannel(Host* host, const std::string& cmd)
+    : host(host), session(host->getSession()), cmd(cmd)
+{
+    channel = ssh_channel_new(session);
+    if (channel == nullptr) {
+        throw std::runtime_error(ssh_get_error(session));
+    }
+
+    int rc = ssh_channel_open_session(channel);
+    if (rc != SSH_OK) {
+        ssh_channel_free(channel);
+        channel = nullptr;
+        throw std::runtime_error(ssh_get_error(session));
+    }
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.userdata = this;
+    callbacks.channel_data_function = staticOnData;
+    callbacks.channel_write_wontblock_function = staticOnWriteWontBlock;
+    callbacks.channel_exit_status_function = staticOnExitStatus;
+    callbacks.channel_close_function = staticOnClose;
+    ssh_callbacks_init(&callbacks);
+
+    if (SSH_OK != ssh_set_channel_callbacks(channel, &callbacks)) {
+        ssh_channel_close(channel);
+        ssh_channel_free(channel);
+        channel = nullptr;
+        throw std::runtime_error(ssh_get_error(session));
+    }
+    host->reserveChannelSlot();
+}
+
+ExecChannel::~ExecChannel()
+{
+    host->getEvtLoop()->cancelTimer(writableTimer);
+    if (channel != nullptr)
+        freeChannel();
+}
+
+void ExecChannel::freeChannel()
+{
+    ssh_set_blocking(session, 0);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    channel = nullptr;
+    ssh_set_blocking(session, 1);
+    host->releaseChannelSlot();
+}
+
+void ExecChannel::exec()
+{
+    int rc = ssh_channel_request_exec(channel, cmd.c_str());
+    if (rc != SSH_OK) {
+        throw std::runtime_error("ssh_channel_request_exec failed");
+    }
+}
+
+size_t ExecChannel::write(const void* data, size_t len)
+{
+    if (channel == nullptr)
+        return 0;
+
+    size_t window = ssh_channel_window_size(channel);
+    if (len > window)
+        len = window;
+    if (len == 0)
+        return 0;
+
+    // the scheduler calls back once the limit allows more
+    TokenBucket& up = host->getScheduler()->upload();
+    size_t allowed = up.take(len);
+    if (allowed < len && writableTimer == 0) {
+        writableTimer = host->getEvtLoop()->addTimer(up.delayUs(len - allowed), [this] () {
+            writableTimer = 0;
+            if (onWritable)
+                onWritable();
+        }, "ExecChannel upload limit");
+    }
+    len = allowed;
+    if (len == 0)
+        return 0;
+
+    // in non-blocking mode libssh queues the data and lets the event loop
+    // flush the socket, so a slow host can't hold up everyone else
+    ssh_set_blocking(session, 0);
+    int rc = ssh_channel_write(channel, data, len);
+    ssh_set_blocking(session, 1);
+
+    size_t written = rc < 0 ? 0 : rc;
+    up.giveBack(len - written);
+    return written;
+}
+
+void ExecChannel::sendEof()
+{
+    if (channel != nullptr)
+        ssh_channel_send_eof(channel);
+}
+
+int ExecChannel::staticOnData(ssh_session session, ssh_channel channel, void* data, uint32_t len, int is_stderr, void* userdata)
+{
+    auto pThis = (ExecChannel*)userdata;
+    StallTimer timer("ExecChannel::onData", &pThis->cmd);
+    if (pThis->onData)
+        pThis->onData((const char*)data, len, is_stderr);
+    return len;
+}
+
+int ExecChannel::staticOnWriteWontBlock(ssh_session session, ssh_channel channel, size_t bytes, void* userdata)
+{
+    auto pThis = (ExecChannel*)userdata;
+    StallTimer timer("ExecChannel::onWritable", &pThis->cmd);
+    if (pThis->onWritable && bytes > 0)
+        pThis->onWritable();
+    return 0;
+}
+
+void ExecChannel::staticOnExitStatus(ssh_session session, ssh_channel channel, int status, void* userdata)
+{
+    // wait until onClose() to report it, more data may still arrive
+    ((ExecChannel*)userdata)->exitStatus = status;
+}
+
+void ExecChannel::staticOnClose(ssh_session session, ssh_channel channel, void* userdata)
+{
+    StallTimer timer("ExecChannel::onClose");
+    auto pThis = (ExecChannel*)userdata;
+
+    // cleanup channel
+    pThis->host->getEvtLoop()->cancelTimer(pThis->writableTimer);
+    pThis->writableTimer = 0;
+    pThis->freeChannel();
+
+    pThis->finished = true;
+    if (pThis->onFinish)
+        pThis->onFinish(pThis->exitStatus);
+}
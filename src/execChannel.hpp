@@ -0,0 +1,98 @@
+#pragma once
+
+#include <libssh/libssh.h>
+#include <libssh/callbacks.h>
+#include <string>
+#include <functional>
+
+class Host;
+
+/**
+ * Quotes a string so that a POSIX shell will treat it as a single word
+ */
+std::string shellQuote(const std::string& str);
+
+/**
+ * Like shellQuote(), but leaves a leading `~/` unquoted so the remote shell
+ * still expands it to the home directory
+ */
+std::string shellQuotePath(const std::string& path);
+
+/**
+ * Runs a command on a remote host over its own channel. Unlike
+ * RemoteProcess, no local file descriptors are attached: data is handed to
+ * and taken from the owner directly, which is useful for builtins that
+ * generate or consume the data themselves.
+ *
+ * The channel counts towards the host's `max_channels`, but doesn't wait for
+ * a slot. Writes are held to the scheduler's upload limit.
+ *
+ * All methods, including the constructor and destructor, must be called on
+ * the event loop thread that the session belongs to.
+ */
+class ExecChannel {
+public:
+    /**
+     * Opens a new channel on the host's session. Throws on failure.
+     */
+    ExecChannel(Host* host, const std::string& cmd);
+    ~ExecChannel();
+
+    ExecChannel(const ExecChannel&) = delete;
+    ExecChannel& operator=(const ExecChannel&) = delete;
+
+    /**
+     * Called when data is received on the remote stdout or stderr
+     */
+    std::function<void(const char* data, size_t len, bool isStderr)> onData;
+
+    /**
+     * Called when the remote window grows or the upload limit allows more,
+     * i.e. when `write()` can accept more data
+     */
+    std::function<void()> onWritable;
+
+    /**
+     * Called after the channel has been closed, with the exit status of the
+     * remote command. The channel must not be deleted from this callback.
+     */
+    std::function<void(int exitStatus)> onFinish;
+
+    /**
+     * Runs the command
+     */
+    void exec();
+
+    /**
+     * Writes up to `len` bytes to the remote stdin without blocking.
+     *
+     * @return the number of bytes written, which may be 0 if the remote
+     *         window is full or the upload limit is reached
+     */
+    size_t write(const void* data, size_t len);
+
+    /**
+     * Closes the remote stdin
+     */
+    void sendEof();
+
+    bool isFinished() const { return finished; }
+
+private:
+    Host* host;
+    ssh_session session = nullptr;
+    ssh_channel channel = nullptr;
+    std::string cmd;
+    ssh_channel_callbacks_struct callbacks;
+
+    int exitStatus = 1;
+    bool finished = false;
+    uint64_t writableTimer = 0;    // while the upload limit holds back data
+
+    void freeChannel();
+
+    static int staticOnData(ssh_session session, ssh_channel channel, void* data, uint32_t len, int is_stderr, void* userdata);
+    static int staticOnWriteWontBlock(ssh_session session, ssh_channel channel, size_t bytes, void* userdata);
+    static void staticOnExitStatus(ssh_session session, ssh_channel channel, int status, void* userdata);
+    static void staticOnClose(ssh_session session, ssh_channel channel, void* userdata);
+};
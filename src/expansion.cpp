@@ -0,0 +1,282 @@
+#include "expansion.hpp"
+#include "context.hpp"
+#include "command.hpp"
+#include "parser/parser.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <cstdlib>
+
+using Expansion::mark;
+
+namespace {
+
+/**
+ * Runs the command substitutions of some words one after another, then puts
+ * their output and the values of variables into the words. Lives on the main
+ * event loop, and deletes itself when done.
+ */
+class Expander {
+public:
+    Expander(Context* c, const std::vector<std::string>& words, const std::vector<IoRedir>& redirs,
+             Expansion::ExpandedCallback done);
+
+    void runNext();
+
+private:
+    Context* c;
+    std::vector<std::string> words;
+    std::vector<IoRedir> redirs;
+    Expansion::ExpandedCallback done;
+    int lastStatus;                             // `$?` before any substitution
+
+    std::vector<std::string> substitutions;     // commands, in order
+    std::vector<std::string> outputs;           // of the ones that ran
+    std::vector<int> statuses;
+
+    // the substitution that is running
+    std::vector<Command*> cmds;
+    size_t nextCmd = 0;
+    int cmdStatus = 0;
+    bool cmdsDone = false;
+    std::string output;
+    Process* proc = nullptr;
+    std::vector<IoRedir> pipeRedirs;
+    int readFd = -1;
+    int writeFd = -1;
+
+    void runCaptured(SimpleCommand* cmd);
+    void runPiped();
+    void startNextCmd();
+    void tryFinishPiped();
+    void substitutionDone(int status);
+    void finish();
+    std::string lookup(const std::string& name, int status) const;
+
+    static int onPipeReadable(int fd, int revents, void* userdata);
+};
+
+Expander::Expander(Context* c, const std::vector<std::string>& words, const std::vector<IoRedir>& redirs,
+                   Expansion::ExpandedCallback done)
+    : c(c), words(words), redirs(redirs), done(done), lastStatus(c->getLastStatus())
+{
+    for (auto& w : words) {
+        for (size_t i = w.find(mark); i != std::string::npos; i = w.find(mark, i + 1)) {
+            size_t end = w.find(mark, i + 1);
+            if (end == std::string::npos)
+                break;
+            if (w[i + 1] == '(')
+                substitutions.push_back(w.substr(i + 2, end - i - 2));
+            i = end;
+        }
+    }
+}
+
+/**
+ * Starts the next substitution, or expands the words if there is none left
+ */
+void Expander::runNext()
+{
+    if (outputs.size() == substitutions.size()) {
+        finish();
+        return;
+    }
+
+    // a substitution is a small script of its own
+    try {
+        Parser p;
+        p.parse(substitutions[outputs.size()] + "\n");
+        for (Command* cmd = p.popCommand(); cmd != nullptr; cmd = p.popCommand())
+            cmds.push_back(cmd);
+        if (!p.isComplete() || p.hadSyntaxError())
+            throw std::runtime_error("bad substitution: $(" + substitutions[outputs.size()] + ")");
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "flassh: %s\n", e.what());
+        substitutionDone(2);
+        return;
+    }
+
+    // a single plain remote command is the common case, its output is
+    // collected from the channel without a pipe
+    auto simple = cmds.size() == 1 ? dynamic_cast<SimpleCommand*>(cmds[0]) : nullptr;
+    if (simple != nullptr && simple->getHost() != localHost && simple->getFileRedirs().empty() &&
+        simple->getModifiers().options().empty() && !simple->hasExpansions())
+        runCaptured(simple);
+    else
+        runPiped();
+}
+
+void Expander::runCaptured(SimpleCommand* cmd)
+{
+    c->whenHostsReady({ cmd->getHost() }, [this, cmd] () {
+        try {
+            proc = c->createPocess(cmd->getHost(), cmd->getArgs(), redirs);
+        }
+        catch (std::exception& e) {
+            fprintf(stderr, "flassh: %s\n", e.what());
+            substitutionDone(1);
+            return;
+        }
+
+        proc->captureStdout(&output, false);
+        proc->start([this] (int status) {
+            // this callback could be in any thread
+            c->getEvtLoop()->enqueueTask([this, status] () {
+                delete proc;
+                proc = nullptr;
+                substitutionDone(status);
+            }, "substitution finished");
+        });
+    });
+}
+
+/**
+ * Runs the commands of a substitution with their stdout going into a pipe,
+ * which is read on the main event loop
+ */
+void Expander::runPiped()
+{
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) {
+        fprintf(stderr, "flassh: pipe2 failed: %s\n", strerror(errno));
+        substitutionDone(1);
+        return;
+    }
+    readFd = fds[0];
+    writeFd = fds[1];
+    fcntl(readFd, F_SETFL, fcntl(readFd, F_GETFL) | O_NONBLOCK);
+    c->getEvtLoop()->addFdRead(readFd, &Expander::onPipeReadable, this, "command substitution");
+
+    pipeRedirs = redirs;
+    pipeRedirs.push_back({ writeFd, STDOUT_FILENO });
+    nextCmd = 0;
+    cmdsDone = false;
+    cmdStatus = 0;
+    startNextCmd();
+}
+
+void Expander::startNextCmd()
+{
+    if (nextCmd == cmds.size()) {
+        // the commands' copies are closed by now, so this lets the reader
+        // see EOF
+        close(writeFd);
+        writeFd = -1;
+        cmdsDone = true;
+        tryFinishPiped();
+        return;
+    }
+
+    cmds[nextCmd++]->start(c, pipeRedirs, [this] (int status) {
+        c->getEvtLoop()->enqueueTask([this, status] () {
+            cmdStatus = status;
+            c->setLastStatus(status);
+            startNextCmd();
+        }, "substitution command finished");
+    });
+}
+
+void Expander::tryFinishPiped()
+{
+    if (cmdsDone && readFd == -1)
+        substitutionDone(cmdStatus);
+}
+
+int Expander::onPipeReadable(int fd, int revents, void* userdata)
+{
+    auto self = static_cast<Expander*>(userdata);
+    char buf[65536];
+    ssize_t n;
+    while ((n = read(fd, buf, sizeof(buf))) > 0)
+        self->output.append(buf, n);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return 0;
+
+    // EOF or an error
+    self->c->getEvtLoop()->removeFdRead(fd);
+    close(fd);
+    self->readFd = -1;
+    self->tryFinishPiped();
+    return 0;
+}
+
+void Expander::substitutionDone(int status)
+{
+    for (auto cmd : cmds)
+        delete cmd;
+    cmds.clear();
+
+    while (!output.empty() && output.back() == '\n')
+        output.pop_back();
+    outputs.push_back(std::move(output));
+    output.clear();
+    statuses.push_back(status);
+    runNext();
+}
+
+/**
+ * Returns the value of a variable
+ *
+ * @param status  The value of `$?` at this point
+ */
+std::string Expander::lookup(const std::string& name, int status) const
+{
+    if (name == "?")
+        return std::to_string(status);
+
+    StringTable::Id id = StringTable::variables().find(name);
+    if (id != StringTable::notFound) {
+        if (auto value = c->getVariable(id))
+            return *value;
+    }
+
+    const char* env = getenv(name.c_str());
+    return env != nullptr ? env : "";
+}
+
+void Expander::finish()
+{
+    // like in a shell, `$?` after a substitution is the substitution's status
+    size_t sub = 0;
+    int status = lastStatus;
+    for (auto& w : words) {
+        if (!Expansion::hasExpansions(w))
+            continue;
+
+        std::string expanded;
+        for (size_t i = 0; i < w.size(); i++) {
+            size_t end = w[i] == mark ? w.find(mark, i + 1) : std::string::npos;
+            if (end == std::string::npos) {
+                expanded.push_back(w[i]);
+                continue;
+            }
+            if (w[i + 1] == '(') {
+                status = statuses[sub];
+                expanded += outputs[sub++];
+            }
+            else {
+                expanded += lookup(w.substr(i + 2, end - i - 2), status);
+            }
+            i = end;
+        }
+        w = std::move(expanded);
+    }
+
+    auto cb = std::move(done);
+    auto expandedWords = std::move(words);
+    int subStatus = statuses.empty() ? -1 : statuses.back();
+    delete this;
+    cb(expandedWords, subStatus);
+}
+
+}   // namespace
+
+
+
+void Expansion::expand(Context* c, const std::vector<std::string>& words, const std::vector<IoRedir>& redirs,
+                       ExpandedCallback done)
+{
+    auto e = new Expander(c, words, redirs, done);
+    e->runNext();
+}
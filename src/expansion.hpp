@@ -0,0 +1,47 @@
+#pragma once
+
+#include "process.hpp"
+#include <string>
+#include <vector>
+#include <functional>
+
+class Context;
+
+/**
+ * Variable expansion and command substitution in the words of a command.
+ *
+ * The lexer writes `$NAME`, `${NAME}` and `$?` as `mark {NAME mark`, and
+ * `$(cmd)` as `mark (cmd mark`, so words only contain marks where a `$` was
+ * neither quoted nor escaped. Expanded values are used as they are, like
+ * inside double quotes in a shell: they aren't split into several words.
+ */
+namespace Expansion {
+
+constexpr char mark = '\x01';
+
+/**
+ * Returns true if `word` has anything to expand
+ */
+inline bool hasExpansions(const std::string& word)
+{
+    return word.find(mark) != std::string::npos;
+}
+
+/**
+ * Called with the expanded words, and the exit status of the last command
+ * substitution, or -1 if there was none
+ */
+typedef std::function<void(std::vector<std::string>& words, int status)> ExpandedCallback;
+
+/**
+ * Expands `words`. Command substitutions run one at a time, with `redirs`
+ * for their stdin and stderr, and their output without trailing newlines
+ * takes their place. Variables are looked up in the Context, or else in the
+ * environment.
+ *
+ * Must be called on the main event loop, where `done` is called too,
+ * right away if there are no command substitutions.
+ */
+void expand(Context* c, const std::vector<std::string>& words, const std::vector<IoRedir>& redirs, ExpandedCallback done);
+
+}   // namespace Expansion
@@ -0,0 +1,69 @@
+#include "daemon.hpp"
+#include "trace.hpp"
+#include "units.hpp"
+#include <cstdio>
+#include <csignal>
+#include <string>
+
+static DaemonServer* server = nullptr;
+
+static void onSignal(int)
+{
+    if (server != nullptr)
+        server->stop();
+}
+
+static void usage()
+{
+    fprintf(stderr, "usage: flasshd [--socket PATH] [--connect-rate N] [--bwlimit-up RATE] [--bwlimit-down RATE]\n");
+}
+
+int main(int argc, char** argv)
+{
+    // writing to a closed pipe should be an error, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    std::string socketPath = daemonSocketPath();
+    uint64_t connectRate = 0;
+    uint64_t bwlimitUp = 0;
+    uint64_t bwlimitDown = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string opt = argv[i];
+        if (opt == "--socket" && i + 1 < argc) {
+            socketPath = argv[++i];
+        }
+        else if ((opt == "--connect-rate" || opt == "--bwlimit-up" || opt == "--bwlimit-down") && i + 1 < argc) {
+            uint64_t& limit = opt == "--connect-rate" ? connectRate : opt == "--bwlimit-up" ? bwlimitUp : bwlimitDown;
+            if (!parseSize(argv[++i], limit)) {
+                usage();
+                return 2;
+            }
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+    Trace::setThreadName("main");
+
+    // no SA_RESTART, so a signal interrupts accept() and run() returns
+    struct sigaction sa = {};
+    sa.sa_handler = onSignal;
+    sigaction(SIGINT, &sa, nullptr);
+    sigaction(SIGTERM, &sa, nullptr);
+
+    try {
+        DaemonServer s(socketPath);
+        s.getScheduler()->setConnectRate(connectRate);
+        s.getScheduler()->setBandwidth(bwlimitUp, bwlimitDown);
+        server = &s;
+        fprintf(stderr, "flasshd: listening on %s\n", socketPath.c_str());
+        s.run();
+        server = nullptr;
+    }
+    catch (std::exception& e) {
+        fprintf(stderr, "flasshd: %s\n", e.what());
+        return 1;
+    }
+    return 0;
+}
@@ -1,11 +1,18 @@
 #include "host.hpp"
+#include "trace.hpp"
+#include "prompter.hpp"
+#include "eventLoop.hpp"
+#include "units.hpp"
+#include <poll.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <cstring>
 #include <stdexcept>
 #include <regex>
-
-static int authenticate_kbdint(ssh_session session);
+#include <random>
+#include <algorithm>
 
 
 
@@ -40,7 +47,105 @@ bool HostInfo::parse(const std::string& str)
     }
 }
 
-std::string HostInfo::toString()
+bool HostInfo::setOption(const std::string& name, const std::string& value)
+{
+    try {
+        if (name == "compression") {
+            if (value == "yes")
+                compression = 6;
+            else if (value == "no")
+                compression = 0;
+            else {
+                unsigned level;
+                if (!parseCount(value, level) || level > 9)
+                    return false;
+                compression = level;
+            }
+        }
+        else if (name == "ciphers") {
+            ciphers = value;
+        }
+        else if (name == "macs") {
+            macs = value;
+        }
+        else if (name == "kex") {
+            kex = value;
+        }
+        else if (name == "rekey_data") {
+            return parseSize(value, rekeyData);
+        }
+        else if (name == "rekey_time") {
+            unsigned seconds;
+            if (!parseCount(value, seconds))
+                return false;
+            rekeyTime = seconds;
+        }
+        else if (name == "identity") {
+            identity = value;
+        }
+        else if (name == "batch") {
+            if (value != "yes" && value != "no")
+                return false;
+            batch = value == "yes";
+        }
+        else if (name == "timeout") {
+            return parseDuration(value, timeout);
+        }
+        else if (name == "reconnect") {
+            return parseCount(value, reconnect);
+        }
+        else if (name == "keepalive") {
+            return parseDuration(value, keepalive);
+        }
+        else if (name == "keepalive_count") {
+            return parseCount(value, keepaliveCount) && keepaliveCount > 0;
+        }
+        else if (name == "max_channels") {
+            return parseCount(value, maxChannels) && maxChannels > 0;
+        }
+        else {
+            return false;
+        }
+        return true;
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+std::vector<std::pair<std::string, std::string>> HostInfo::options() const
+{
+    std::vector<std::pair<std::string, std::string>> ret;
+    if (compression != -1)
+        ret.push_back({ "compression", std::to_string(compression) });
+    if (!ciphers.empty())
+        ret.push_back({ "ciphers", ciphers });
+    if (!macs.empty())
+        ret.push_back({ "macs", macs });
+    if (!kex.empty())
+        ret.push_back({ "kex", kex });
+    if (rekeyData != 0)
+        ret.push_back({ "rekey_data", std::to_string(rekeyData) });
+    if (rekeyTime != 0)
+        ret.push_back({ "rekey_time", std::to_string(rekeyTime) });
+    if (!identity.empty())
+        ret.push_back({ "identity", identity });
+    if (!batch)
+        ret.push_back({ "batch", "no" });
+    if (timeout != 0)
+        ret.push_back({ "timeout", std::to_string(timeout) });
+    if (reconnect != 3)
+        ret.push_back({ "reconnect", std::to_string(reconnect) });
+    if (keepalive != 30)
+        ret.push_back({ "keepalive", std::to_string(keepalive) });
+    if (keepaliveCount != 3)
+        ret.push_back({ "keepalive_count", std::to_string(keepaliveCount) });
+    if (maxChannels != 10)
+        ret.push_back({ "max_channels", std::to_string(maxChannels) });
+    return ret;
+}
+
+std::string HostInfo::toString() const
 {
     std::string str;
     if (!userName.empty())
@@ -56,9 +161,22 @@ std::string HostInfo::toString()
     return str;
 }
 
+std::string HostInfo::key() const
+{
+    // the port is always included, since toString() leaves out 22
+    return userName + "@" + hostName + ":" + std::to_string(port) +
+           " " + std::to_string(compression) + " " + ciphers + " " + macs +
+           " " + kex + " " + std::to_string(rekeyData) + " " +
+           std::to_string(rekeyTime) + " " + identity + (batch ? " batch" : "") +
+           " " + std::to_string(timeout) + " " + std::to_string(reconnect) +
+           " " + std::to_string(keepalive) + " " + std::to_string(keepaliveCount) +
+           " " + std::to_string(maxChannels);
+}
+
 
 
-Host::Host()
+Host::Host(EventLoop* evtLoop, const HostInfo& info, Scheduler* scheduler)
+    : evtLoop(evtLoop), scheduler(scheduler), info(info)
 {
     session = ssh_new();
     if (!session)
@@ -67,12 +185,37 @@ Host::Host()
 
 Host::~Host()
 {
+    if (pollFd != -1)
+        evtLoop->removeFd(pollFd);
+    evtLoop->cancelTimer(checkTimer);
+    evtLoop->cancelTimer(reconnectTimer);
+    evtLoop->cancelTimer(keepaliveTimer);
+    if (connectTicket != 0)
+        scheduler->cancel(connectTicket);
+    Prompter::zero(password);
+    for (auto channel : spareChannels)
+        ssh_channel_free(channel);
+    if (sftp != nullptr)
+        sftp_free(sftp);
     ssh_free(session);
+    for (auto& old : oldSessions) {
+        if (old.second != nullptr)
+            sftp_free(old.second);
+        ssh_free(old.first);
+    }
+}
+
+void Host::startConnect()
+{
+    connectTicket = scheduler->whenCanConnect(evtLoop, [this] () {
+        connectTicket = 0;
+        connect();
+    });
 }
 
-void Host::connect(const HostInfo& info)
+void Host::connect()
 {
-    this->info = info;
+    Trace::asyncBegin("Host::connect", this, info.hostName);
 
     // set options
     ssh_options_set(session, SSH_OPTIONS_HOST, info.hostName.c_str());
@@ -80,21 +223,433 @@ void Host::connect(const HostInfo& info)
     if (!info.userName.empty()) {
         ssh_options_set(session, SSH_OPTIONS_USER, info.userName.c_str());
     }
+    if (!info.identity.empty()) {
+        ssh_options_set(session, SSH_OPTIONS_ADD_IDENTITY, info.identity.c_str());
+    }
+    try {
+        setTuningOptions();
+    }
+    catch (std::exception& e) {
+        fail(e.what());
+        return;
+    }
+
+    // every libssh call below returns SSH_AGAIN instead of waiting for the
+    // server, and is called again once the session's FD is ready
+    ssh_set_blocking(session, 0);
+    state = CONNECTING;
+    step();
+}
+
+void Host::whenReady(HostReadyCallback callback)
+{
+    evtLoop->enqueueTask([this, callback] () {
+        if (state == READY)
+            callback("");
+        else if (state == FAILED)
+            callback(error);
+        else
+            readyCallbacks.push_back(callback);
+    }, "Host::whenReady");
+}
+
+bool Host::isAlive() const
+{
+    if (state == READY)
+        return ssh_is_connected(session);
+    return state != FAILED;
+}
+
+bool Host::checkConnection()
+{
+    if (state == READY && !ssh_is_connected(session))
+        connectionLost();
+    return state == READY;
+}
+
+uint64_t Host::onConnectionLost(std::function<void()> callback)
+{
+    uint64_t id = nextLostId++;
+    lostCallbacks[id] = callback;
+    return id;
+}
+
+void Host::removeLostCallback(uint64_t id)
+{
+    lostCallbacks.erase(id);
+}
+
+/**
+ * Checks the connection once a second while the host is ready. libssh
+ * notices a dropped connection while polling the session, but doesn't tell
+ * anyone.
+ */
+void Host::watchConnection()
+{
+    checkTimer = evtLoop->addTimer(checkIntervalUs, [this] () {
+        checkTimer = 0;
+        if (checkConnection())
+            watchConnection();
+    }, "Host::checkConnection");
+}
+
+/**
+ * Sends a keepalive every `keepalive` seconds while the host is ready. Each
+ * one asks the server for a reply, so there is always something for the
+ * peer to acknowledge, and a dead one shows as data that stays unacked.
+ */
+void Host::scheduleKeepalive()
+{
+    if (info.keepalive == 0)
+        return;
+
+    keepaliveTimer = evtLoop->addTimer(info.keepalive * 1000000, [this] () {
+        keepaliveTimer = 0;
+        if (!checkConnection())
+            return;
+
+        if (!keepaliveUnanswered())
+            missedKeepalives = 0;
+        else if (++missedKeepalives >= info.keepaliveCount) {
+            fprintf(stderr, "flassh: %s doesn't answer keepalives\n", info.hostName.c_str());
+            return connectionLost();
+        }
+
+        ssh_send_keepalive(session);
+        scheduleKeepalive();
+    }, "Host::keepalive");
+}
+
+/**
+ * Returns true if data sent on the session, such as the last keepalive,
+ * hasn't been acknowledged for a whole keepalive interval. This is asked of
+ * the kernel, since libssh doesn't tell when the server replies.
+ */
+bool Host::keepaliveUnanswered() const
+{
+    tcp_info ti;
+    socklen_t len = sizeof(ti);
+    if (getsockopt(ssh_get_fd(session), IPPROTO_TCP, TCP_INFO, &ti, &len) == -1)
+        return false;    // not TCP, e.g. a proxy command
+    return ti.tcpi_unacked > 0 && ti.tcpi_last_ack_recv >= info.keepalive * 1000;
+}
+
+/**
+ * Gives up the dropped session, and starts connecting again unless the
+ * host has no reconnect attempts
+ */
+void Host::connectionLost()
+{
+    fprintf(stderr, "flassh: lost connection to %s\n", info.hostName.c_str());
+    Trace::asyncInstant("connection lost", this);
+    evtLoop->cancelTimer(checkTimer);
+    evtLoop->cancelTimer(keepaliveTimer);
+    checkTimer = 0;
+    keepaliveTimer = 0;
+    ready = false;
+
+    // whatever runs on the session finishes first and frees its channels
+    auto callbacks = std::move(lostCallbacks);
+    lostCallbacks.clear();
+    for (auto& cb : callbacks)
+        cb.second();
+
+    // the socket may still look connected if the peer stopped answering
+    evtLoop->removeSession(session);
+    ssh_silent_disconnect(session);
+    for (auto channel : spareChannels)
+        ssh_channel_free(channel);
+    channelSlots -= spareChannels.size() + (sftp != nullptr);
+    spareChannels.clear();
+    oldSessions.push_back({ session, sftp });
+    sftp = nullptr;
+    grantChannelSlots();
+
+    session = ssh_new();
+    if (session == nullptr)
+        error = "Failed to create ssh_session";
+    else if (info.reconnect == 0)
+        error = "Lost connection to " + info.hostName;
+    else
+        return scheduleReconnect();
+
+    state = FAILED;
+    runReadyCallbacks(error);
+}
+
+/**
+ * Connects again after a delay that doubles with every attempt, with some
+ * jitter so that hosts that dropped together don't all come back at once
+ */
+void Host::scheduleReconnect()
+{
+    static thread_local std::minstd_rand rng(monotonicUs());
+    uint64_t delay = std::min(checkIntervalUs << std::min(reconnectAttempt, 5u), maxReconnectDelayUs);
+    delay = delay / 2 + rng() % (delay / 2);
+
+    ++reconnectAttempt;
+    state = RECONNECT_WAIT;
+    reconnectTimer = evtLoop->addTimer(delay, [this] () {
+        reconnectTimer = 0;
+        startConnect();
+    }, "Host::reconnect");
+}
+
+/**
+ * Advances the connection as far as it goes without waiting
+ */
+void Host::step()
+{
+    int rc;
+    switch (state) {
+    case CONNECTING:
+        rc = ssh_connect(session);
+        if (rc == SSH_AGAIN)
+            return waitForSession();
+        if (rc != SSH_OK)
+            return fail("Failed to connect to " + info.hostName);
+
+        //authHost();   // TODO
+        Trace::asyncInstant("connected", this);
+        state = AUTH_PUBKEY;
+        // fall through
+
+    case AUTH_PUBKEY:
+        // TODO: doesn't work well for public keys
+        rc = ssh_userauth_publickey_auto(session, nullptr, nullptr);
+        if (rc == SSH_AUTH_AGAIN)
+            return waitForSession();
+        if (rc == SSH_AUTH_ERROR)
+            return fail("Error while trying public key authentication");
+        if (rc == SSH_AUTH_SUCCESS)
+            return finishConnect();
+
+        // else we need to try another authentication method
+        return askPassword();
+
+    case AUTH_PASSWORD:
+        // libssh wants the same password again after SSH_AUTH_AGAIN
+        rc = ssh_userauth_password(session, nullptr, password.c_str());
+        if (rc == SSH_AUTH_AGAIN)
+            return waitForSession();
+        Prompter::zero(password);
+        if (rc == SSH_AUTH_ERROR)
+            return fail("Error while trying password authentication");
+        if (rc == SSH_AUTH_SUCCESS)
+            return finishConnect();
+
+        // else we need to try another authentication method
+        state = AUTH_KBDINT;
+        // fall through
+
+    case AUTH_KBDINT:
+        rc = ssh_userauth_kbdint(session, nullptr, nullptr);
+        if (rc == SSH_AUTH_AGAIN)
+            return waitForSession();
+        if (rc == SSH_AUTH_INFO)
+            return askKbdint();
+        if (rc == SSH_AUTH_ERROR)
+            return fail("Error while trying keyboard interactive authentication");
+        if (rc != SSH_AUTH_SUCCESS)
+            return fail("Failed to authenticate user");
+        return finishConnect();
+
+    default:
+        return;
+    }
+}
+
+/**
+ * Steps again once the session's FD has what libssh is waiting for
+ */
+void Host::waitForSession()
+{
+    int fd = ssh_get_fd(session);
+    if (fd == -1)
+        return fail("Failed to connect to " + info.hostName);
+
+    short events = POLLIN;
+    if (ssh_get_poll_flags(session) & SSH_WRITE_PENDING)
+        events |= POLLOUT;
+    pollFd = fd;
+    evtLoop->addFd(fd, events, &Host::onSessionFd, this, "Host::onSessionFd");
+}
+
+int Host::onSessionFd(socket_t fd, int revents, void* userdata)
+{
+    auto pThis = (Host*)userdata;
+
+    // the next step may wait for other events, and the poll set shouldn't
+    // change under the loop polling it, so step from a task
+    pThis->evtLoop->removeFd(fd);
+    pThis->pollFd = -1;
+    pThis->evtLoop->enqueueTask([pThis] () { pThis->step(); }, "Host::step");
+    return 0;
+}
+
+void Host::askPassword()
+{
+    Trace::asyncInstant("password prompt", this);
+    state = PROMPTING;
+    Prompter::ask("", { { "Enter password for " + info.toString(), false } },
+                  [this] (bool ok, std::vector<std::string>& answers) {
+        std::string answer = ok ? answers[0] : "";
+        evtLoop->enqueueTask([this, ok, answer] () mutable {
+            if (!ok)
+                return fail("No password entered");
+            password = answer;
+            Prompter::zero(answer);
+            state = AUTH_PASSWORD;
+            step();
+        }, "password entered");
+    });
+}
 
-    // connect
-    int rc = ssh_connect(session);
-    if (rc != SSH_OK) {
-        sshException("Failed to connect to " + info.hostName);
+void Host::askKbdint()
+{
+    Trace::asyncInstant("keyboard interactive prompt", this);
+
+    std::string header;
+    const char* name = ssh_userauth_kbdint_getname(session);
+    const char* instruction = ssh_userauth_kbdint_getinstruction(session);
+    if (name != nullptr && strlen(name) > 0)
+        header += name;
+    if (instruction != nullptr && strlen(instruction) > 0)
+        header += (header.empty() ? "" : "\n") + std::string(instruction);
+
+    std::vector<Prompter::Question> questions;
+    int nprompts = ssh_userauth_kbdint_getnprompts(session);
+    for (int i = 0; i < nprompts; i++) {
+        char echo;
+        const char* prompt = ssh_userauth_kbdint_getprompt(session, i, &echo);
+        questions.push_back({ prompt != nullptr ? prompt : "", echo != 0 });
     }
 
-    //authHost();   // TODO
-    authUser();
+    state = PROMPTING;
+    Prompter::ask(header, questions, [this] (bool ok, std::vector<std::string>& answers) {
+        evtLoop->enqueueTask([this, ok, answers] () mutable {
+            for (size_t i = 0; ok && i < answers.size(); i++)
+                ok = ssh_userauth_kbdint_setanswer(session, i, answers[i].c_str()) >= 0;
+            for (auto& a : answers)
+                Prompter::zero(a);
+            if (!ok)
+                return fail("Error while trying keyboard interactive authentication");
+            state = AUTH_KBDINT;
+            step();
+        }, "keyboard interactive answers");
+    });
+}
+
+void Host::finishConnect()
+{
+    // the rest of flassh uses the session in blocking mode
+    ssh_set_blocking(session, 1);
 
-    // set O_CLOEXEC on the ssh socket
+    // set FD_CLOEXEC on the ssh socket
     int fd = ssh_get_fd(session);
-    int flags = fcntl(fd, F_GETFL);
-    if (fcntl(fd, F_SETFL, flags | O_CLOEXEC) == -1) {
-        throw std::runtime_error("Failed to set O_CLOEXEC on FD");
+    int flags = fcntl(fd, F_GETFD);
+    if (fcntl(fd, F_SETFD, flags | FD_CLOEXEC) == -1)
+        return fail("Failed to set FD_CLOEXEC on FD");
+
+    // the kernel gives up on data that stays unacked as long as the
+    // keepalives would, so a command writing to a dead peer fails too
+    if (info.keepalive != 0) {
+        unsigned int ms = info.keepalive * info.keepaliveCount * 1000;
+        setsockopt(fd, IPPROTO_TCP, TCP_USER_TIMEOUT, &ms, sizeof(ms));
+    }
+
+    evtLoop->addSession(session);
+    state = READY;
+    ready = true;
+    Trace::asyncEnd("Host::connect", this);
+    if (reconnectAttempt > 0)
+        fprintf(stderr, "flassh: reconnected to %s\n", info.hostName.c_str());
+    reconnectAttempt = 0;
+    missedKeepalives = 0;
+    watchConnection();
+    scheduleKeepalive();
+    runReadyCallbacks("");
+}
+
+void Host::fail(const std::string& what)
+{
+    const char* sshErr = ssh_get_error(session);
+    error = what;
+    if (sshErr != nullptr && strlen(sshErr) > 0)
+        error += std::string(": ") + sshErr;
+    Prompter::zero(password);
+    Trace::asyncEnd("Host::connect", this, error);
+
+    // a failed attempt to reconnect is tried again, with a new session
+    if (reconnectAttempt > 0 && reconnectAttempt < info.reconnect) {
+        if (pollFd != -1) {
+            evtLoop->removeFd(pollFd);
+            pollFd = -1;
+        }
+        ssh_free(session);
+        session = ssh_new();
+        if (session != nullptr)
+            return scheduleReconnect();
+        error = "Failed to create ssh_session";
+    }
+
+    state = FAILED;
+    runReadyCallbacks(error);
+}
+
+/**
+ * Tells everyone waiting in whenReady() how connecting went, with an empty
+ * `error` on success
+ */
+void Host::runReadyCallbacks(const std::string& error)
+{
+    auto callbacks = std::move(readyCallbacks);
+    readyCallbacks.clear();
+    for (auto& cb : callbacks)
+        cb(error);
+}
+
+void Host::setTuningOptions()
+{
+    // compression is negotiated for the whole session, so it applies to
+    // every channel
+    if (info.compression > 0) {
+        int level = info.compression;
+        ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "yes");
+        ssh_options_set(session, SSH_OPTIONS_COMPRESSION_LEVEL, &level);
+    }
+    else if (info.compression == 0) {
+        ssh_options_set(session, SSH_OPTIONS_COMPRESSION, "no");
+    }
+
+    if (!info.ciphers.empty()) {
+        if (ssh_options_set(session, SSH_OPTIONS_CIPHERS_C_S, info.ciphers.c_str()) < 0 ||
+            ssh_options_set(session, SSH_OPTIONS_CIPHERS_S_C, info.ciphers.c_str()) < 0)
+        {
+            sshException("Unsupported ciphers " + info.ciphers);
+        }
+    }
+
+    if (!info.macs.empty()) {
+        if (ssh_options_set(session, SSH_OPTIONS_HMAC_C_S, info.macs.c_str()) < 0 ||
+            ssh_options_set(session, SSH_OPTIONS_HMAC_S_C, info.macs.c_str()) < 0)
+        {
+            sshException("Unsupported MACs " + info.macs);
+        }
+    }
+
+    if (!info.kex.empty()) {
+        if (ssh_options_set(session, SSH_OPTIONS_KEY_EXCHANGE, info.kex.c_str()) < 0) {
+            sshException("Unsupported key exchange " + info.kex);
+        }
+    }
+
+    if (info.rekeyData != 0) {
+        ssh_options_set(session, SSH_OPTIONS_REKEY_DATA, &info.rekeyData);
+    }
+
+    if (info.rekeyTime != 0) {
+        ssh_options_set(session, SSH_OPTIONS_REKEY_TIME, &info.rekeyTime);
     }
 }
 
@@ -174,47 +729,122 @@ void Host::authHost()
     ssh_clean_pubkey_hash(&hash);
 }
 
-void Host::authUser()
+sftp_session Host::getSftp()
 {
-    // TODO: doesn't work well for public keys
+    if (sftp != nullptr)
+        return sftp;
 
-    // try authenticating with public key first
-    int rc;
-    while ((rc = ssh_userauth_publickey_auto(session, nullptr, nullptr)) == SSH_AUTH_AGAIN)
-    {
+    sftp = sftp_new(session);
+    if (sftp == nullptr)
+        sshException("Failed to create SFTP session");
+
+    if (sftp_init(sftp) != SSH_OK) {
+        sftp_free(sftp);
+        sftp = nullptr;
+        sshException("Failed to initialize SFTP session");
     }
+    reserveChannelSlot();
+    return sftp;
+}
 
-    if (rc == SSH_AUTH_ERROR)
-        sshException("Error while trying public key authentication");
+void Host::prefetchChannel()
+{
+    if (state != READY || spareChannels.size() >= maxSpareChannels ||
+        channelSlots >= info.maxChannels || !slotWaiters.empty())
+    {
+        return;
+    }
 
-    if (rc == SSH_AUTH_SUCCESS)
+    ssh_channel channel = ssh_channel_new(session);
+    if (channel == nullptr)
         return;
 
-    // else we need to try another authentication method
+    // returns SSH_AGAIN once the request is sent, the event loop processes
+    // the answer while the channel waits
+    ssh_set_blocking(session, 0);
+    int rc = ssh_channel_open_session(channel);
+    ssh_set_blocking(session, 1);
+    if (rc == SSH_ERROR) {
+        ssh_channel_free(channel);
+        return;
+    }
+    spareChannels.push_back(channel);
+    ++channelSlots;
+}
 
-    // password authentication
-    std::string prompt = "Enter password for " + info.toString();
-    char* password = getpass(prompt.c_str());
-    rc = ssh_userauth_password(session, nullptr, password);
-    
-    // zero the password for security
-    memset(password, 0, strlen(password));
+ssh_channel Host::takeChannel()
+{
+    // the caller's slot covers the channel, so the spare one's is freed
+    while (!spareChannels.empty()) {
+        ssh_channel channel = spareChannels.front();
+        spareChannels.pop_front();
+        --channelSlots;
+
+        // waits for the answer if it hasn't arrived yet, and fails if the
+        // open was denied or the server has closed the channel since
+        if (ssh_channel_open_session(channel) == SSH_OK)
+            return channel;
+        ssh_channel_free(channel);
+    }
 
-    if (rc == SSH_AUTH_ERROR)
-        sshException("Error while trying password authentication");
+    ssh_channel channel = ssh_channel_new(session);
+    if (channel == nullptr)
+        return nullptr;
+    if (ssh_channel_open_session(channel) != SSH_OK) {
+        ssh_channel_free(channel);
+        return nullptr;
+    }
+    return channel;
+}
 
-    if (rc == SSH_AUTH_SUCCESS)
+void Host::acquireChannelSlot(std::function<void()> task)
+{
+    if (slotWaiters.empty() && freeChannelSlot()) {
+        ++channelSlots;
+        task();
         return;
+    }
+    slotWaiters.push_back(std::move(task));
+}
+
+void Host::releaseChannelSlot()
+{
+    --channelSlots;
+    grantChannelSlots();
+}
 
-    // else we need to try another authentication method
+/**
+ * Returns true if a channel may be opened, closing a spare one to make room
+ * if that is what's in the way
+ */
+bool Host::freeChannelSlot()
+{
+    if (channelSlots < info.maxChannels)
+        return true;
+    if (spareChannels.empty())
+        return false;
 
-    // keyboard interactive authentication
-    rc = authenticate_kbdint(session);
+    ssh_channel channel = spareChannels.back();
+    spareChannels.pop_back();
+    ssh_set_blocking(session, 0);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    ssh_set_blocking(session, 1);
+    --channelSlots;
+    return true;
+}
 
-    if (rc == SSH_AUTH_ERROR)
-        sshException("Error while trying keyboard interactive authentication");
-    if (rc != SSH_AUTH_SUCCESS)
-        sshException("Failed to authenticate user");
+/**
+ * Hands freed slots to the waiting tasks. They are queued, since slots are
+ * usually released from channel callbacks.
+ */
+void Host::grantChannelSlots()
+{
+    while (!slotWaiters.empty() && freeChannelSlot()) {
+        ++channelSlots;
+        evtLoop->enqueueTask(std::move(slotWaiters.front()), "channel slot");
+        slotWaiters.pop_front();
+    }
 }
 
 void Host::sshException(const std::string& what)
@@ -225,52 +855,3 @@ void Host::sshException(const std::string& what)
     }
     throw std::runtime_error(what + ": " + sshErr);
 }
-
-/**
- * Copied from libssh documentation to handle keyboard interactive authentication
- */
-static int authenticate_kbdint(ssh_session session)
-{
-    int rc;
-    rc = ssh_userauth_kbdint(session, NULL, NULL);
-    while (rc == SSH_AUTH_INFO)
-    {
-        const char *name, *instruction;
-        int nprompts, iprompt;
-        name = ssh_userauth_kbdint_getname(session);
-        instruction = ssh_userauth_kbdint_getinstruction(session);
-        nprompts = ssh_userauth_kbdint_getnprompts(session);
-        if (strlen(name) > 0)
-            printf("%s\n", name);
-        if (strlen(instruction) > 0)
-            printf("%s\n", instruction);
-        for (iprompt = 0; iprompt < nprompts; iprompt++)
-        {
-            const char *prompt;
-            char echo;
-            prompt = ssh_userauth_kbdint_getprompt(session, iprompt, &echo);
-            if (echo)
-            {
-                char buffer[128], *ptr;
-                printf("%s", prompt);
-                if (fgets(buffer, sizeof(buffer), stdin) == NULL)
-                    return SSH_AUTH_ERROR;
-                buffer[sizeof(buffer) - 1] = '\0';
-                if ((ptr = strchr(buffer, '\n')) != NULL)
-                    *ptr = '\0';
-                if (ssh_userauth_kbdint_setanswer(session, iprompt, buffer) < 0)
-                    return SSH_AUTH_ERROR;
-                memset(buffer, 0, strlen(buffer));
-            }
-            else
-            {
-                char *ptr;
-                ptr = getpass(prompt);
-                if (ssh_userauth_kbdint_setanswer(session, iprompt, ptr) < 0)
-                    return SSH_AUTH_ERROR;
-            }
-        }
-        rc = ssh_userauth_kbdint(session, NULL, NULL);
-    }
-    return rc;
-}
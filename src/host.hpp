@@ -1,13 +1,39 @@
 #pragma once
 
 #include <libssh/libssh.h>
+#include <libssh/sftp.h>
+#include "stats.hpp"
+#include "scheduler.hpp"
 #include <string>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <atomic>
+#include <vector>
+#include <utility>
+#include <map>
 
 struct HostInfo {
     std::string userName;
     std::string hostName;
     unsigned int port;
 
+    // connection tuning, set with `name=value` options in host definitions
+
+    int compression = -1;       // zlib level 1-9, 0 to disable, -1 for default
+    std::string ciphers;        // comma separated, in order of preference
+    std::string macs;
+    std::string kex;
+    uint64_t rekeyData = 0;     // bytes, 0 for default
+    uint32_t rekeyTime = 0;     // seconds, 0 for default
+    std::string identity;       // private key to try before the default ones
+    bool batch = true;          // run consecutive commands over one channel
+    uint64_t timeout = 0;       // seconds a command may run, 0 for no limit
+    unsigned reconnect = 3;     // attempts after the connection drops
+    uint64_t keepalive = 30;    // seconds between keepalives, 0 to disable
+    unsigned keepaliveCount = 3;    // unanswered ones until the peer is dead
+    unsigned maxChannels = 10;  // open at once, like sshd's MaxSessions
+
     /**
      * Parse a string of the form [username@]hostname[:port]
      * 
@@ -15,24 +41,212 @@ struct HostInfo {
      */
     bool parse(const std::string& str);
 
-    std::string toString();
+    /**
+     * Sets one of the `name=value` options of a host definition
+     *
+     * @return false if the option or value is invalid
+     */
+    bool setOption(const std::string& name, const std::string& value);
+
+    /**
+     * Returns the options that aren't at their default, as `setOption()`
+     * takes them
+     */
+    std::vector<std::pair<std::string, std::string>> options() const;
+
+    std::string toString() const;
+
+    /**
+     * Returns a string that is the same for two infos only if connecting with
+     * them gives the same kind of session
+     */
+    std::string key() const;
 };
 
+/**
+ * Called on the host's event loop once it is connected and authenticated, or
+ * has failed to. `error` is empty on success.
+ */
+typedef std::function<void(const std::string& error)> HostReadyCallback;
+
+/**
+ * A connection to a remote host. The session belongs to one event loop, and
+ * everything that uses it (connecting, channels, SFTP) must run on that
+ * loop's thread.
+ *
+ * Connecting and authenticating is a non-blocking state machine driven by
+ * the loop, so the loop keeps serving other hosts meanwhile. Passwords and
+ * other answers are asked for by the Prompter.
+ *
+ * Once ready, the host checks its connection every second. If it has
+ * dropped, the host connects again with a new session, up to
+ * `HostInfo::reconnect` times with growing delays, and is not ready
+ * meanwhile. The old session is kept until the host is deleted, since
+ * channels and files may still refer to it.
+ *
+ * A peer that went away without closing the connection, e.g. behind a NAT
+ * that forgot it, is found with keepalives: if `HostInfo::keepaliveCount`
+ * of them in a row aren't acknowledged, the connection counts as dropped.
+ *
+ * At most `HostInfo::maxChannels` channels are open at once, counting spare
+ * and SFTP ones, so the server doesn't refuse them. Processes that would
+ * open more wait for a slot in turn.
+ */
 class Host {
 public:
-    Host();
+    Host(EventLoop* evtLoop, const HostInfo& info, Scheduler* scheduler);
     ~Host();
 
-    void connect(const HostInfo& info);
+    /**
+     * Starts connecting and authenticating, as soon as the scheduler allows
+     * a new connection. Must be called on the host's event loop, once.
+     */
+    void startConnect();
+
+    /**
+     * Calls `callback` once the host is ready or has failed, right away if it
+     * already has. Can be called from any thread.
+     */
+    void whenReady(HostReadyCallback callback);
+
+    /**
+     * Returns true once the host is connected and authenticated. Can be
+     * called from any thread.
+     */
+    bool isReady() const { return ready; }
+
+    /**
+     * Returns false if the host failed to connect or has lost its
+     * connection. Must be called on the host's event loop.
+     */
+    bool isAlive() const;
+
+    /**
+     * Starts reconnecting if the connection has dropped. Must be called on
+     * the host's event loop.
+     *
+     * @return true if the host is ready
+     */
+    bool checkConnection();
+
+    /**
+     * Calls `callback` on the host's event loop if the connection drops
+     * while the host is ready, before it reconnects. Must be called on the
+     * host's event loop, like `removeLostCallback()`.
+     *
+     * @return an ID for `removeLostCallback()`
+     */
+    uint64_t onConnectionLost(std::function<void()> callback);
+    void removeLostCallback(uint64_t id);
+
     void authHost();
-    void authUser();
     void disconnect();
 
     ssh_session getSession() const { return session; }
+    EventLoop* getEvtLoop() const { return evtLoop; }
+    Scheduler* getScheduler() const { return scheduler; }
+    HostStats& getStats() { return stats; }
+    const HostInfo& getInfo() const { return info; }
+
+    /**
+     * Returns the SFTP session for this host, starting it the first time
+     */
+    sftp_session getSftp();
+
+    /**
+     * Starts opening a session channel without waiting for the server's
+     * answer, so a later `takeChannel()` doesn't pay for the round trip. Must
+     * be called on the host's event loop.
+     */
+    void prefetchChannel();
+
+    /**
+     * Returns an open session channel, preferring a prefetched one, or nullptr
+     * on error. Must be called on the host's event loop.
+     */
+    ssh_channel takeChannel();
+
+    /**
+     * Calls `task` once a channel may be opened without going over
+     * `max_channels`, right away if possible, or else on the host's event
+     * loop in the order asked for. The slot is held until
+     * `releaseChannelSlot()`. Must be called on the host's event loop, like
+     * the other slot methods.
+     */
+    void acquireChannelSlot(std::function<void()> task);
+
+    /**
+     * Takes a slot without waiting, even over the limit, for a channel that
+     * is needed right away
+     */
+    void reserveChannelSlot() { ++channelSlots; }
+
+    void releaseChannelSlot();
 
 private:
+    // more than a few spare channels would only waste server resources
+    static constexpr size_t maxSpareChannels = 4;
+
+    static constexpr uint64_t checkIntervalUs = 1000000;
+    static constexpr uint64_t maxReconnectDelayUs = 30000000;
+
+    enum State {
+        IDLE,
+        CONNECTING,
+        AUTH_PUBKEY,
+        AUTH_PASSWORD,
+        AUTH_KBDINT,
+        PROMPTING,      // waiting for the Prompter
+        READY,
+        RECONNECT_WAIT, // waiting before connecting again
+        FAILED
+    };
+
+    State state = IDLE;
+    std::atomic<bool> ready{false};
+    std::string error;
+    std::vector<HostReadyCallback> readyCallbacks;
+    int pollFd = -1;            // the session's FD while we wait on it
+    std::string password;
+
+    unsigned reconnectAttempt = 0;  // 0 unless reconnecting
+    uint64_t checkTimer = 0;
+    uint64_t reconnectTimer = 0;
+    uint64_t keepaliveTimer = 0;
+    unsigned missedKeepalives = 0;
+    Scheduler::Ticket connectTicket = 0;
+
+    unsigned channelSlots = 0;  // held by processes, spare channels and SFTP
+    std::deque<std::function<void()>> slotWaiters;
+    uint64_t nextLostId = 1;
+    std::map<uint64_t, std::function<void()>> lostCallbacks;
+    std::vector<std::pair<ssh_session, sftp_session>> oldSessions;
+
     ssh_session session;
+    sftp_session sftp = nullptr;
+    std::deque<ssh_channel> spareChannels;
+    EventLoop* evtLoop;
+    Scheduler* scheduler;
+    HostStats stats;
     HostInfo info;
 
+    void setTuningOptions();
     void sshException(const std::string& what);
+
+    void connect();
+    void step();
+    void waitForSession();
+    void askPassword();
+    void askKbdint();
+    void finishConnect();
+    void fail(const std::string& what);
+    void runReadyCallbacks(const std::string& error);
+    void watchConnection();
+    void scheduleKeepalive();
+    bool keepaliveUnanswered() const;
+    void connectionLost();
+    void scheduleReconnect();
+    bool freeChannelSlot();
+    void grantChannelSlots();
+    static int onSessionFd(socket_t fd, int revents, void* userdata);
 };
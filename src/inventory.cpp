@@ -0,0 +1,77 @@
+#include "inventory.hpp"
+#include "context.hpp"
+#include "command.hpp"
+#include "parser/parser.hpp"
+#include <fstream>
+#include <sstream>
+#include <unistd.h>
+
+InventoryProcess::InventoryProcess(Context* ctx, const std::vector<std::string>& args)
+    : ctx(ctx), args(args) {}
+
+void InventoryProcess::start(ProcessFinishedCallback onFinish)
+{
+    if (args.size() != 2) {
+        printError("usage: inventory FILE");
+        onFinish(2);
+        return;
+    }
+
+    std::ifstream file(args[1]);
+    if (!file) {
+        printError(args[1] + ": can't open file");
+        onFinish(1);
+        return;
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+
+    // parse everything first, so a bad line doesn't leave half of the hosts
+    // defined
+    std::vector<Command*> cmds;
+    std::string error;
+    try {
+        Parser p;
+        p.parse(ss.str() + "\n");
+        if (p.hadSyntaxError())
+            error = "syntax error";
+        else if (!p.isComplete())
+            error = "unexpected end of file";
+        for (Command* c = p.popCommand(); c != nullptr; c = p.popCommand()) {
+            cmds.push_back(c);
+            if (error.empty() && dynamic_cast<NewHostCommand*>(c) == nullptr)
+                error = "only host definitions are allowed";
+        }
+    }
+    catch (std::exception& e) {
+        error = e.what();
+    }
+
+    int status = 0;
+    if (!error.empty()) {
+        printError(args[1] + ": " + error);
+        status = 1;
+    }
+    else {
+        for (auto c : cmds) {
+            auto def = static_cast<NewHostCommand*>(c);
+            try {
+                ctx->addHost(def->getAlias(), def->getHostInfo());
+            }
+            catch (std::exception& e) {
+                printError(e.what());
+                status = 1;
+            }
+        }
+    }
+
+    for (auto c : cmds)
+        delete c;
+    onFinish(status);
+}
+
+void InventoryProcess::printError(const std::string& msg)
+{
+    std::string line = "inventory: " + msg + "\n";
+    write(getRedirectedFd(STDERR_FILENO), line.data(), line.size());
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include "process.hpp"
+
+class Context;
+
+/**
+ * Builtin `inventory FILE`
+ *
+ * Defines the hosts listed in FILE, one `alias := [user@]host[:port]` per
+ * line with the same options as in scripts. All of them start connecting
+ * and authenticating in the background right away, and a command only waits
+ * for the host it runs on, so the handshakes of a large fleet overlap with
+ * each other and with the rest of the script.
+ *
+ * Anything but host definitions and comments in FILE is an error, and
+ * nothing is defined then.
+ */
+class InventoryProcess : public Process {
+public:
+    InventoryProcess(Context* ctx, const std::vector<std::string>& args);
+
+    void start(ProcessFinishedCallback onFinish);
+
+private:
+    Context* ctx;
+    std::vector<std::string> args;
+
+    void printError(const std::string& msg);
+};
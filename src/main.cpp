@@ -1,40 +1,141 @@
 #include "parser/parser.hpp"
 #include "parser/lexer.hpp"
 #include "context.hpp"
+#include "trace.hpp"
+#include "stats.hpp"
+#include "stallDetector.hpp"
+#include "daemon.hpp"
+#include "batch.hpp"
+#include "compiledScript.hpp"
+#include "units.hpp"
 #include <cstdio>
 #include <iostream>
 #include <fstream>
 #include <string>
 #include <sstream>
+#include <csignal>
 
 int runScript(const std::vector<std::string>& args);
+void runInteractive();
+
+// print counters to stderr before exiting
+static bool showStats = false;
+
+// run the script in flasshd instead of connecting ourselves
+static bool useDaemon = false;
+
+// number of event loop threads, 0 for one per CPU core
+static unsigned numEvtLoops = 0;
+
+// limits of the scheduler, 0 for none
+static uint64_t connectRate = 0;
+static uint64_t bwlimitUp = 0;
+static uint64_t bwlimitDown = 0;
+
+static void usage()
+{
+    fprintf(stderr, "usage: flassh [--trace FILE] [--stats] [--stall-threshold MS] [--daemon]\n"
+                    "              [--event-loops N] [--connect-rate N]\n"
+                    "              [--bwlimit-up RATE] [--bwlimit-down RATE]\n"
+                    "              [script [args...]]\n");
+}
+
+static void setLimits(Context& ctx)
+{
+    ctx.getScheduler()->setConnectRate(connectRate);
+    ctx.getScheduler()->setBandwidth(bwlimitUp, bwlimitDown);
+}
 
 int main(int argc, char** argv)
 {
-    if (argc == 1) {
-        // interactive mode
-        Context ctx;
-        Parser p;
-        std::string line;
-        printf("> ");
-        while (std::getline(std::cin, line)) {
-            p.parse(line + "\n");
-            Command* c = nullptr;
-            while ((c = p.popCommand()) != nullptr) {
-                ctx.enqueueCommand(c);
-                ctx.flushCmdQueue();
+    // writing to a closed pipe should be an error, not kill us
+    signal(SIGPIPE, SIG_IGN);
+
+    // options come before the script, everything after it belongs to the
+    // script
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] == '-'; i++) {
+        std::string opt = argv[i];
+        if (opt == "--") {
+            ++i;
+            break;
+        }
+        else if (opt == "--trace" && i + 1 < argc) {
+            Trace::start(argv[++i]);
+        }
+        else if (opt == "--stats") {
+            showStats = true;
+        }
+        else if (opt == "--daemon") {
+            useDaemon = true;
+        }
+        else if (opt == "--stall-threshold" && i + 1 < argc) {
+            char* end;
+            double ms = strtod(argv[++i], &end);
+            if (*end != '\0' || ms <= 0) {
+                usage();
+                return 2;
+            }
+            StallTimer::setThreshold(ms * 1000);
+        }
+        else if (opt == "--event-loops" && i + 1 < argc) {
+            if (!parseCount(argv[++i], numEvtLoops) || numEvtLoops == 0) {
+                usage();
+                return 2;
+            }
+        }
+        else if ((opt == "--connect-rate" || opt == "--bwlimit-up" || opt == "--bwlimit-down") && i + 1 < argc) {
+            uint64_t& limit = opt == "--connect-rate" ? connectRate : opt == "--bwlimit-up" ? bwlimitUp : bwlimitDown;
+            if (!parseSize(argv[++i], limit)) {
+                usage();
+                return 2;
             }
-            printf(p.isComplete() ? "> " : ">> ");
+        }
+        else {
+            usage();
+            return 2;
         }
     }
+    Trace::setThreadName("main");
+
+    int status = 0;
+    if (i == argc) {
+        runInteractive();
+    }
     else {
         std::vector<std::string> args;
-        for (int i = 1; i < argc; i++) {
+        for (; i < argc; i++) {
             args.push_back(argv[i]);
         }
-        return runScript(args);
+        status = runScript(args);
+    }
+
+    // all other threads have stopped once the context is gone
+    Trace::stop();
+    return status;
+}
+
+void runInteractive()
+{
+    Context ctx(numEvtLoops);
+    setLimits(ctx);
+    Parser p;
+    std::string line;
+    printf("> ");
+    while (std::getline(std::cin, line)) {
+        p.parse(line + "\n");
+        if (p.hadSyntaxError())
+            ctx.setLastStatus(2);
+        Command* c = nullptr;
+        while ((c = p.popCommand()) != nullptr) {
+            ctx.enqueueCommand(c);
+            ctx.flushCmdQueue();
+        }
+        printf(p.isComplete() ? "> " : ">> ");
     }
-    return 0;
+
+    if (showStats)
+        fprintf(stderr, "%s", formatStats(&ctx).c_str());
 }
 
 int runScript(const std::vector<std::string>& args)
@@ -52,18 +153,25 @@ int runScript(const std::vector<std::string>& args)
     buffer << inFile.rdbuf();
     buffer << "\n";     // newline required to end commands
 
-    Context ctx;
-    Parser p;
-    p.parse(buffer.str());
-    if (!p.isComplete()) {
+    if (useDaemon)
+        return runInDaemon(daemonSocketPath(), buffer.str());
+
+    std::vector<Command*> cmds;
+    LoadResult loaded = loadScript(buffer.str(), cmds);
+    if (loaded == UNEXPECTED_EOF)
         fprintf(stderr, "flassh: Unexpected EOF\n");
+    if (loaded != LOADED)
         return 2;
-    }
-    Command* c = nullptr;
-    while ((c = p.popCommand()) != nullptr) {
+
+    Context ctx(numEvtLoops);
+    setLimits(ctx);
+    for (auto c : batchCommands(cmds))
         ctx.enqueueCommand(c);
-    }
     ctx.flushCmdQueue();
 
-    return 0;
+    if (showStats)
+        fprintf(stderr, "%s", formatStats(&ctx).c_str());
+
+    // like a shell, the status of the last command
+    return ctx.getLastStatus();
 }
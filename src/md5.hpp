@@ -0,0 +1,34 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/**
+ * Incremental MD5 hash, compatible with the output of `md5sum`. Only used to
+ * detect changed data, not for anything security related.
+ */
+class Md5 {
+public:
+    Md5();
+
+    void update(const void* data, size_t len);
+
+    /**
+     * Finishes the hash and returns it as 32 lowercase hex digits. The object
+     * must not be updated afterwards.
+     */
+    std::string hexDigest();
+
+    /**
+     * Convenience function to hash a single buffer
+     */
+    static std::string hash(const void* data, size_t len);
+
+private:
+    uint32_t state[4];
+    uint64_t length = 0;
+    unsigned char buffer[64];
+
+    void transform(const unsigned char* block);
+};
@@ -0,0 +1,300 @@
+#include "multicast.hpp"
+#include "execChannel.hpp"
+#include "context.hpp"
+#include "host.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+
+MulticastProcess::MulticastProcess(Context* ctx, const std::vector<std::string>& args)
+    : ctx(ctx), args(args) {}
+
+MulticastProcess::~MulticastProcess()
+{
+    // the channels have already been deleted on their event loops
+
+    if (srcFd != -1)
+        close(srcFd);
+}
+
+void MulticastProcess::start(ProcessFinishedCallback onFinish)
+{
+    this->onFinish = onFinish;
+
+    if (args.size() < 4) {
+        printError("usage: distribute SRC DEST HOST...");
+        finish(2);
+        return;
+    }
+
+    srcFd = open(args[1].c_str(), O_RDONLY | O_CLOEXEC);
+    if (srcFd == -1) {
+        printError(args[1] + ": " + strerror(errno));
+        finish(1);
+        return;
+    }
+    posix_fadvise(srcFd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    // look up every host before sending anything, so a typo in the last host
+    // name doesn't leave half of the hosts updated
+    dests.resize(args.size() - 3);
+    try {
+        for (size_t i = 0; i < dests.size(); i++) {
+            dests[i].hostAlias = args[i + 3];
+            dests[i].host = ctx->getHost(dests[i].hostAlias);
+        }
+    }
+    catch (std::exception& e) {
+        printError(e.what());
+        finish(1);
+        return;
+    }
+
+    // The data arrives as "<length>\n" headers each followed by that many
+    // bytes, and a final "0\n". DEST is only replaced once that final header
+    // has been received, so a source that fails to read or a dropped channel
+    // never leave a truncated file behind.
+    std::string cmd =
+        "f=" + shellQuotePath(args[2]) + "; t=\"$f.flassh-distribute\"; "
+        ": > \"$t\" || exit 1; "
+        "while read -r len; do "
+            "if [ \"$len\" = 0 ]; then exec mv -f \"$t\" \"$f\"; fi; "
+            "head -c \"$len\" >> \"$t\" || break; "
+        "done; "
+        "rm -f \"$t\"; echo \"incomplete data, $f not modified\" >&2; exit 1";
+    int errFd = getRedirectedFd(STDERR_FILENO);
+
+    std::lock_guard lck(mtx);
+    numRunning = dests.size();
+    for (auto& d : dests) {
+        Destination* pd = &d;
+        post(d, [this, pd, cmd, errFd] () { openDest(*pd, cmd, errFd); });
+    }
+}
+
+/**
+ * Runs `task` on the event loop of the host of `d`. Must be called with `mtx`
+ * held. The process only finishes once every posted task has run, so tasks
+ * never see a deleted process.
+ */
+void MulticastProcess::post(Destination& d, std::function<void()> task)
+{
+    ++pendingTasks;
+    d.host->getEvtLoop()->enqueueTask([this, task] () {
+        task();
+
+        std::unique_lock lck(mtx);
+        --pendingTasks;
+        if (numRunning > 0 || pendingTasks > 0 || finished)
+            return;
+        finished = true;
+        int status = exitStatus;
+        lck.unlock();
+        finish(status);
+    }, "distribute");
+}
+
+/**
+ * Opens the channel to `d` and starts sending. Runs on the event loop of the
+ * host of `d`.
+ */
+void MulticastProcess::openDest(Destination& d, const std::string& cmd, int errFd)
+{
+    try {
+        d.channel = new ExecChannel(d.host, cmd);
+        d.channel->onData = [errFd] (const char* data, size_t len, bool isStderr) {
+            // the remote side only prints error messages, on stderr
+            if (isStderr)
+                write(errFd, data, len);
+        };
+        d.channel->onWritable = [this, &d] () { pump(d); };
+        d.channel->onFinish = [this, &d] (int status) { onDestFinished(d, status); };
+        d.channel->exec();
+    }
+    catch (std::exception& e) {
+        printError(d.hostAlias + ": " + e.what());
+        delete d.channel;
+        d.channel = nullptr;
+
+        std::lock_guard lck(mtx);
+        exitStatus = 1;
+        markDone(d);
+        return;
+    }
+
+    pump(d);
+}
+
+/**
+ * Sends as much buffered data to `d` as its channel window allows, reading
+ * more from the source when `d` is the one furthest ahead. Runs on the event
+ * loop of the host of `d`.
+ */
+void MulticastProcess::pump(Destination& d)
+{
+    std::unique_lock lck(mtx);
+    d.starved = false;
+    while (!d.done && !d.eofSent) {
+        fill();
+
+        if (d.offset == readOffset) {
+            if (!srcEof) {
+                // fill() wakes us up once someone has read more
+                d.starved = true;
+                return;
+            }
+
+            lck.unlock();
+            d.channel->sendEof();
+            lck.lock();
+            d.eofSent = true;
+            return;
+        }
+
+        // find the chunk containing the next byte to send. It can't be
+        // dropped while the lock is released, because `d` hasn't sent it yet.
+        uint64_t start = chunksOffset;
+        auto it = chunks.begin();
+        while (d.offset >= start + it->size()) {
+            start += it->size();
+            ++it;
+        }
+        size_t skip = d.offset - start;
+        const char* data = it->data() + skip;
+        size_t avail = it->size() - skip;
+
+        lck.unlock();
+        size_t len = d.channel->write(data, avail);
+        lck.lock();
+
+        if (len == 0) {
+            // the window is full, wait for onWritable
+            return;
+        }
+
+        d.offset += len;
+        dropSentChunks();
+    }
+}
+
+/**
+ * Reads chunks from the source until it is `maxBuffered` bytes ahead of the
+ * slowest destination, then wakes up the destinations that were waiting for
+ * data. Each chunk is preceded by its length header. The final "0\n" header
+ * is only added after a clean EOF, so a read error makes the destinations
+ * discard what they received. Must be called with `mtx` held.
+ */
+void MulticastProcess::fill()
+{
+    bool moved = false;
+    while (!srcEof && readOffset - slowestOffset() < maxBuffered) {
+        std::vector<char> chunk(chunkSize);
+        ssize_t len = read(srcFd, chunk.data(), chunk.size());
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            printError(args[1] + ": " + strerror(errno));
+            exitStatus = 1;
+            srcEof = true;
+            moved = true;
+            break;
+        }
+
+        std::string header = std::to_string(len) + "\n";
+        chunks.emplace_back(header.begin(), header.end());
+        readOffset += header.size();
+        if (len == 0) {
+            srcEof = true;
+        }
+        else {
+            chunk.resize(len);
+            chunks.push_back(std::move(chunk));
+            readOffset += len;
+        }
+        moved = true;
+    }
+
+    if (!moved)
+        return;
+
+    for (auto& d : dests) {
+        if (d.starved && !d.done) {
+            d.starved = false;
+            Destination* pd = &d;
+            post(d, [this, pd] () { pump(*pd); });
+        }
+    }
+}
+
+void MulticastProcess::dropSentChunks()
+{
+    uint64_t slowest = slowestOffset();
+    while (!chunks.empty() && chunksOffset + chunks.front().size() <= slowest) {
+        chunksOffset += chunks.front().size();
+        chunks.pop_front();
+    }
+}
+
+uint64_t MulticastProcess::slowestOffset() const
+{
+    // destinations that already finished (or failed) don't hold anyone back
+    uint64_t slowest = readOffset;
+    for (auto& d : dests) {
+        if (!d.done && d.offset < slowest)
+            slowest = d.offset;
+    }
+    return slowest;
+}
+
+void MulticastProcess::onDestFinished(Destination& d, int status)
+{
+    std::lock_guard lck(mtx);
+    if (status != 0) {
+        printError(d.hostAlias + ": exited with status " + std::to_string(status));
+        exitStatus = 1;
+    }
+    else if (!d.eofSent) {
+        printError(d.hostAlias + ": channel closed before all data was sent");
+        exitStatus = 1;
+    }
+    markDone(d);
+
+    // can't delete the channel from inside its own callback
+    Destination* pd = &d;
+    post(d, [pd] () {
+        delete pd->channel;
+        pd->channel = nullptr;
+    });
+}
+
+/**
+ * Stops waiting for `d`. Must be called with `mtx` held.
+ */
+void MulticastProcess::markDone(Destination& d)
+{
+    d.done = true;
+    --numRunning;
+
+    // the others may have been waiting on this one
+    dropSentChunks();
+    if (numRunning > 0)
+        fill();
+}
+
+void MulticastProcess::finish(int status)
+{
+    if (srcFd != -1) {
+        close(srcFd);
+        srcFd = -1;
+    }
+    chunks.clear();
+
+    if (onFinish)
+        onFinish(status);
+}
+
+void MulticastProcess::printError(const std::string& msg)
+{
+    std::string line = "distribute: " + msg + "\n";
+    write(getRedirectedFd(STDERR_FILENO), line.data(), line.size());
+}
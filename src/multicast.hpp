@@ -0,0 +1,81 @@
+#pragma once
+
+#include "process.hpp"
+#include <deque>
+#include <cstdint>
+#include <mutex>
+#include <functional>
+
+class ExecChannel;
+class Host;
+
+/**
+ * Builtin `distribute SRC DEST HOST...`
+ *
+ * Copies the local file SRC to DEST on every HOST. The source is read only
+ * once, in large sequential chunks that are shared by all destinations and
+ * freed once the slowest destination has sent them. Each destination writes
+ * only as much as its channel window allows, so a slow host never blocks the
+ * others; reading pauses once the slowest host falls `maxBuffered` bytes
+ * behind, which bounds memory use.
+ *
+ * DEST is written to a temporary file next to it, which only replaces DEST
+ * once the whole source has been read without errors.
+ *
+ * Each destination is driven from the event loop of its host, so hosts on
+ * different loops send in parallel. The shared state is protected by `mtx`,
+ * which is not held while writing to a channel.
+ */
+class MulticastProcess : public Process {
+public:
+    MulticastProcess(Context* ctx, const std::vector<std::string>& args);
+    ~MulticastProcess();
+
+    void start(ProcessFinishedCallback onFinish);
+
+    static constexpr size_t chunkSize = 1 << 20;
+    static constexpr size_t maxBuffered = 16 * chunkSize;
+
+private:
+    struct Destination {
+        std::string hostAlias;
+        Host* host = nullptr;
+        ExecChannel* channel = nullptr;
+        uint64_t offset = 0;        // number of bytes sent so far
+        bool eofSent = false;
+        bool starved = false;       // waiting for more data from the source
+        bool done = false;          // channel closed
+    };
+
+    Context* ctx;
+    std::vector<std::string> args;
+    std::vector<Destination> dests;
+    ProcessFinishedCallback onFinish;
+
+    std::mutex mtx;
+    size_t numRunning = 0;
+    size_t pendingTasks = 0;        // tasks queued on the hosts' event loops
+    bool finished = false;
+    int exitStatus = 0;
+
+    int srcFd = -1;
+    bool srcEof = false;
+    uint64_t readOffset = 0;
+
+    // chunks that have not been sent to every destination yet, the first
+    // one starting at `chunksOffset`
+    std::deque<std::vector<char>> chunks;
+    uint64_t chunksOffset = 0;
+
+    void post(Destination& d, std::function<void()> task);
+    void openDest(Destination& d, const std::string& cmd, int errFd);
+    void pump(Destination& d);
+    void fill();
+    void dropSentChunks();
+    uint64_t slowestOffset() const;
+    void onDestFinished(Destination& d, int status);
+    void markDone(Destination& d);
+    void finish(int status);
+
+    void printError(const std::string& msg);
+};
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <cstddef>
+#include <mutex>
+#include <new>
+
+/**
+ * Base class that makes `new T` and `delete` of a T reuse freed memory. Up to
+ * `maxFree` blocks are kept on a free list; beyond that, and for classes
+ * derived from T, the heap is used as usual.
+ *
+ * The list is shared by all threads, since objects such as processes are
+ * often deleted on another event loop than the one that created them.
+ */
+template <class T, size_t maxFree = 64>
+class Pooled {
+public:
+    static void* operator new(size_t size)
+    {
+        if (size == sizeof(T)) {
+            std::lock_guard lck(mtx);
+            if (numFree > 0)
+                return freeList[--numFree];
+        }
+        return ::operator new(size);
+    }
+
+    static void operator delete(void* p, size_t size)
+    {
+        if (size == sizeof(T)) {
+            std::lock_guard lck(mtx);
+            if (numFree < maxFree) {
+                freeList[numFree++] = p;
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+
+private:
+    static inline std::mutex mtx;
+    static inline void* freeList[maxFree];
+    static inline size_t numFree = 0;
+};
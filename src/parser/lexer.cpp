@@ -1,5 +1,6 @@
 #include "lexer.hpp"
 #include "symbols.hpp"
+#include "../expansion.hpp"
 #include <stdexcept>
 
 using namespace Symbols;
@@ -35,6 +36,13 @@ bool Lexer::isComplete() const
     return curTok == nullptr;
 }
 
+std::string Lexer::popError()
+{
+    std::string ret;
+    ret.swap(error);
+    return ret;
+}
+
 void Lexer::pushChar(char c)
 {
     if (curTok == nullptr) {
@@ -74,9 +82,12 @@ void Lexer::pushToken(int symbol)
 
     curTok->symbol = symbol;
 
-    // see if we can upgrade from STR to VARNAME
-    if (curTok->symbol == STR && !tokenWasEverQuotedOrEscaped && isVarname(curTok->str)) {
-        curTok->symbol = VARNAME;
+    // see if we can upgrade from STR to VARNAME or MODIFIER
+    if (curTok->symbol == STR && !tokenWasEverQuotedOrEscaped) {
+        if (isVarname(curTok->str))
+            curTok->symbol = VARNAME;
+        else if (curTok->str[0] == '@' && isVarname(curTok->str.substr(1)))
+            curTok->symbol = MODIFIER;
     }
 
     tokenQueue.push_back(curTok);
@@ -97,7 +108,23 @@ static bool isOp(char c)
             c == ';' ||
             c == '=' ||
             c == '|' ||
-            c == '&');
+            c == '&' ||
+            c == '>' ||
+            c == '<');
+}
+
+/**
+ * Returns `true` if `str` is a non-empty string of digits
+ */
+static bool isDigits(const std::string& str)
+{
+    if (str.empty())
+        return false;
+    for (char c : str) {
+        if (!isdigit(c))
+            return false;
+    }
+    return true;
 }
 
 /**
@@ -107,7 +134,8 @@ static bool isOpStart(char c)
 {
     return (c == ':' ||
             c == '|' ||
-            c == '&');
+            c == '&' ||
+            c == '>');
 }
 
 static int oneCharOpToSymbol(char c)
@@ -123,6 +151,10 @@ static int oneCharOpToSymbol(char c)
         return PIPE;
     case '&':
         return AMPERSAND;
+    case '>':
+        return GREATER;
+    case '<':
+        return LESS;
     default:
         throw std::invalid_argument("bad arg for oneCharOpToSymbol");
     }
@@ -149,6 +181,11 @@ void Lexer::handleDefault(char c)
         nextHandler = &Lexer::handleEscaped;
         tokenWasEverQuotedOrEscaped = true;
     }
+    // possibly the start of an expansion
+    else if (c == '$') {
+        afterExpansion = &Lexer::handleDefault;
+        nextHandler = &Lexer::handleDollar;
+    }
     // space characters end the current token
     else if (isspace(c)) {
         pushToken(STR);
@@ -162,7 +199,9 @@ void Lexer::handleDefault(char c)
     }
     // operators end the current token
     else if (isOp(c) && !tokenWasEverQuotedOrEscaped) {
-        pushToken(STR);
+        // digits right in front of a redirection are its FD, e.g. `2>`
+        bool ioNumber = (c == '>' || c == '<') && curTok != nullptr && isDigits(curTok->str);
+        pushToken(ioNumber ? IO_NUMBER : STR);
         pushChar(c);
 
         if (isOpStart(c)) {
@@ -210,6 +249,13 @@ void Lexer::handleOp(char c)
             handled = true;
         }
     }
+    else if (curTok->str == ">") {
+        if (c == '>') {
+            pushChar(c);
+            pushToken(GREATER2);
+            handled = true;
+        }
+    }
     else {
         throw std::logic_error("bad curTok->str in Lexer::handleOp");
     }
@@ -246,6 +292,11 @@ void Lexer::handleQuoted(char c)
     else if (c == '\\' && quote == '\"') {
         nextHandler = &Lexer::handleQuotedEscaped;
     }
+    // expansions also happen inside double quotes
+    else if (c == '$' && quote == '\"') {
+        afterExpansion = &Lexer::handleQuoted;
+        nextHandler = &Lexer::handleDollar;
+    }
     // otherwise: write character as-is
     else {
         pushChar(c);
@@ -272,8 +323,8 @@ void Lexer::handleQuotedEscaped(char c)
     if (c == '\\') {
         pushChar(c);
     }
-    // escaped matching quote --> just the quote
-    else if (c == quote) {
+    // escaped matching quote or dollar sign --> just the character
+    else if (c == quote || c == '$') {
         pushChar(c);
     }
     // newline --> do nothing for bash compatibility
@@ -285,3 +336,112 @@ void Lexer::handleQuotedEscaped(char c)
     }
     nextHandler = &Lexer::handleQuoted;
 }
+
+/**
+ * Previous character was an unquoted or double quoted `$`. Expansions are
+ * written to the token between `Expansion::mark`s, see expansion.hpp; a `$`
+ * that doesn't start one stays as it is.
+ */
+void Lexer::handleDollar(char c)
+{
+    nextHandler = afterExpansion;
+    if (c == '(') {
+        pushChar(Expansion::mark);
+        pushChar('(');
+        substDepth = 1;
+        substQuote = 0;
+        substEscaped = false;
+        nextHandler = &Lexer::handleSubstitution;
+    }
+    else if (c == '{') {
+        pushChar(Expansion::mark);
+        pushChar('{');
+        nextHandler = &Lexer::handleBracedVarName;
+    }
+    else if (c == '?') {
+        pushChar(Expansion::mark);
+        pushChar('{');
+        pushChar('?');
+        pushChar(Expansion::mark);
+    }
+    else if (isalpha(c) || c == '_') {
+        pushChar(Expansion::mark);
+        pushChar('{');
+        pushChar(c);
+        nextHandler = &Lexer::handleVarName;
+    }
+    else {
+        pushChar('$');
+        (this->*nextHandler)(c);
+    }
+}
+
+/**
+ * Inside the name of a `$NAME` expansion, which ends at the first character
+ * that can't be part of a name
+ */
+void Lexer::handleVarName(char c)
+{
+    if (isalnum(c) || c == '_') {
+        pushChar(c);
+        return;
+    }
+
+    pushChar(Expansion::mark);
+    nextHandler = afterExpansion;
+    (this->*nextHandler)(c);
+}
+
+/**
+ * Inside the braces of a `${NAME}` expansion
+ */
+void Lexer::handleBracedVarName(char c)
+{
+    if (c == '}') {
+        pushChar(Expansion::mark);
+        nextHandler = afterExpansion;
+    }
+    else if (isalnum(c) || c == '_' || c == '?') {
+        pushChar(c);
+    }
+    else {
+        if (error.empty())
+            error = "bad substitution: unexpected " + std::string(c == '\n' ? "newline" : std::string(1, c)) + " in ${}";
+
+        // drop the token and skip to the next line
+        delete curTok;
+        curTok = nullptr;
+        nextHandler = c == '\n' ? &Lexer::handleDefault : &Lexer::handleCommented;
+    }
+}
+
+/**
+ * Inside `$(...)`. The command is kept as it is written and parsed when it
+ * runs, so only quotes, escapes and nested parentheses are tracked here, to
+ * find the closing parenthesis.
+ */
+void Lexer::handleSubstitution(char c)
+{
+    if (substEscaped) {
+        substEscaped = false;
+    }
+    else if (c == '\\' && substQuote != '\'') {
+        substEscaped = true;
+    }
+    else if (substQuote != 0) {
+        if (c == substQuote)
+            substQuote = 0;
+    }
+    else if (isQuote(c)) {
+        substQuote = c;
+    }
+    else if (c == '(') {
+        ++substDepth;
+    }
+    else if (c == ')' && --substDepth == 0) {
+        pushChar(Expansion::mark);
+        nextHandler = afterExpansion;
+        return;
+    }
+    pushChar(c);
+}
@@ -32,12 +32,20 @@ public:
      */
     bool isComplete() const;
 
+    /**
+     * Returns the first error in the input since the last call, or an empty
+     * string if there was none. The rest of the line with the error is
+     * skipped.
+     */
+    std::string popError();
+
 private:
     int line = 1;
     int col = 1;
 
     Token* curTok = nullptr;
     std::deque<Token*> tokenQueue;
+    std::string error;
 
     /**
      * Pushes a character to the current token
@@ -59,8 +67,20 @@ private:
     void handleQuoted(char c);
     void handleEscaped(char c);
     void handleQuotedEscaped(char c);
+    void handleDollar(char c);
+    void handleVarName(char c);
+    void handleBracedVarName(char c);
+    void handleSubstitution(char c);
 
     // these get rid of a few state permutations
     char quote = 0;
     bool tokenWasEverQuotedOrEscaped;
+
+    // state to go back to after an expansion, i.e. quoted or not
+    CharHandler afterExpansion = nullptr;
+
+    // inside `$(...)`
+    int substDepth = 0;
+    char substQuote = 0;
+    bool substEscaped = false;
 };
@@ -2,6 +2,7 @@
 #include "util.hpp"
 #include "symbols.hpp"
 #include <stack>
+#include <unistd.h>
 
 using namespace Symbols;
 using namespace std::placeholders;
@@ -32,18 +33,41 @@ FlasshGrammar::FlasshGrammar()
     addRule(SET_HOST, {{ VARNAME, ge0(SPACE), COLON, ge0(SPACE) }});
 
     addRule(COMMAND_LIST, {
-        { COMMAND, ge0(SPACE), opt(SEMICOLON) },
-        { COMMAND, ge0(SPACE), SEMICOLON, ge0(SPACE), COMMAND_LIST }});
+        { AND_OR_LIST, ge0(SPACE), opt(SEMICOLON) },
+        { AND_OR_LIST, ge0(SPACE), SEMICOLON, ge0(SPACE), COMMAND_LIST }});
+
+    // `&&` and `||` have the same precedence and group from the left, pipes
+    // bind tighter
+    addRule(AND_OR_LIST, {{ COMMAND, ge0(AND_OR) }});
+    addRule(AND_OR, {{ ge0(SPACE), AND_OR_OP, ge0(SPACE_OR_NEWLINE), COMMAND }});
+    addRule(AND_OR_OP, {
+        { LOG_AND },
+        { LOG_OR }});
 
     addRule(COMMAND, {
+        { ASSIGNMENT },
         { SIMPLE_COMMAND },
         { PIPE_COMMAND }});
 
+    addRule(ASSIGNMENT, {{ VARNAME, EQUALS, opt(ARG) }});
     addRule(PIPE_COMMAND, {{ SIMPLE_COMMAND, ge0(SPACE), PIPE, ge0(SPACE_OR_NEWLINE), COMMAND }});
-    addRule(SIMPLE_COMMAND, {{ opt(CMD_HOST), ARG_LIST }});
+    addRule(SIMPLE_COMMAND, {{ CMD_MODIFIERS, opt(CMD_HOST), ARG_LIST, ge0(REDIRECT) }});
+    // unlike ge0(), try the modifiers before the empty rule, otherwise
+    // `@cache 1h ls` would run a command named `@cache`
+    addRule(CMD_MODIFIERS, {
+        { CMD_MODIFIER, CMD_MODIFIERS },
+        {} });
+    addRule(CMD_MODIFIER, {{ MODIFIER, ge1(SPACE), ARG, ge1(SPACE) }});
     addRule(CMD_HOST, {{ opt({ VARNAME, ge0(SPACE) }), COLON2, ge0(SPACE) }});
-    addRule(DEFINE_HOST, {{ VARNAME, ge0(SPACE), COLON_EQ, ge0(SPACE), ARG, opt(HOST_PORT) }});
+    addRule(REDIRECT, {{ ge0(SPACE), opt(IO_NUMBER), REDIRECT_OP, ge0(SPACE), opt(REDIRECT_HOST), ARG }});
+    addRule(REDIRECT_OP, {
+        { GREATER },
+        { GREATER2 },
+        { LESS }});
+    addRule(REDIRECT_HOST, {{ opt(VARNAME), COLON2 }});
+    addRule(DEFINE_HOST, {{ VARNAME, ge0(SPACE), COLON_EQ, ge0(SPACE), ARG, opt(HOST_PORT), ge0(HOST_OPTION) }});
     addRule(HOST_PORT, {{ COLON, ARG }});
+    addRule(HOST_OPTION, {{ ge1(SPACE), VARNAME, EQUALS, ARG }});
 
     addRule(ARG_LIST, {
         { ARG },
@@ -51,7 +75,8 @@ FlasshGrammar::FlasshGrammar()
 
     addRule(ARG, {
         { VARNAME },
-        { STR }});
+        { STR },
+        { MODIFIER }});
 
     addRule(SPACE_OR_NEWLINE, {
         { SPACE },
@@ -98,8 +123,19 @@ Command* Parser::popCommand()
 
 void Parser::parse(const std::string& buf)
 {
+    syntaxError = false;
     lex.input(buf);
 
+    // none of the input runs if the lexer rejected some of it
+    std::string lexError = lex.popError();
+    if (!lexError.empty()) {
+        reportError(lexError);
+        for (Token* tok = lex.popToken(); tok != nullptr; tok = lex.popToken())
+            delete tok;
+        deleteTokens(tokens.size());
+        return;
+    }
+
     // if lexer got incomplete input, wait until we get more input
     if (!lex.isComplete())
         return;
@@ -201,6 +237,7 @@ void Parser::parse(const std::string& buf)
         else if (maxUnmatchedToken < tokens.size()) {
             // TODO: line number?
             fprintf(stderr, "Syntax error: unexpected token %s\n", tokens[maxUnmatchedToken]->str.c_str());
+            syntaxError = true;
             deleteTokens(tokens.size());
         }
         else {
@@ -222,6 +259,12 @@ void Parser::parse(const std::string& buf)
 
     // build commands
     parseTree->traverse(std::bind(&Parser::enter, this, _1), std::bind(&Parser::leave, this, _1));
+    if (syntaxError) {
+        while (!commands.empty()) {
+            delete commands.front();
+            commands.pop();
+        }
+    }
 
     // FIXME
     deleteTokens(tokens.size());
@@ -236,26 +279,76 @@ void Parser::enter(ParseTreeNode* n)
         if (!setHost.empty()) {
             alias = setHost[0]->findSymbol(VARNAME).at(0)->concatTokens();
         }
-        hostAliasStack.push(alias);
+        hostAliasStack.push(StringTable::hostAliases().intern(alias));
     }
     else if (n->getSymbol() == SIMPLE_COMMAND) {
-        auto argNodes = n->findSymbol(ARG);
-        std::vector<std::string> args;
+        // only look at the outermost ARG_LIST, the redirections have ARGs too
+        auto argNodes = n->findSymbol(ARG_LIST).at(0)->findSymbol(ARG);
+        std::vector<StringTable::Id> args;
         for (auto an : argNodes) {
-            args.push_back(an->concatTokens());
+            args.push_back(StringTable::args().intern(an->concatTokens()));
         }
         auto hostOverride = n->findSymbol(CMD_HOST);
-        std::string hostAlias;
+        HostId host = localHost;
         if (!hostOverride.empty()) {
             auto hostName = hostOverride.at(0)->findSymbol(VARNAME);
             if (!hostName.empty()) {
-                hostAlias = hostName.at(0)->concatTokens();
+                host = StringTable::hostAliases().intern(hostName.at(0)->concatTokens());
             }
         }
         else {
-            hostAlias = hostAliasStack.top();
+            host = hostAliasStack.top();
+        }
+
+        CommandModifiers modifiers;
+        for (auto mn : n->findSymbol(CMD_MODIFIER)) {
+            std::string name = mn->getChildren().at(0)->concatTokens().substr(1);
+            std::string value = mn->findSymbol(ARG).at(0)->concatTokens();
+            if (!modifiers.set(name, value)) {
+                reportError("bad modifier @" + name + " " + value);
+            }
         }
-        cmdStack.push(new SimpleCommand(hostAlias, args));
+
+        std::vector<FileRedir> fileRedirs;
+        for (auto rn : n->findSymbol(REDIRECT)) {
+            FileRedir r;
+            int op = rn->findSymbol(REDIRECT_OP).at(0)->getChildren().at(0)->getSymbol();
+            r.fd = (op == LESS) ? STDIN_FILENO : STDOUT_FILENO;
+            r.mode = (op == LESS) ? FileRedir::READ :
+                     (op == GREATER2) ? FileRedir::APPEND : FileRedir::WRITE;
+
+            // single digits, like a POSIX shell has to support at least
+            auto ioNumber = rn->findSymbol(IO_NUMBER);
+            if (!ioNumber.empty()) {
+                std::string fd = ioNumber.at(0)->concatTokens();
+                if (fd.size() > 1)
+                    reportError("bad file descriptor " + fd);
+                else
+                    r.fd = fd[0] - '0';
+            }
+
+            // like commands, files are on the default host unless overridden
+            auto redirHost = rn->findSymbol(REDIRECT_HOST);
+            if (!redirHost.empty()) {
+                auto hostName = redirHost.at(0)->findSymbol(VARNAME);
+                if (!hostName.empty()) {
+                    r.host = StringTable::hostAliases().intern(hostName.at(0)->concatTokens());
+                }
+            }
+            else {
+                r.host = hostAliasStack.top();
+            }
+
+            r.path = rn->findSymbol(ARG).at(0)->concatTokens();
+            fileRedirs.push_back(r);
+        }
+        cmdStack.push(new SimpleCommand(host, args, fileRedirs, modifiers));
+    }
+    else if (n->getSymbol() == ASSIGNMENT) {
+        std::string name = n->getChildren()[0]->concatTokens();
+        auto valueNodes = n->findSymbol(ARG);
+        std::string value = valueNodes.empty() ? "" : valueNodes.at(0)->concatTokens();
+        cmdStack.push(new AssignCommand(StringTable::variables().intern(name), StringTable::args().intern(value)));
     }
     else if (n->getSymbol() == PIPE_COMMAND) {
         
@@ -270,7 +363,15 @@ void Parser::enter(ParseTreeNode* n)
         hostStr += n->findSymbol(flasshGrammar.opt(HOST_PORT)).at(0)->concatTokens();
         
         if (!info.parse(hostStr)) {
-            throw std::runtime_error("bad host definition");
+            reportError("bad host definition " + hostStr);
+        }
+
+        for (auto on : n->findSymbol(HOST_OPTION)) {
+            std::string name = on->findSymbol(VARNAME).at(0)->concatTokens();
+            std::string value = on->findSymbol(ARG).at(0)->concatTokens();
+            if (!info.setOption(name, value)) {
+                reportError("bad host option " + name + "=" + value);
+            }
         }
 
         cmdStack.push(new NewHostCommand(alias, info));
@@ -299,6 +400,25 @@ void Parser::leave(ParseTreeNode* n)
         cmdStack.pop();
         cmdStack.push(new PipeCommand(left, right));
     }
+    else if (n->getSymbol() == AND_OR) {
+        // the left side is everything before this operator in the list
+        int op = n->findSymbol(AND_OR_OP).at(0)->getChildren().at(0)->getSymbol();
+        auto right = cmdStack.top();
+        cmdStack.pop();
+        auto left = cmdStack.top();
+        cmdStack.pop();
+        cmdStack.push(new AndOrCommand(left, right, op == LOG_AND ? AndOrCommand::AND : AndOrCommand::OR));
+    }
+}
+
+/**
+ * Reports an error in input that parsed, e.g. a bad value. Like after a
+ * syntax error, no commands are returned for the input.
+ */
+void Parser::reportError(const std::string& msg)
+{
+    fprintf(stderr, "Syntax error: %s\n", msg.c_str());
+    syntaxError = true;
 }
 
 void Parser::deleteTokens(size_t numTokens)
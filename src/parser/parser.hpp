@@ -29,6 +29,13 @@ public:
      */
     void parse(const std::string& buf);
 
+    /**
+     * Returns `true` if the last call to `parse()` reported a syntax error.
+     * The tokens up to the error are dropped, and no commands are returned
+     * for them.
+     */
+    bool hadSyntaxError() const { return syntaxError; }
+
 private:
     std::queue<Command*> commands;
 
@@ -36,12 +43,14 @@ private:
     std::deque<Token*> tokens;
 
     bool parseIncomplete = false;
+    bool syntaxError = false;
 
     // commands that are currently being built
     std::stack<Command*> cmdStack;
-    std::stack<std::string> hostAliasStack;
+    std::stack<HostId> hostAliasStack;
 
     void enter(ParseTreeNode* node);
+    void reportError(const std::string& msg);
     void leave(ParseTreeNode* node);
 
     void deleteTokens(size_t numTokens);
@@ -5,6 +5,8 @@ namespace Symbols {
 enum Terminals {
     VARNAME,    // must match the regex [A-Za-z_]\w* and have no quotes or escapes
     STR,        // arbitrary string of characters that isn't a VARNAME
+    MODIFIER,   // @ followed by a VARNAME, with no quotes or escapes
+    IO_NUMBER,  // digits right in front of < or >, the FD of a redirection
 
     SPACE,      // whitespace, excluding \n
     NEWLINE,    // \n
@@ -14,11 +16,14 @@ enum Terminals {
     EQUALS,     // =
     PIPE,       // |
     AMPERSAND,  // &
+    GREATER,    // >
+    LESS,       // <
     
     COLON2,     // ::
     COLON_EQ,   // :=
-    LOG_OR,     // &&
-    LOG_AND,    // ||
+    LOG_OR,     // ||
+    LOG_AND,    // &&
+    GREATER2,   // >>
 
     NUM_TERMINAL_SYMBOLS
 };
@@ -28,12 +33,22 @@ enum NonTerminals {
     FULL_COMMAND,
     SET_HOST,
     COMMAND_LIST,
+    AND_OR_LIST,
+    AND_OR,
+    AND_OR_OP,
     COMMAND,
+    ASSIGNMENT,
     SIMPLE_COMMAND,
+    CMD_MODIFIERS,
+    CMD_MODIFIER,
     CMD_HOST,
     PIPE_COMMAND,
     DEFINE_HOST,
     HOST_PORT,
+    HOST_OPTION,
+    REDIRECT,
+    REDIRECT_OP,
+    REDIRECT_HOST,
     ARG,
     ARG_LIST,
     SPACE_OR_NEWLINE,
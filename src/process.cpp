@@ -1,36 +1,95 @@
 #include "process.hpp"
 #include "context.hpp"
+#include "remoteFile.hpp"
+#include "host.hpp"
+#include "eventLoop.hpp"
+#include "trace.hpp"
+#include "stallDetector.hpp"
 #include <libssh/callbacks.h>
 #include <stdexcept>
 #include <sys/wait.h>
 #include <unistd.h>
 #include <cstring>
 #include <thread>
+#include <csignal>
+#include <fcntl.h>
+#include <algorithm>
 
 void Process::redirectIo(int fdLocal, int fdProc)
 {
     ioRedirs.push_back({ fdLocal, fdProc });
 }
 
+void Process::redirectIo(const std::vector<IoRedir>& redirs)
+{
+    ioRedirs.insert(ioRedirs.end(), redirs.begin(), redirs.end());
+}
+
+int Process::getRedirectedFd(int fdProc) const
+{
+    // later redirections take precedence
+    for (auto it = ioRedirs.rbegin(); it != ioRedirs.rend(); ++it) {
+        if (it->newfd == fdProc)
+            return it->oldfd;
+    }
+    return fdProc;
+}
 
 
-LocalProcess::LocalProcess(const std::vector<std::string>& args) : args(args)
+
+LocalProcess::LocalProcess(const std::vector<StringTable::Id>& args)
 {
     if (args.empty())
         throw std::invalid_argument("Tried to create process with no args");
 
-    for (auto& argStr : args) {
-        argv.push_back(argStr.c_str());
+    argv = argvInline;
+    if (args.size() > inlineArgs) {
+        argvHeap.resize(args.size() + 1);
+        argv = argvHeap.data();
+    }
+
+    // interned strings never move, so argv can point right at them
+    for (size_t i = 0; i < args.size(); i++) {
+        argv[i] = StringTable::args().get(args[i]).c_str();
     }
-    argv.push_back(nullptr);
+    argv[args.size()] = nullptr;
+}
+
+LocalProcess::LocalProcess(const std::vector<std::string>& args)
+{
+    if (args.empty())
+        throw std::invalid_argument("Tried to create process with no args");
+
+    argv = argvInline;
+    if (args.size() > inlineArgs) {
+        argvHeap.resize(args.size() + 1);
+        argv = argvHeap.data();
+    }
+
+    for (size_t i = 0; i < args.size(); i++) {
+        argv[i] = args[i].c_str();
+    }
+    argv[args.size()] = nullptr;
 }
 
 void LocalProcess::start(ProcessFinishedCallback onFinish)
 {
+    // when tracing, the exec is seen as EOF on a close-on-exec pipe
+    int execPipe[2] = { -1, -1 };
+    if (Trace::isEnabled()) {
+        Trace::asyncBegin("LocalProcess", this, argv[0]);
+        if (pipe2(execPipe, O_CLOEXEC) == -1)
+            execPipe[0] = execPipe[1] = -1;
+    }
+    uint64_t forkStart = Trace::now();
+
     // TODO: more robust error handling
     pid = fork();
     if (pid == 0) {
         // child
+
+        // flassh ignores SIGPIPE, but the child shouldn't
+        signal(SIGPIPE, SIG_DFL);
         
         // apply I/O redirection
         for (auto& r : ioRedirs) {
@@ -40,23 +99,43 @@ void LocalProcess::start(ProcessFinishedCallback onFinish)
             }
         }
 
-        execvp(argv[0], (char* const*)argv.data());
+        execvp(argv[0], (char* const*)argv);
 
-        // if we got here, then exec failed
+        // if we got here, then exec failed; same statuses as a shell
         fprintf(stderr, "exec failed: %s\n", strerror(errno));
-        exit(1);    // TODO: is there a special error code for this?
+        exit(errno == ENOENT ? 127 : 126);
     }
     else if (pid > 0) {
         // parent
+        Trace::complete("fork", forkStart, argv[0]);
+        if (execPipe[1] != -1)
+            close(execPipe[1]);
 
         // wait for process to finish in another thread
-        std::thread t([this, onFinish] () {
+        std::thread t([this, onFinish, execPipe] () {
+            Trace::setThreadName("waitpid");
+            if (execPipe[0] != -1) {
+                char c;
+                while (read(execPipe[0], &c, 1) == -1 && errno == EINTR) {}
+                close(execPipe[0]);
+                Trace::asyncInstant("exec", this);
+            }
+
             int status = -1;
+            uint64_t waitStart = Trace::now();
             int rc = waitpid(pid, &status, 0);
             if (rc == -1) {
                 fprintf(stderr, "waitpid failed\n");
             }
             pid = 0;
+            Trace::complete("waitpid", waitStart, argv[0]);
+            Trace::asyncEnd("LocalProcess", this, "status " + std::to_string(status));
+
+            // report it like a shell does, 128 + N for signal N
+            if (WIFEXITED(status))
+                status = WEXITSTATUS(status);
+            else if (WIFSIGNALED(status))
+                status = 128 + WTERMSIG(status);
 
             if (onFinish)
                 onFinish(status);
@@ -66,49 +145,59 @@ void LocalProcess::start(ProcessFinishedCallback onFinish)
         t.detach();
     }
     else {
+        if (execPipe[0] != -1) {
+            close(execPipe[0]);
+            close(execPipe[1]);
+        }
         throw std::runtime_error("fork failed");
     }
 }
 
 
 
-RemoteProcess::RemoteProcess(ssh_session session, Context* ctx, const std::vector<std::string>& args)
-    : ctx(ctx), session(session)
+RemoteProcess::RemoteProcess(Host* host, Context* ctx, const std::vector<std::string>& args)
+    : ctx(ctx), host(host)
 {
-    channel = ssh_channel_new(session);
-    if (channel == nullptr) {
-        throw std::runtime_error(ssh_get_error(session));
-    }
-
-    int rc = ssh_channel_open_session(channel);
-    if (rc != SSH_OK) {
-        ssh_channel_free(channel);
-        channel = nullptr;
-        throw std::runtime_error(ssh_get_error(session));
-    }
-
     // TODO: no libssh function that takes a list of strings as args?
     // TODO: probably missing some escape sequences
     for (auto& a : args) {
         cmd += a + " ";
     }
+    label = host->getInfo().hostName + ": " + cmd;
+    timeout = host->getInfo().timeout;
+}
 
-    // setup callback so we can get exit status
-    auto cb = new ssh_channel_callbacks_struct;
-    memset(cb, 0, sizeof(*cb));
-    cb->userdata = this;
-    cb->channel_data_function = staticOnData;   // TODO: remove once libssh connectors work better
-    cb->channel_exit_status_function = staticOnExitStatus;
-    cb->channel_close_function = staticOnClose;
-    // TODO: signals
-    ssh_callbacks_init(cb);
+bool RemoteProcess::redirectToRemoteFile(RemoteFile* file, int fdProc)
+{
+    // the file can only be written from the event loop of its own host
+    if (file->getHost()->getEvtLoop() != host->getEvtLoop())
+        return false;
+
+    if (fdProc == STDOUT_FILENO)
+        stdoutFile = file;
+    else if (fdProc == STDERR_FILENO)
+        stderrFile = file;
+    else
+        return false;
+    return true;
+}
 
-    if (SSH_OK != ssh_set_channel_callbacks(channel, cb)) {
-        ssh_channel_close(channel);
-        ssh_channel_free(channel);
-        channel = nullptr;
-        throw std::runtime_error(ssh_get_error(session));
-    }
+bool RemoteProcess::captureStdout(std::string* out, bool tee)
+{
+    stdoutCapture = out;
+    teeStdout = tee;
+    return true;
+}
+
+bool RemoteProcess::setTimeout(uint64_t seconds)
+{
+    timeout = seconds;
+    return true;
+}
+
+void RemoteProcess::setStderrFilter(std::function<void(const char* data, size_t len)> filter)
+{
+    stderrFilter = filter;
 }
 
 void RemoteProcess::start(ProcessFinishedCallback onFinish)
@@ -117,8 +206,8 @@ void RemoteProcess::start(ProcessFinishedCallback onFinish)
 
     // setup default connectors, validate filenos
     bool stdinRedirected = false;
-    bool stdoutRedirected = false;
-    bool stderrRedirected = false;
+    bool stdoutRedirected = stdoutFile != nullptr;
+    bool stderrRedirected = stderrFile != nullptr;
     for (auto& r : ioRedirs) {
         if (r.newfd == STDIN_FILENO)
             stdinRedirected = true;
@@ -138,48 +227,268 @@ void RemoteProcess::start(ProcessFinishedCallback onFinish)
     if (!stderrRedirected)
         redirectIo(STDERR_FILENO, STDERR_FILENO);
 
+    Trace::asyncBegin("RemoteProcess", this, cmd);
+
+    // the session may only be used by the thread of its event loop
+    host->getEvtLoop()->enqueueTask([this] () {
+        host->acquireChannelSlot([this] () {
+            hasChannelSlot = true;
+            exec();
+        });
+    }, "RemoteProcess::exec");
+}
+
+/**
+ * Opens the channel and runs the command. Runs on the host's event loop.
+ */
+void RemoteProcess::exec()
+{
+    // the host may have lost its connection since the command started
+    if (!host->checkConnection()) {
+        fail("not connected to " + host->getInfo().hostName);
+        return;
+    }
+    session = host->getSession();
+
+    uint64_t openStart = Trace::now();
+    uint64_t openStartUs = monotonicUs();
+    channel = host->takeChannel();
+    if (channel == nullptr) {
+        std::string error = ssh_get_error(session);
+        host->checkConnection();
+        fail(error);
+        return;
+    }
+    lostCallback = host->onConnectionLost([this] () { onConnectionLost(); });
+    Trace::complete("ssh_channel_open_session", openStart);
+    host->getStats().channelOpen.add(monotonicUs() - openStartUs);
+
+    // setup callback so we can get exit status
+    auto cb = new ssh_channel_callbacks_struct;
+    memset(cb, 0, sizeof(*cb));
+    cb->userdata = this;
+    cb->channel_data_function = staticOnData;   // TODO: remove once libssh connectors work better
+    cb->channel_eof_function = staticOnEof;
+    cb->channel_exit_status_function = staticOnExitStatus;
+    cb->channel_close_function = staticOnClose;
+    // TODO: signals
+    ssh_callbacks_init(cb);
+
+    if (SSH_OK != ssh_set_channel_callbacks(channel, cb)) {
+        fail(ssh_get_error(session));
+        return;
+    }
+
     // TODO: change to libssh connectors if they become reliable enough
     // setup info for callbacks to forward data to/from the ssh channel
     for (auto& r : ioRedirs) {
         if (r.newfd == STDIN_FILENO) {
             stdinLocalFd = r.oldfd;
-            ctx->getEvtLoop()->addFdRead(r.oldfd, &RemoteProcess::forwardFdToChannel, this);
         }
-        else {
-            if (r.newfd == STDOUT_FILENO) {
-                stdoutLocalFd = r.oldfd;
-            }
-            else if (r.newfd == STDERR_FILENO) {
-                stderrLocalFd = r.oldfd;
-            }
+        else if (r.newfd == STDOUT_FILENO) {
+            stdoutLocalFd = r.oldfd;
+        }
+        else if (r.newfd == STDERR_FILENO) {
+            stderrLocalFd = r.oldfd;
         }
     }
 
     // start the process
+    uint64_t execStart = Trace::now();
     int rc = ssh_channel_request_exec(channel, cmd.c_str());
     if (rc != SSH_OK) {
-        ssh_channel_close(channel);
+        fail("ssh_channel_request_exec failed");
+        return;
+    }
+    Trace::complete("ssh_channel_request_exec", execStart);
+
+    if (timeout > 0) {
+        timeoutTimer = host->getEvtLoop()->addTimer(timeout * 1000000, [this] () {
+            onTimeout();
+        }, "RemoteProcess timeout");
+    }
+
+    watchStdin();
+}
+
+/**
+ * Reports an error while starting the process and finishes with
+ * `sshErrorStatus`
+ */
+void RemoteProcess::fail(const std::string& msg)
+{
+    fprintf(stderr, "flassh: %s\n", msg.c_str());
+
+    // freeing also closes the channel if it was opened
+    if (channel != nullptr) {
+        host->removeLostCallback(lostCallback);
         ssh_channel_free(channel);
-        throw std::runtime_error("ssh_channel_request_exec failed");
+        channel = nullptr;
+    }
+    releaseChannelSlot();
+
+    Trace::asyncEnd("RemoteProcess", this, msg);
+    onFinish(sshErrorStatus);
+}
+
+/**
+ * Stops a command that ran longer than its timeout. Asks the remote side to
+ * terminate it, but doesn't wait, since a command that hangs e.g. on a dead
+ * NFS mount may not react to signals either.
+ */
+void RemoteProcess::onTimeout()
+{
+    timeoutTimer = 0;
+    fprintf(stderr, "flassh: %s: timed out after %llus\n", label.c_str(), (unsigned long long)timeout);
+
+    ssh_set_blocking(session, 0);
+    ssh_channel_request_send_signal(channel, "TERM");
+    ssh_set_blocking(session, 1);
+    closeChannel();
+
+    Trace::asyncEnd("RemoteProcess", this, "timed out");
+    if (onFinish)
+        onFinish(timeoutStatus);
+}
+
+/**
+ * Finishes a process whose host has lost its connection. The channel is
+ * gone with it, so there won't be any more callbacks.
+ */
+void RemoteProcess::onConnectionLost()
+{
+    lostCallback = 0;
+    fprintf(stderr, "flassh: %s: connection lost\n", label.c_str());
+    closeChannel();
+
+    Trace::asyncEnd("RemoteProcess", this, "connection lost");
+    if (onFinish)
+        onFinish(sshErrorStatus);
+}
+
+/**
+ * Stops everything that uses the channel and frees it
+ */
+void RemoteProcess::closeChannel()
+{
+    stopWatchingStdin();
+    host->getEvtLoop()->cancelTimer(timeoutTimer);
+    host->getEvtLoop()->cancelTimer(readTimer);
+    timeoutTimer = 0;
+    readTimer = 0;
+    host->removeLostCallback(lostCallback);
+    lostCallback = 0;
+
+    ssh_set_blocking(session, 0);
+    ssh_channel_close(channel);
+    ssh_channel_free(channel);
+    channel = nullptr;
+    ssh_set_blocking(session, 1);
+    releaseChannelSlot();
+}
+
+void RemoteProcess::releaseChannelSlot()
+{
+    if (hasChannelSlot) {
+        host->releaseChannelSlot();
+        hasChannelSlot = false;
+    }
+}
+
+void RemoteProcess::watchStdin()
+{
+    host->getEvtLoop()->addFdRead(stdinLocalFd, &RemoteProcess::forwardFdToChannel, this, "RemoteProcess stdin");
+    stdinWatched = true;
+}
+
+void RemoteProcess::stopWatchingStdin()
+{
+    if (stdinWatched) {
+        host->getEvtLoop()->removeFdRead(stdinLocalFd);
+        stdinWatched = false;
+    }
+    host->getEvtLoop()->cancelTimer(stdinTimer);
+    stdinTimer = 0;
+}
+
+/**
+ * Stops reading stdin until the upload limit allows more
+ */
+void RemoteProcess::pauseStdin(uint64_t delayUs)
+{
+    stopWatchingStdin();
+    stdinTimer = host->getEvtLoop()->addTimer(delayUs, [this] () {
+        stdinTimer = 0;
+        watchStdin();
+    }, "RemoteProcess upload limit");
+}
+
+/**
+ * Reads the output that the download limit left in the channel, as much as
+ * the limit allows now, or all of it if `all` is set. It is in the channel's
+ * buffer already, so reading doesn't process packets, which could call back
+ * into this process.
+ */
+void RemoteProcess::readHeldBack(bool all)
+{
+    TokenBucket& down = host->getScheduler()->download();
+    char buf[16384];
+    for (int isStderr = 0; isStderr < 2; isStderr++) {
+        while (heldBack[isStderr] > 0) {
+            uint32_t want = std::min<uint32_t>(heldBack[isStderr], sizeof(buf));
+            uint32_t n = all ? want : down.take(want);
+            if (n == 0) {
+                readTimer = host->getEvtLoop()->addTimer(down.delayUs(want), [this] () {
+                    readTimer = 0;
+                    readHeldBack(false);
+                }, "RemoteProcess download limit");
+                return;
+            }
+
+            int len = ssh_channel_read_nonblocking(channel, buf, n, isStderr);
+            if (len <= 0) {
+                heldBack[isStderr] = 0;
+                break;
+            }
+            heldBack[isStderr] -= len;
+            deliver(buf, len, isStderr);
+        }
     }
 }
 
 int RemoteProcess::staticOnData(ssh_session session, ssh_channel channel, void* data, uint32_t len, int is_stderr, void* userdata)
 {
+    auto pThis = (RemoteProcess*)userdata;
+    StallTimer timer("RemoteProcess::onData", &pThis->label);
+
     // forward to member function
-    return ((RemoteProcess*)userdata)->onData(session, channel, data, len, is_stderr);
+    return pThis->onData(session, channel, data, len, is_stderr);
+}
+
+void RemoteProcess::staticOnEof(ssh_session session, ssh_channel channel, void* userdata)
+{
+    Trace::asyncInstant("EOF", userdata);
 }
 
 void RemoteProcess::staticOnExitStatus(ssh_session session, ssh_channel channel, int status, void* userdata)
 {
+    auto pThis = (RemoteProcess*)userdata;
+    StallTimer timer("RemoteProcess::onExitStatus", &pThis->label);
+
     // forward to member function
-    ((RemoteProcess*)userdata)->onExitStatus(session, channel, status);
+    pThis->onExitStatus(session, channel, status);
 }
 
 void RemoteProcess::staticOnClose(ssh_session session, ssh_channel channel, void* userdata)
 {
+    // the process may be deleted on another thread as soon as onFinish has
+    // been called, so the timer needs its own copy of the label
+    auto pThis = (RemoteProcess*)userdata;
+    std::string label = StallTimer::isEnabled() ? pThis->label : std::string();
+    StallTimer timer("RemoteProcess::onClose", &label);
+
     // forward to member function
-    ((RemoteProcess*)userdata)->onClose(session, channel);
+    pThis->onClose(session, channel);
 }
 
 int RemoteProcess::onData(ssh_session session, ssh_channel channel, void* data, uint32_t len, int is_stderr)
@@ -190,15 +499,55 @@ int RemoteProcess::onData(ssh_session session, ssh_channel channel, void* data,
         exit(1);
     }
 
+    // libssh passes everything that is buffered, including what was held
+    // back before, and keeps whatever isn't taken
+    TokenBucket& down = host->getScheduler()->download();
+    uint32_t n = down.take(len);
+    heldBack[is_stderr != 0] = len - n;
+    if (n < len && readTimer == 0) {
+        readTimer = host->getEvtLoop()->addTimer(down.delayUs(len - n), [this] () {
+            readTimer = 0;
+            readHeldBack(false);
+        }, "RemoteProcess download limit");
+    }
+    if (n > 0)
+        deliver((const char*)data, n, is_stderr);
+    return n;
+}
+
+/**
+ * Forwards output of the process to where it goes
+ */
+void RemoteProcess::deliver(const char* data, size_t len, bool isStderr)
+{
+    if (!gotFirstByte) {
+        Trace::asyncInstant("first byte", this);
+        gotFirstByte = true;
+    }
+
+    HostStats& stats = host->getStats();
+    (isStderr ? stats.stderrBytes : stats.stdoutBytes).add(len);
+
+    if (!isStderr && stdoutCapture != nullptr) {
+        stdoutCapture->append(data, len);
+        if (!teeStdout)
+            return;
+    }
+
     // forward output
-    if (is_stderr) {
-        write(stderrLocalFd, data, len);
+    RemoteFile* file = isStderr ? stderrFile : stdoutFile;
+    if (isStderr && stderrFilter) {
+        stderrFilter(data, len);
+    }
+    else if (file != nullptr) {
+        file->write(data, len);
     }
     else {
-        write(stdoutLocalFd, data, len);
+        uint64_t writeStart = monotonicUs();
+        write(isStderr ? stderrLocalFd : stdoutLocalFd, data, len);
+        stats.writeCalls.add();
+        stats.writeBlockedUs.add(monotonicUs() - writeStart);
     }
-    
-    return len;
 }
 
 void RemoteProcess::onExitStatus(ssh_session session, ssh_channel channel, int status)
@@ -209,8 +558,10 @@ void RemoteProcess::onExitStatus(ssh_session session, ssh_channel channel, int s
         exit(1);
     }
 
+    Trace::asyncInstant("exit status", this, std::to_string(status));
+
     // stop listening for events on the stdin FD
-    ctx->getEvtLoop()->removeFdRead(stdinLocalFd);
+    stopWatchingStdin();
 
     exitStatus = status;
 
@@ -220,12 +571,14 @@ void RemoteProcess::onExitStatus(ssh_session session, ssh_channel channel, int s
 
 void RemoteProcess::onClose(ssh_session session, ssh_channel channel)
 {
-    // cleanup channel
-    ssh_set_blocking(session, 0);
-    ssh_channel_close(channel);
-    ssh_channel_free(channel);
-    channel = nullptr;
-    ssh_set_blocking(session, 1);
+    // output held back by the download limit is still in the channel
+    readHeldBack(true);
+
+    // also stops watching stdin, in case there was no exit status, e.g. if
+    // the process was killed
+    closeChannel();
+
+    Trace::asyncEnd("RemoteProcess", this, "status " + std::to_string(exitStatus));
 
     if (onFinish)
         onFinish(exitStatus);
@@ -237,16 +590,29 @@ int RemoteProcess::forwardFdToChannel(int fd, int revents, void* userdata)
     RemoteProcess* pThis = (RemoteProcess*) userdata;
     ssh_channel channel = pThis->channel;
 
+    TokenBucket& up = pThis->host->getScheduler()->upload();
+    size_t want = up.take(sizeof(buf));
+    if (want == 0) {
+        pThis->pauseStdin(up.delayUs(sizeof(buf)));
+        return SSH_OK;
+    }
+
     // should not block because this is being called by the libssh event loop
-    int len = read(fd, buf, sizeof(buf));
+    int len = read(fd, buf, want);
+    up.giveBack(want - std::max(len, 0));
+    HostStats& stats = pThis->host->getStats();
+    stats.readCalls.add();
     if (len < 0)
         return SSH_ERROR;       // ???
     else if (len == 0) {
         ssh_channel_send_eof(channel);
-        pThis->ctx->getEvtLoop()->removeFdRead(fd);
+        pThis->stopWatchingStdin();
     }
     else {
+        uint64_t writeStart = monotonicUs();
         ssh_channel_write(channel, buf, len);
+        stats.stdinBytes.add(len);
+        stats.writeBlockedUs.add(monotonicUs() - writeStart);
     }
 
     return SSH_OK;
@@ -1,6 +1,8 @@
 #pragma once
 
 #include <libssh/libssh.h>
+#include "stringTable.hpp"
+#include "objectPool.hpp"
 #include <vector>
 #include <string>
 #include <mutex>
@@ -9,18 +11,33 @@
 
 typedef std::function<void(int)> ProcessFinishedCallback;
 class Context;
+class Host;
+class RemoteFile;
 
 struct IoRedir {
     int oldfd;
     int newfd;
 };
 
+/**
+ * Redirection of a process FD to a file on any host, i.e. `>`, `>>` or `<`
+ */
+struct FileRedir {
+    enum Mode { READ, WRITE, APPEND };
+
+    int fd;                 // FD in the process
+    Mode mode;
+    HostId host = localHost;    // localHost for the local machine
+    std::string path;
+};
+
 class Process {
 public:
     virtual ~Process() = default;
 
     /**
-     * Starts the process, and calls the callback function when finished.
+     * Starts the process, and calls the callback function when finished. The
+     * callback may be called on any thread.
      */
     virtual void start(ProcessFinishedCallback onFinish) = 0;
 
@@ -33,41 +50,136 @@ public:
      *                 `STDIN_FILENO`, `STDOUT_FILENO`, or`STDERR_FILENO`.
      */
     void redirectIo(int fdLocal, int fdProc);
+    void redirectIo(const std::vector<IoRedir>& redirs);
+
+    /**
+     * Writes process FD `fdProc` straight to a remote file, without going
+     * through a local FD. Must be called before the process is started, and
+     * the file must stay open until the process finishes.
+     *
+     * @return false if the process can't do this, in which case the caller
+     *         has to go through a pipe
+     */
+    virtual bool redirectToRemoteFile(RemoteFile* file, int fdProc) { return false; }
+
+    /**
+     * Also appends everything the process writes to stdout to `out`, which
+     * must stay valid until the process finishes. Must be called before the
+     * process is started.
+     *
+     * @param tee  If false, stdout only goes to `out`
+     * @return false if the process can't do this
+     */
+    virtual bool captureStdout(std::string* out, bool tee = true) { return false; }
+
+    /**
+     * Exit status of a process that was stopped for running too long, the
+     * same as the `timeout` utility's
+     */
+    static constexpr int timeoutStatus = 124;
+
+    /**
+     * Exit status of a remote process that couldn't be started or lost its
+     * connection, the same as ssh's
+     */
+    static constexpr int sshErrorStatus = 255;
+
+    /**
+     * Stops the process if it runs longer than `seconds`, overriding any
+     * default limit. Must be called before the process is started.
+     *
+     * @return false if the process can't do this
+     */
+    virtual bool setTimeout(uint64_t seconds) { return false; }
 
 protected:
+    /**
+     * Returns the local FD that process FD `fdProc` has been redirected to,
+     * or `fdProc` itself if it has not been redirected.
+     */
+    int getRedirectedFd(int fdProc) const;
+
+
     // TODO: shouldn't need to keep this around
     std::vector<IoRedir> ioRedirs;
 };
 
-class LocalProcess : public Process {
+class LocalProcess : public Process, public Pooled<LocalProcess> {
 public:
+    /**
+     * @param args  IDs in `StringTable::args()`, whose strings are used as
+     *              they are, without copying
+     */
+    LocalProcess(const std::vector<StringTable::Id>& args);
+
+    /**
+     * @param args  Must stay valid until the process is deleted
+     */
     LocalProcess(const std::vector<std::string>& args);
 
     void start(ProcessFinishedCallback onFinish);
 
 private:
-    // TODO: too much copying?
-    std::vector<std::string> args;
-    std::vector<const char*> argv;
+    // argv of short commands is kept in the object
+    static constexpr size_t inlineArgs = 8;
+    const char* argvInline[inlineArgs + 1];
+    std::vector<const char*> argvHeap;
+    const char** argv;
 
     pid_t pid = 0;
 };
 
-class RemoteProcess : public Process {
+/**
+ * A process on a remote host. The channel is opened and serviced on the event
+ * loop of the host, so the constructor and `start()` can be called from any
+ * thread.
+ *
+ * The process waits for a channel slot of the host before it opens its
+ * channel, and its stdin and output are held to the scheduler's bandwidth
+ * limits. Output beyond the limit is left in the channel, so the server
+ * stops sending once the channel's window is full.
+ */
+class RemoteProcess : public Process, public Pooled<RemoteProcess> {
 public:
-    RemoteProcess(ssh_session session, Context* ctx, const std::vector<std::string>& args);
+    RemoteProcess(Host* host, Context* ctx, const std::vector<std::string>& args);
 
     void start(ProcessFinishedCallback onFinish);
 
+    bool redirectToRemoteFile(RemoteFile* file, int fdProc);
+    bool captureStdout(std::string* out, bool tee = true);
+    bool setTimeout(uint64_t seconds);
+
+    /**
+     * Passes stderr to `filter` instead of writing it to the local FD. The
+     * filter is called on the host's event loop. Must be called before the
+     * process is started.
+     */
+    void setStderrFilter(std::function<void(const char* data, size_t len)> filter);
+
 private:
     Context* ctx = nullptr;
+    Host* host = nullptr;
     ssh_session session = nullptr;
     ssh_channel channel = nullptr;
     std::string cmd;
+    std::string label;      // host and command, for stall reports
+    bool stdinWatched = false;
+    bool gotFirstByte = false;
+    bool hasChannelSlot = false;
 
     int exitStatus = 1;
     ProcessFinishedCallback onFinish;
 
+    // seconds, the host's `timeout=` unless set with `setTimeout()`
+    uint64_t timeout = 0;
+    uint64_t timeoutTimer = 0;
+    uint64_t lostCallback = 0;
+
+    // while the bandwidth limits hold back stdin or output
+    uint64_t stdinTimer = 0;
+    uint64_t readTimer = 0;
+    uint32_t heldBack[2] = { 0, 0 };   // bytes left in the channel, by is_stderr
+
     // workaround for libssh connectors bug
     // connectors sometimes cut off data at the end
     // connector for stdin doesn't really work well with pipes
@@ -75,7 +187,28 @@ private:
     int stdoutLocalFd;
     int stderrLocalFd;
 
+    // set if output goes directly to a file on another host
+    RemoteFile* stdoutFile = nullptr;
+    RemoteFile* stderrFile = nullptr;
+
+    std::string* stdoutCapture = nullptr;
+    bool teeStdout = true;
+    std::function<void(const char*, size_t)> stderrFilter;
+
+    void exec();
+    void fail(const std::string& msg);
+    void watchStdin();
+    void stopWatchingStdin();
+    void pauseStdin(uint64_t delayUs);
+    void readHeldBack(bool all);
+    void deliver(const char* data, size_t len, bool isStderr);
+    void releaseChannelSlot();
+    void closeChannel();
+    void onTimeout();
+    void onConnectionLost();
+
     static int staticOnData(ssh_session session, ssh_channel channel, void* data, uint32_t len, int is_stderr, void* userdata);
+    static void staticOnEof(ssh_session session, ssh_channel channel, void* userdata);
     static void staticOnExitStatus(ssh_session session, ssh_channel channel, int status, void* userdata);
     static void staticOnClose(ssh_session session, ssh_channel channel, void* userdata);
 
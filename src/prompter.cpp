@@ -0,0 +1,98 @@
+#include "prompter.hpp"
+#include "trace.hpp"
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <thread>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+
+namespace {
+
+struct PromptJob {
+    std::string header;
+    std::vector<Prompter::Question> questions;
+    Prompter::AnswerCallback callback;
+};
+
+std::mutex jobsMtx;
+std::condition_variable jobsCv;
+std::deque<PromptJob> jobs;
+bool threadStarted = false;
+
+}
+
+/**
+ * Reads one line from the user, without echo unless `echo` is set
+ */
+static bool readAnswer(const Prompter::Question& q, std::string& answer)
+{
+    if (!q.echo) {
+        char* password = getpass(q.prompt.c_str());
+        if (password == nullptr)
+            return false;
+        answer = password;
+        memset(password, 0, strlen(password));
+        return true;
+    }
+
+    fputs(q.prompt.c_str(), stderr);
+    fflush(stderr);
+    char buffer[256];
+    if (fgets(buffer, sizeof(buffer), stdin) == nullptr)
+        return false;
+    buffer[strcspn(buffer, "\n")] = '\0';
+    answer = buffer;
+    memset(buffer, 0, sizeof(buffer));
+    return true;
+}
+
+static void promptThread()
+{
+    Trace::setThreadName("prompt");
+    while (true) {
+        PromptJob job;
+        {
+            std::unique_lock lck(jobsMtx);
+            jobsCv.wait(lck, [] () { return !jobs.empty(); });
+            job = std::move(jobs.front());
+            jobs.pop_front();
+        }
+
+        if (!job.header.empty())
+            fprintf(stderr, "%s\n", job.header.c_str());
+
+        bool ok = true;
+        std::vector<std::string> answers(job.questions.size());
+        for (size_t i = 0; ok && i < job.questions.size(); i++)
+            ok = readAnswer(job.questions[i], answers[i]);
+
+        job.callback(ok, answers);
+        for (auto& a : answers)
+            Prompter::zero(a);
+    }
+}
+
+void Prompter::ask(const std::string& header, const std::vector<Question>& questions, AnswerCallback callback)
+{
+    std::lock_guard lck(jobsMtx);
+    jobs.push_back({ header, questions, callback });
+    jobsCv.notify_one();
+
+    // blocks in getpass() or fgets() most of its life, so it is never joined
+    if (!threadStarted) {
+        std::thread(promptThread).detach();
+        threadStarted = true;
+    }
+}
+
+void Prompter::zero(std::string& secret)
+{
+    // volatile, so the compiler can't drop the writes to memory that is
+    // about to be freed
+    volatile char* p = &secret[0];
+    for (size_t i = 0; i < secret.size(); i++)
+        p[i] = '\0';
+    secret.clear();
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * Asks the user for passwords and other answers on a thread of its own, so
+ * no event loop waits for the user. Questions from different hosts are asked
+ * one batch at a time, in the order they were asked.
+ */
+class Prompter {
+public:
+    struct Question {
+        std::string prompt;
+        bool echo;          // false for passwords
+    };
+
+    /**
+     * Called on the prompt thread. `ok` is false if the user couldn't be
+     * asked or stdin ended. The answers should be zeroed once used.
+     */
+    typedef std::function<void(bool ok, std::vector<std::string>& answers)> AnswerCallback;
+
+    /**
+     * Prints `header` if it isn't empty, then asks the questions in order.
+     * Can be called from any thread.
+     */
+    static void ask(const std::string& header, const std::vector<Question>& questions, AnswerCallback callback);
+
+    /**
+     * Overwrites a secret before the memory is freed
+     */
+    static void zero(std::string& secret);
+};
@@ -0,0 +1,200 @@
+#include "remoteFile.hpp"
+#include "host.hpp"
+#include "eventLoop.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <algorithm>
+
+RemoteFile::RemoteFile(Host* host, const std::string& path, FileRedir::Mode mode)
+    : host(host), path(path), mode(mode)
+{
+    // SFTP paths are relative to the home directory already
+    std::string sftpPath = path;
+    if (sftpPath.compare(0, 2, "~/") == 0)
+        sftpPath = sftpPath.substr(2);
+
+    int flags;
+    switch (mode) {
+    case FileRedir::READ:
+        flags = O_RDONLY;
+        break;
+    case FileRedir::WRITE:
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+        break;
+    case FileRedir::APPEND:
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+        break;
+    }
+
+    sftp_session sftp = host->getSftp();
+    file = sftp_open(sftp, sftpPath.c_str(), flags, 0666);
+    if (file == nullptr) {
+        throw std::runtime_error(path + ": " + ssh_get_error(host->getSession()));
+    }
+
+    // not every server honors the append flag, so start at the end ourselves
+    if (mode == FileRedir::APPEND) {
+        sftp_attributes attr = sftp_fstat(file);
+        if (attr != nullptr) {
+            sftp_seek64(file, attr->size);
+            sftp_attributes_free(attr);
+        }
+    }
+}
+
+RemoteFile::~RemoteFile()
+{
+    stopPump();
+    if (file != nullptr)
+        sftp_close(file);
+}
+
+void RemoteFile::write(const void* data, size_t len)
+{
+    auto p = (const char*)data;
+    while (len > 0 && !failed) {
+        ssize_t rc = sftp_write(file, p, len);
+        if (rc <= 0) {
+            reportError("write failed");
+            return;
+        }
+        p += rc;
+        len -= rc;
+    }
+}
+
+void RemoteFile::startPump(int fd, std::function<void()> onDone)
+{
+    this->onDone = onDone;
+    buf.resize(64 * 1024);
+
+    // keep our end non-blocking, the event loop must never wait on the
+    // process at the other end
+    pipeFd = fd;
+    fcntl(pipeFd, F_SETFL, fcntl(pipeFd, F_GETFL) | O_NONBLOCK);
+    watchPipe();
+}
+
+void RemoteFile::watchPipe()
+{
+    EventLoop* loop = host->getEvtLoop();
+    if (mode == FileRedir::READ)
+        loop->addFdWrite(pipeFd, &RemoteFile::onPipeWritable, this, "RemoteFile pump");
+    else
+        loop->addFdRead(pipeFd, &RemoteFile::onPipeReadable, this, "RemoteFile pump");
+}
+
+/**
+ * Stops watching the pipe until a bandwidth limit allows more
+ */
+void RemoteFile::pausePump(uint64_t delayUs)
+{
+    if (mode == FileRedir::READ)
+        host->getEvtLoop()->removeFdWrite(pipeFd);
+    else
+        host->getEvtLoop()->removeFdRead(pipeFd);
+    pumpTimer = host->getEvtLoop()->addTimer(delayUs, [this] () {
+        pumpTimer = 0;
+        watchPipe();
+    }, "RemoteFile bandwidth limit");
+}
+
+void RemoteFile::stopPump()
+{
+    if (pipeFd == -1)
+        return;
+
+    host->getEvtLoop()->cancelTimer(pumpTimer);
+    pumpTimer = 0;
+    if (mode == FileRedir::READ)
+        host->getEvtLoop()->removeFdWrite(pipeFd);
+    else
+        host->getEvtLoop()->removeFdRead(pipeFd);
+    close(pipeFd);
+    pipeFd = -1;
+}
+
+void RemoteFile::pumpFinished()
+{
+    stopPump();
+
+    // onDone may delete this object
+    auto cb = onDone;
+    if (cb)
+        cb();
+}
+
+void RemoteFile::reportError(const std::string& what)
+{
+    if (!failed) {
+        fprintf(stderr, "flassh: %s: %s: %s\n", path.c_str(), what.c_str(), ssh_get_error(host->getSession()));
+        failed = true;
+    }
+}
+
+int RemoteFile::onPipeReadable(int fd, int revents, void* userdata)
+{
+    auto pThis = (RemoteFile*)userdata;
+
+    TokenBucket& up = pThis->host->getScheduler()->upload();
+    size_t want = up.take(pThis->buf.size());
+    if (want == 0) {
+        pThis->pausePump(up.delayUs(pThis->buf.size()));
+        return SSH_OK;
+    }
+
+    ssize_t len = read(fd, pThis->buf.data(), want);
+    up.giveBack(want - std::max<ssize_t>(len, 0));
+    if (len < 0 && (errno == EAGAIN || errno == EINTR))
+        return SSH_OK;
+
+    if (len <= 0) {
+        // EOF, the process closed its end
+        pThis->pumpFinished();
+        return SSH_OK;
+    }
+
+    pThis->write(pThis->buf.data(), len);
+    return SSH_OK;
+}
+
+int RemoteFile::onPipeWritable(int fd, int revents, void* userdata)
+{
+    auto pThis = (RemoteFile*)userdata;
+
+    while (true) {
+        // refill the buffer from the file
+        if (pThis->bufPos == pThis->bufLen) {
+            TokenBucket& down = pThis->host->getScheduler()->download();
+            size_t want = down.take(pThis->buf.size());
+            if (want == 0) {
+                pThis->pausePump(down.delayUs(pThis->buf.size()));
+                return SSH_OK;
+            }
+
+            ssize_t len = sftp_read(pThis->file, pThis->buf.data(), want);
+            down.giveBack(want - std::max<ssize_t>(len, 0));
+            if (len < 0)
+                pThis->reportError("read failed");
+            if (len <= 0) {
+                // closing our end gives the process EOF
+                pThis->pumpFinished();
+                return SSH_OK;
+            }
+            pThis->bufPos = 0;
+            pThis->bufLen = len;
+        }
+
+        ssize_t len = ::write(fd, pThis->buf.data() + pThis->bufPos, pThis->bufLen - pThis->bufPos);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EINTR)
+                return SSH_OK;
+
+            // EPIPE, the process doesn't want any more input
+            pThis->pumpFinished();
+            return SSH_OK;
+        }
+        pThis->bufPos += len;
+    }
+}
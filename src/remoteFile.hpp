@@ -0,0 +1,75 @@
+#pragma once
+
+#include "process.hpp"
+#include <libssh/sftp.h>
+#include <functional>
+
+class Host;
+
+/**
+ * A file on a remote host that is the source or target of an I/O
+ * redirection. The file is accessed over SFTP, so no helper process (like
+ * `cat` or `tee`) has to be started on the remote host.
+ *
+ * All methods, including the constructor and destructor, must be called on
+ * the event loop thread of the host.
+ */
+class RemoteFile {
+public:
+    /**
+     * Opens the file. Throws on failure.
+     */
+    RemoteFile(Host* host, const std::string& path, FileRedir::Mode mode);
+    ~RemoteFile();
+
+    RemoteFile(const RemoteFile&) = delete;
+    RemoteFile& operator=(const RemoteFile&) = delete;
+
+    FileRedir::Mode getMode() const { return mode; }
+    Host* getHost() const { return host; }
+
+    /**
+     * Writes data directly to the file. Errors are reported once, after
+     * which all data is discarded.
+     */
+    void write(const void* data, size_t len);
+
+    /**
+     * Connects the file to a pipe that is serviced by the event loop of the
+     * host. When writing, everything read from the pipe goes into the file;
+     * when reading, the file contents are written into the pipe. The pump
+     * is held to the scheduler's bandwidth limits.
+     *
+     * @param fd      The end of the pipe for the file, read end when writing
+     *                and write end when reading. It belongs to the pump from
+     *                now on, and is closed when the pump stops.
+     * @param onDone  Called on the host's event loop once all data has been
+     *                transferred, i.e. when the pipe reaches EOF or the whole
+     *                file has been read
+     */
+    void startPump(int fd, std::function<void()> onDone);
+
+private:
+    Host* host;
+    std::string path;
+    FileRedir::Mode mode;
+    sftp_file file = nullptr;
+    bool failed = false;
+
+    // pump state
+    int pipeFd = -1;
+    std::function<void()> onDone;
+    std::vector<char> buf;
+    size_t bufPos = 0;
+    size_t bufLen = 0;
+    uint64_t pumpTimer = 0;     // while a bandwidth limit holds the pump back
+
+    void watchPipe();
+    void pausePump(uint64_t delayUs);
+    void stopPump();
+    void pumpFinished();
+    void reportError(const std::string& what);
+
+    static int onPipeReadable(int fd, int revents, void* userdata);
+    static int onPipeWritable(int fd, int revents, void* userdata);
+};
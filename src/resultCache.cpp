@@ -0,0 +1,132 @@
+#include "resultCache.hpp"
+#include "host.hpp"
+#include "md5.hpp"
+#include <fstream>
+#include <sstream>
+#include <thread>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// bump when the file format changes, old entries are then treated as misses
+static const char* magic = "flassh-cache 1";
+
+std::string cacheDirectory()
+{
+    std::string base;
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (xdg != nullptr && xdg[0] != '\0') {
+        base = xdg;
+    }
+    else if (home != nullptr && home[0] != '\0') {
+        base = std::string(home) + "/.cache";
+        mkdir(base.c_str(), 0700);
+    }
+    else {
+        return "";
+    }
+
+    std::string dir = base + "/flassh";
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+        return "";
+    return dir;
+}
+
+std::string ResultCache::key(const HostInfo& host, const std::vector<std::string>& args)
+{
+    // arguments can't contain NUL, so this is unambiguous
+    std::string str = host.toString();
+    for (auto& a : args) {
+        str.push_back('\0');
+        str += a;
+    }
+    return Md5::hash(str.data(), str.size());
+}
+
+bool ResultCache::lookup(const std::string& key, uint64_t ttl, Entry& out)
+{
+    std::string dir = cacheDirectory();
+    if (dir.empty())
+        return false;
+
+    std::ifstream f(dir + "/" + key, std::ios::binary);
+    if (!f)
+        return false;
+
+    // header line: magic, creation time, exit status
+    std::string header;
+    if (!std::getline(f, header) || header.compare(0, strlen(magic), magic) != 0)
+        return false;
+
+    std::istringstream hs(header.substr(strlen(magic)));
+    int64_t created;
+    int status;
+    if (!(hs >> created >> status))
+        return false;
+
+    int64_t age = time(nullptr) - created;
+    if (age < 0 || (uint64_t)age > ttl)
+        return false;
+
+    std::ostringstream data;
+    data << f.rdbuf();
+    out.status = status;
+    out.output = data.str();
+    return true;
+}
+
+void ResultCache::store(const std::string& key, const Entry& entry)
+{
+    std::string dir = cacheDirectory();
+    if (dir.empty())
+        return;
+
+    std::string path = dir + "/" + key;
+    std::string tmpPath = path + "." + std::to_string(getpid()) + ".tmp";
+    {
+        std::ofstream f(tmpPath, std::ios::binary | std::ios::trunc);
+        f << magic << " " << (int64_t)time(nullptr) << " " << entry.status << "\n";
+        f.write(entry.output.data(), entry.output.size());
+        if (!f) {
+            fprintf(stderr, "flassh: failed to write cache entry %s\n", tmpPath.c_str());
+            unlink(tmpPath.c_str());
+            return;
+        }
+    }
+
+    if (rename(tmpPath.c_str(), path.c_str()) == -1) {
+        fprintf(stderr, "flassh: failed to write cache entry %s: %s\n", path.c_str(), strerror(errno));
+        unlink(tmpPath.c_str());
+    }
+}
+
+
+
+CachedProcess::CachedProcess(const ResultCache::Entry& entry) : entry(entry) {}
+
+void CachedProcess::start(ProcessFinishedCallback onFinish)
+{
+    // stdout may be a pipe read on this thread's event loop, so write from
+    // another thread to avoid blocking on a full pipe
+    int fd = getRedirectedFd(STDOUT_FILENO);
+    std::thread t([this, fd, onFinish] () {
+        const char* p = entry.output.data();
+        size_t left = entry.output.size();
+        while (left > 0) {
+            ssize_t n = write(fd, p, left);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;      // e.g. reader went away, like a killed process
+            p += n;
+            left -= n;
+        }
+
+        if (onFinish)
+            onFinish(entry.status);
+    });
+    t.detach();
+}
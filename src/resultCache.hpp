@@ -0,0 +1,64 @@
+#pragma once
+
+#include "process.hpp"
+#include <string>
+#include <vector>
+#include <cstdint>
+
+struct HostInfo;
+
+/**
+ * On-disk cache of the results of remote commands marked with `@cache TTL`.
+ * An entry holds the stdout and exit status of one run, and is keyed by the
+ * host's user, name and port, and the command's arguments.
+ *
+ * Entries are stored in `$XDG_CACHE_HOME/flassh`, or `~/.cache/flassh`, one
+ * file per entry. They are written to a temporary file and renamed, so
+ * concurrent flassh instances never see a partial entry.
+ */
+/**
+ * Returns flassh's cache directory, creating it if needed. Empty if there is
+ * none.
+ */
+std::string cacheDirectory();
+
+namespace ResultCache {
+
+struct Entry {
+    int status = 0;
+    std::string output;
+};
+
+/**
+ * Returns the key of a command on a host
+ */
+std::string key(const HostInfo& host, const std::vector<std::string>& args);
+
+/**
+ * Looks up an entry that is at most `ttl` seconds old
+ *
+ * @return false if there is no such entry
+ */
+bool lookup(const std::string& key, uint64_t ttl, Entry& out);
+
+/**
+ * Stores an entry, replacing any older one. Failures are only reported,
+ * since the command itself has already succeeded.
+ */
+void store(const std::string& key, const Entry& entry);
+
+}   // namespace ResultCache
+
+/**
+ * Replays a cached result: writes the stored output to stdout and finishes
+ * with the stored status. Stdin is not read.
+ */
+class CachedProcess : public Process {
+public:
+    CachedProcess(const ResultCache::Entry& entry);
+
+    void start(ProcessFinishedCallback onFinish);
+
+private:
+    ResultCache::Entry entry;
+};
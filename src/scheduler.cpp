@@ -0,0 +1,138 @@
+#include "scheduler.hpp"
+#include "stats.hpp"
+#include <algorithm>
+
+void TokenBucket::setRate(uint64_t perSecond, uint64_t burst)
+{
+    std::lock_guard lck(mtx);
+    rate = perSecond;
+    this->burst = std::max<uint64_t>(burst, 1);
+    tokens = this->burst;
+    lastUs = monotonicUs();
+}
+
+void TokenBucket::refill()
+{
+    uint64_t now = monotonicUs();
+    tokens = std::min<double>(tokens + (now - lastUs) * rate / 1e6, burst);
+    lastUs = now;
+}
+
+uint64_t TokenBucket::take(uint64_t want)
+{
+    if (rate == 0)
+        return want;
+
+    std::lock_guard lck(mtx);
+    refill();
+    uint64_t n = std::min<uint64_t>(want, tokens);
+    tokens -= n;
+    return n;
+}
+
+void TokenBucket::giveBack(uint64_t n)
+{
+    if (rate == 0)
+        return;
+
+    std::lock_guard lck(mtx);
+    tokens = std::min<double>(tokens + n, burst);
+}
+
+uint64_t TokenBucket::delayUs(uint64_t n)
+{
+    if (rate == 0)
+        return 0;
+
+    std::lock_guard lck(mtx);
+    refill();
+    double missing = std::min(n, burst) - tokens;
+    return missing > 0 ? missing * 1e6 / rate + 1 : 0;
+}
+
+
+
+Scheduler::Scheduler(EventLoop* timerLoop) : timerLoop(timerLoop) {}
+
+void Scheduler::setConnectRate(uint64_t perSecond)
+{
+    connects.setRate(perSecond, perSecond);
+}
+
+void Scheduler::setBandwidth(uint64_t up, uint64_t down)
+{
+    // a quarter second of data at once keeps the pauses short
+    this->up.setRate(up, up / 4);
+    this->down.setRate(down, down / 4);
+}
+
+Scheduler::Ticket Scheduler::whenCanConnect(EventLoop* loop, std::function<void()> task)
+{
+    std::lock_guard lck(mtx);
+    Ticket ticket = nextTicket++;
+    tasks[ticket] = std::move(task);
+
+    if (queue.empty() && connects.take(1) == 1) {
+        dispatch(ticket, loop);
+        return ticket;
+    }
+
+    queue.push_back({ ticket, loop });
+    if (!timerPending) {
+        timerPending = true;
+        timerLoop->enqueueTask([this] () { drain(); }, "Scheduler::drain");
+    }
+    return ticket;
+}
+
+void Scheduler::cancel(Ticket ticket)
+{
+    // a queued one is skipped once it comes up
+    std::lock_guard lck(mtx);
+    tasks.erase(ticket);
+}
+
+void Scheduler::dispatch(Ticket ticket, EventLoop* loop)
+{
+    loop->enqueueTask([this, ticket] () { run(ticket); }, "Scheduler::connect");
+}
+
+void Scheduler::run(Ticket ticket)
+{
+    std::function<void()> task;
+    {
+        std::lock_guard lck(mtx);
+        auto it = tasks.find(ticket);
+        if (it == tasks.end())
+            return;
+        task = std::move(it->second);
+        tasks.erase(it);
+    }
+    task();
+}
+
+/**
+ * Dispatches as many waiting connections as the rate allows, and comes back
+ * when the next one may go. Runs on the timer loop.
+ */
+void Scheduler::drain()
+{
+    std::lock_guard lck(mtx);
+    while (!queue.empty()) {
+        Waiting w = queue.front();
+        if (tasks.count(w.ticket) == 0) {
+            queue.pop_front();
+            continue;
+        }
+        if (connects.take(1) == 0)
+            break;
+        queue.pop_front();
+        dispatch(w.ticket, w.loop);
+    }
+
+    if (queue.empty()) {
+        timerPending = false;
+        return;
+    }
+    timerLoop->addTimer(connects.delayUs(1), [this] () { drain(); }, "Scheduler::drain");
+}
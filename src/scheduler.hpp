@@ -0,0 +1,117 @@
+#pragma once
+
+#include "eventLoop.hpp"
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+
+/**
+ * Limits a rate, e.g. of bytes per second, shared by all threads. Units that
+ * weren't used pile up to `burst`, so short pauses don't lower the average.
+ *
+ * The rate must be set before anything takes from the bucket.
+ */
+class TokenBucket {
+public:
+    /**
+     * @param perSecond  The rate, or 0 for no limit
+     */
+    void setRate(uint64_t perSecond, uint64_t burst);
+
+    bool isLimited() const { return rate != 0; }
+
+    /**
+     * Takes up to `want` units without waiting
+     *
+     * @return the number taken, all of them if there is no limit
+     */
+    uint64_t take(uint64_t want);
+
+    /**
+     * Returns units that were taken but not used
+     */
+    void giveBack(uint64_t n);
+
+    /**
+     * Returns the microseconds until `n` units, or the burst if that is
+     * less, are available
+     */
+    uint64_t delayUs(uint64_t n);
+
+private:
+    std::mutex mtx;
+    uint64_t rate = 0;
+    uint64_t burst = 0;
+    double tokens = 0;
+    uint64_t lastUs = 0;
+
+    void refill();
+};
+
+/**
+ * Shares limits between all hosts of a Context, so that fanning out to many
+ * hosts doesn't trip the servers' or the network's limits: how fast new
+ * connections are opened, and the bandwidth in each direction. Work that
+ * has to wait for a connection is done in the order it was asked for.
+ *
+ * Thread safe. The limits must be set before any host connects.
+ */
+class Scheduler {
+public:
+    typedef uint64_t Ticket;
+
+    /**
+     * @param timerLoop  The loop whose timers start waiting connections
+     */
+    Scheduler(EventLoop* timerLoop);
+
+    /**
+     * @param perSecond  New connections per second, 0 for no limit
+     */
+    void setConnectRate(uint64_t perSecond);
+
+    /**
+     * @param up    Bytes per second sent to all hosts, 0 for no limit
+     * @param down  Bytes per second received from all hosts
+     */
+    void setBandwidth(uint64_t up, uint64_t down);
+
+    /**
+     * Runs `task` on `loop` once a new connection may be opened
+     *
+     * @return a ticket for `cancel()`
+     */
+    Ticket whenCanConnect(EventLoop* loop, std::function<void()> task);
+
+    /**
+     * Drops a task of `whenCanConnect()` if it hasn't run yet. Must be called
+     * on the task's loop, so it can't be running meanwhile.
+     */
+    void cancel(Ticket ticket);
+
+    TokenBucket& upload() { return up; }
+    TokenBucket& download() { return down; }
+
+private:
+    struct Waiting {
+        Ticket ticket;
+        EventLoop* loop;
+    };
+
+    std::mutex mtx;
+    EventLoop* timerLoop;
+    TokenBucket connects;
+    TokenBucket up;
+    TokenBucket down;
+
+    Ticket nextTicket = 1;
+    std::deque<Waiting> queue;
+    std::map<Ticket, std::function<void()>> tasks;  // queued or dispatched
+    bool timerPending = false;
+
+    void dispatch(Ticket ticket, EventLoop* loop);
+    void run(Ticket ticket);
+    void drain();
+};
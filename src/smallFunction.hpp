@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+template <class Signature, size_t Size = 48>
+class SmallFunction;
+
+/**
+ * A move-only std::function that keeps callables of up to `Size` bytes
+ * inside the object. Only bigger ones are allocated, so the lambdas handed
+ * between event loops, which capture a few pointers, cost no allocation.
+ */
+template <class R, class... Args, size_t Size>
+class SmallFunction<R(Args...), Size> {
+public:
+    SmallFunction() = default;
+    SmallFunction(std::nullptr_t) {}
+
+    template <class F, class = std::enable_if_t<!std::is_same_v<std::decay_t<F>, SmallFunction>>>
+    SmallFunction(F&& f)
+    {
+        typedef std::decay_t<F> Fn;
+        if constexpr (fitsInline<Fn>()) {
+            new (buf) Fn(std::forward<F>(f));
+            ops = &inlineOps<Fn>;
+        }
+        else {
+            *(Fn**)buf = new Fn(std::forward<F>(f));
+            ops = &heapOps<Fn>;
+        }
+    }
+
+    SmallFunction(SmallFunction&& other) noexcept { take(other); }
+
+    SmallFunction& operator=(SmallFunction&& other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+        return *this;
+    }
+
+    SmallFunction(const SmallFunction&) = delete;
+    SmallFunction& operator=(const SmallFunction&) = delete;
+
+    ~SmallFunction() { reset(); }
+
+    explicit operator bool() const { return ops != nullptr; }
+
+    R operator()(Args... args) { return ops->call(buf, std::forward<Args>(args)...); }
+
+private:
+    struct Ops {
+        R (*call)(void* buf, Args&&... args);
+        void (*move)(void* to, void* from);     // also destroys `from`
+        void (*destroy)(void* buf);
+    };
+
+    template <class Fn>
+    static constexpr bool fitsInline()
+    {
+        return sizeof(Fn) <= Size && alignof(Fn) <= alignof(std::max_align_t) &&
+            std::is_nothrow_move_constructible_v<Fn>;
+    }
+
+    template <class Fn>
+    static constexpr Ops inlineOps = {
+        [] (void* b, Args&&... args) -> R { return (*(Fn*)b)(std::forward<Args>(args)...); },
+        [] (void* to, void* from) { new (to) Fn(std::move(*(Fn*)from)); ((Fn*)from)->~Fn(); },
+        [] (void* b) { ((Fn*)b)->~Fn(); },
+    };
+
+    template <class Fn>
+    static constexpr Ops heapOps = {
+        [] (void* b, Args&&... args) -> R { return (**(Fn**)b)(std::forward<Args>(args)...); },
+        [] (void* to, void* from) { *(Fn**)to = *(Fn**)from; },
+        [] (void* b) { delete *(Fn**)b; },
+    };
+
+    alignas(std::max_align_t) unsigned char buf[Size];
+    const Ops* ops = nullptr;
+
+    void take(SmallFunction& other)
+    {
+        if (other.ops != nullptr) {
+            other.ops->move(buf, other.buf);
+            ops = other.ops;
+            other.ops = nullptr;
+        }
+    }
+
+    void reset()
+    {
+        if (ops != nullptr) {
+            ops->destroy(buf);
+            ops = nullptr;
+        }
+    }
+};
@@ -0,0 +1,44 @@
+#include "stallDetector.hpp"
+#include "stats.hpp"
+#include "eventLoop.hpp"
+#include <cstdio>
+
+uint64_t StallTimer::threshold = 0;
+
+// innermost running timer on this thread
+static thread_local StallTimer* current = nullptr;
+
+StallTimer::StallTimer(const char* origin, const std::string* detail)
+    : origin(origin), detail(detail)
+{
+    if (!isEnabled())
+        return;
+
+    start = monotonicUs();
+    parent = current;
+    current = this;
+}
+
+StallTimer::~StallTimer()
+{
+    if (!isEnabled() || current != this)
+        return;
+    current = parent;
+
+    uint64_t elapsed = monotonicUs() - start;
+    if (elapsed < threshold || childReported)
+        return;
+
+    if (parent != nullptr)
+        parent->childReported = true;
+
+    EventLoop* loop = EventLoop::current();
+    if (loop != nullptr)
+        loop->getStats().stalls.add();
+
+    fprintf(stderr, "flassh: event loop stalled for %.1fms in %s%s%s%s\n",
+            elapsed / 1e3, origin,
+            detail != nullptr ? " (" : "",
+            detail != nullptr ? detail->c_str() : "",
+            detail != nullptr ? ")" : "");
+}
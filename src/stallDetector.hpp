@@ -0,0 +1,43 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+/**
+ * Reports event loop callbacks that run longer than a threshold. While one
+ * runs, no other session or FD on the same event loop is serviced, so these
+ * show up as stalls for unrelated hosts.
+ *
+ * Create one on the stack around the code to time. When timers are nested,
+ * only the innermost one that exceeds the threshold is reported, since it
+ * has the most specific origin.
+ */
+class StallTimer {
+public:
+    /**
+     * @param origin  What is being timed, must outlive the timer
+     * @param detail  Optional details, e.g. the host and command. Must outlive
+     *                the timer.
+     */
+    StallTimer(const char* origin, const std::string* detail = nullptr);
+    ~StallTimer();
+
+    StallTimer(const StallTimer&) = delete;
+    StallTimer& operator=(const StallTimer&) = delete;
+
+    /**
+     * Sets the threshold in microseconds. 0 disables the detector, which is
+     * the default.
+     */
+    static void setThreshold(uint64_t us) { threshold = us; }
+    static bool isEnabled() { return threshold != 0; }
+
+private:
+    const char* origin;
+    const std::string* detail;
+    uint64_t start = 0;
+    StallTimer* parent = nullptr;
+    bool childReported = false;
+
+    static uint64_t threshold;
+};
@@ -0,0 +1,218 @@
+#include "stats.hpp"
+#include "context.hpp"
+#include "host.hpp"
+#include "eventLoop.hpp"
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+#ifdef FLASSH_COUNT_ALLOCS
+// every `new` of the process is counted, to keep an eye on allocations in
+// the paths that run for each command. Only built with -DFLASSH_COUNT_ALLOCS=ON,
+// since it replaces the global allocator of everything linking flassh_core.
+static Counter allocations;
+
+void* operator new(size_t size)
+{
+    allocations.add();
+    void* p = malloc(size != 0 ? size : 1);
+    if (p == nullptr)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    allocations.add();
+    return malloc(size != 0 ? size : 1);
+}
+
+void* operator new(size_t size, std::align_val_t align)
+{
+    allocations.add();
+    void* p = nullptr;
+    if (posix_memalign(&p, std::max(size_t(align), sizeof(void*)), size != 0 ? size : 1) != 0)
+        throw std::bad_alloc();
+    return p;
+}
+
+void* operator new(size_t size, std::align_val_t align, const std::nothrow_t&) noexcept
+{
+    allocations.add();
+    void* p = nullptr;
+    if (posix_memalign(&p, std::max(size_t(align), sizeof(void*)), size != 0 ? size : 1) != 0)
+        return nullptr;
+    return p;
+}
+
+// the array forms default to these, and all of them free() what was
+// allocated above
+
+void operator delete(void* p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept
+{
+    free(p);
+}
+
+void operator delete(void* p, std::align_val_t, const std::nothrow_t&) noexcept
+{
+    free(p);
+}
+
+uint64_t allocationCount()
+{
+    return allocations.get();
+}
+#endif
+
+uint64_t monotonicUs()
+{
+    auto d = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void LatencyHistogram::add(uint64_t us)
+{
+    // bucket i holds durations below 2^i microseconds
+    int i = 0;
+    while (i < numBuckets - 1 && (uint64_t(1) << i) <= us)
+        ++i;
+    buckets[i].add();
+    maxUs.max(us);
+}
+
+uint64_t LatencyHistogram::count() const
+{
+    uint64_t n = 0;
+    for (auto& b : buckets)
+        n += b.get();
+    return n;
+}
+
+uint64_t LatencyHistogram::percentile(double p) const
+{
+    uint64_t total = count();
+    if (total == 0)
+        return 0;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < numBuckets; i++) {
+        seen += buckets[i].get();
+        if (seen * 100.0 >= p * total)
+            return std::min(uint64_t(1) << i, max());
+    }
+    return max();
+}
+
+static std::string formatBytes(uint64_t n)
+{
+    static const char* units[] = { "B", "KiB", "MiB", "GiB", "TiB" };
+    double v = n;
+    int u = 0;
+    while (v >= 1024 && u < 4) {
+        v /= 1024;
+        ++u;
+    }
+
+    char buf[32];
+    snprintf(buf, sizeof(buf), u == 0 ? "%.0f %s" : "%.1f %s", v, units[u]);
+    return buf;
+}
+
+static std::string formatUs(uint64_t us)
+{
+    char buf[32];
+    if (us < 1000)
+        snprintf(buf, sizeof(buf), "%lluus", (unsigned long long)us);
+    else if (us < 1000000)
+        snprintf(buf, sizeof(buf), "%.1fms", us / 1e3);
+    else
+        snprintf(buf, sizeof(buf), "%.2fs", us / 1e6);
+    return buf;
+}
+
+std::string formatStats(Context* ctx)
+{
+    std::string out;
+    char line[256];
+
+    snprintf(line, sizeof(line), "%-16s %10s %10s %10s %8s %8s %10s %8s %10s %10s\n",
+             "host", "stdout", "stderr", "stdin", "reads", "writes", "write wait",
+             "channels", "open p50", "open p99");
+    out += line;
+    auto& hosts = ctx->getHosts();
+    for (HostId id = 0; id < hosts.size(); id++) {
+        if (hosts[id] == nullptr)
+            continue;
+        const HostStats& s = hosts[id]->getStats();
+        snprintf(line, sizeof(line), "%-16s %10s %10s %10s %8llu %8llu %10s %8llu %10s %10s\n",
+                 StringTable::hostAliases().get(id).c_str(),
+                 formatBytes(s.stdoutBytes.get()).c_str(),
+                 formatBytes(s.stderrBytes.get()).c_str(),
+                 formatBytes(s.stdinBytes.get()).c_str(),
+                 (unsigned long long)s.readCalls.get(),
+                 (unsigned long long)s.writeCalls.get(),
+                 formatUs(s.writeBlockedUs.get()).c_str(),
+                 (unsigned long long)s.channelOpen.count(),
+                 formatUs(s.channelOpen.percentile(50)).c_str(),
+                 formatUs(s.channelOpen.percentile(99)).c_str());
+        out += line;
+    }
+
+    snprintf(line, sizeof(line), "\n%-16s %10s %10s %10s %10s\n", "event loop", "wakeups", "tasks", "max queue", "stalls");
+    out += line;
+    auto& loops = ctx->getEvtLoops();
+    for (size_t i = 0; i < loops.size(); i++) {
+        const EvtLoopStats& s = loops[i]->getStats();
+        std::string name = i == 0 ? "main" : std::to_string(i);
+        snprintf(line, sizeof(line), "%-16s %10llu %10llu %10llu %10llu\n", name.c_str(),
+                 (unsigned long long)s.wakeups.get(),
+                 (unsigned long long)s.tasksRun.get(),
+                 (unsigned long long)s.maxQueueDepth.get(),
+                 (unsigned long long)s.stalls.get());
+        out += line;
+    }
+
+#ifdef FLASSH_COUNT_ALLOCS
+    snprintf(line, sizeof(line), "\n%-16s %10llu\n", "allocations", (unsigned long long)allocationCount());
+    out += line;
+#endif
+
+    return out;
+}
+
+
+
+StatsProcess::StatsProcess(Context* ctx, const std::vector<std::string>& args)
+    : ctx(ctx) {}
+
+void StatsProcess::start(ProcessFinishedCallback onFinish)
+{
+    std::string out = formatStats(ctx);
+    write(getRedirectedFd(STDOUT_FILENO), out.data(), out.size());
+
+    if (onFinish)
+        onFinish(0);
+}
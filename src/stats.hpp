@@ -0,0 +1,105 @@
+#pragma once
+
+#include "process.hpp"
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+class Context;
+
+/**
+ * A counter that can be updated from any thread without locking
+ */
+class Counter {
+public:
+    void add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+
+    /**
+     * Raises the value to `n` if it is lower
+     */
+    void max(uint64_t n)
+    {
+        uint64_t cur = get();
+        while (cur < n && !value.compare_exchange_weak(cur, n, std::memory_order_relaxed)) {}
+    }
+
+private:
+    std::atomic<uint64_t> value{0};
+};
+
+/**
+ * Histogram of durations in microseconds, with power of two buckets
+ */
+class LatencyHistogram {
+public:
+    void add(uint64_t us);
+
+    uint64_t count() const;
+    uint64_t max() const { return maxUs.get(); }
+
+    /**
+     * Returns an upper bound for the given percentile (0-100)
+     */
+    uint64_t percentile(double p) const;
+
+private:
+    static constexpr int numBuckets = 40;
+    Counter buckets[numBuckets];
+    Counter maxUs;
+};
+
+/**
+ * I/O counters of a host, summed over all of its processes
+ */
+struct HostStats {
+    // data received from the remote stdout/stderr, sent to the remote stdin
+    Counter stdoutBytes;
+    Counter stderrBytes;
+    Counter stdinBytes;
+
+    // syscalls on the local ends of the streams
+    Counter readCalls;
+    Counter writeCalls;
+    Counter writeBlockedUs;     // time spent in blocking writes
+
+    LatencyHistogram channelOpen;
+};
+
+struct EvtLoopStats {
+    Counter wakeups;
+    Counter tasksRun;
+    Counter maxQueueDepth;
+    Counter stalls;             // callbacks over the stall threshold
+};
+
+/**
+ * Microseconds on a monotonic clock, for measuring durations
+ */
+uint64_t monotonicUs();
+
+#ifdef FLASSH_COUNT_ALLOCS
+/**
+ * Returns the number of heap allocations made by the process so far
+ */
+uint64_t allocationCount();
+#endif
+
+/**
+ * Formats the counters of all hosts and event loops as a table. Must be
+ * called on the main event loop thread, or when no commands are running.
+ */
+std::string formatStats(Context* ctx);
+
+/**
+ * Builtin `stats`, prints the counters collected so far
+ */
+class StatsProcess : public Process {
+public:
+    StatsProcess(Context* ctx, const std::vector<std::string>& args);
+
+    void start(ProcessFinishedCallback onFinish);
+
+private:
+    Context* ctx;
+};
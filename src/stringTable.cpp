@@ -0,0 +1,61 @@
+#include "stringTable.hpp"
+
+StringTable::StringTable(std::initializer_list<std::string> initial)
+{
+    for (auto& str : initial)
+        intern(str);
+}
+
+StringTable::Id StringTable::intern(const std::string& str)
+{
+    std::lock_guard lck(mtx);
+    auto it = ids.find(str);
+    if (it != ids.end())
+        return it->second;
+
+    Id id = strings.size();
+    strings.push_back(str);
+    ids[strings.back()] = id;
+    return id;
+}
+
+StringTable::Id StringTable::find(const std::string& str) const
+{
+    std::lock_guard lck(mtx);
+    auto it = ids.find(str);
+    return it != ids.end() ? it->second : notFound;
+}
+
+const std::string& StringTable::get(Id id) const
+{
+    std::lock_guard lck(mtx);
+    return strings.at(id);
+}
+
+std::vector<std::string> StringTable::get(const std::vector<Id>& ids) const
+{
+    std::lock_guard lck(mtx);
+    std::vector<std::string> ret;
+    ret.reserve(ids.size());
+    for (Id id : ids)
+        ret.push_back(strings.at(id));
+    return ret;
+}
+
+StringTable& StringTable::hostAliases()
+{
+    static StringTable table({ "" });
+    return table;
+}
+
+StringTable& StringTable::args()
+{
+    static StringTable table;
+    return table;
+}
+
+StringTable& StringTable::variables()
+{
+    static StringTable table;
+    return table;
+}
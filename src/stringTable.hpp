@@ -0,0 +1,71 @@
+#pragma once
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <mutex>
+#include <cstdint>
+#include <initializer_list>
+
+/**
+ * Stores each distinct string once, and names it with a small integer ID.
+ * IDs are handed out in order starting at 0, so they can index a vector.
+ * Strings are never removed, and references to them stay valid. Thread safe.
+ */
+class StringTable {
+public:
+    typedef uint32_t Id;
+
+    static constexpr Id notFound = UINT32_MAX;
+
+    /**
+     * Interns `initial` in order, so they get the first IDs
+     */
+    StringTable(std::initializer_list<std::string> initial = {});
+
+    /**
+     * Returns the ID of `str`, adding it if it is new
+     */
+    Id intern(const std::string& str);
+
+    /**
+     * Returns the ID of `str`, or `notFound` if it hasn't been interned
+     */
+    Id find(const std::string& str) const;
+
+    const std::string& get(Id id) const;
+
+    /**
+     * Returns the strings with these IDs
+     */
+    std::vector<std::string> get(const std::vector<Id>& ids) const;
+
+    /**
+     * Host aliases, shared by the parser and Context. The empty alias, the
+     * local machine, is always ID 0.
+     */
+    static StringTable& hostAliases();
+
+    /**
+     * Arguments of commands, so a generated script that repeats the same
+     * arguments stores each of them once
+     */
+    static StringTable& args();
+
+    /**
+     * Variable names, so Context can keep the values in a flat table
+     */
+    static StringTable& variables();
+
+private:
+    mutable std::mutex mtx;
+    std::deque<std::string> strings;    // elements don't move as it grows
+    std::unordered_map<std::string_view, Id> ids;
+};
+
+typedef StringTable::Id HostId;
+
+// the ID of the empty alias
+static constexpr HostId localHost = 0;
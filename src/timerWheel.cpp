@@ -0,0 +1,197 @@
+#include "timerWheel.hpp"
+#include <cstring>
+
+TimerWheel::TimerWheel(uint64_t now) : current(now)
+{
+    for (auto& h : heads)
+        h = nil;
+    memset(occupied, 0, sizeof(occupied));
+}
+
+TimerWheel::TimerId TimerWheel::add(uint64_t expiry, Callback callback, const char* origin)
+{
+    uint32_t i;
+    if (!freeNodes.empty()) {
+        i = freeNodes.back();
+        freeNodes.pop_back();
+    }
+    else {
+        nodes.emplace_back();
+        i = nodes.size() - 1;
+    }
+
+    // never due right away, so a timer that adds itself again can't keep
+    // popExpired() going forever
+    Node& n = nodes[i];
+    n.callback = std::move(callback);
+    n.origin = origin;
+    n.expiry = expiry > current ? expiry : current + 1;
+    insert(i);
+    ++numTimers;
+    return ((uint64_t)n.generation << 32) | (i + 1);
+}
+
+void TimerWheel::cancel(TimerId id)
+{
+    uint32_t i = (uint32_t)id - 1;
+    if (id == 0 || i >= nodes.size())
+        return;
+    Node& n = nodes[i];
+    if (n.list == noList || n.generation != id >> 32)
+        return;
+
+    unlink(i);
+    n.callback = Callback();
+    n.list = noList;
+    ++n.generation;
+    freeNodes.push_back(i);
+    --numTimers;
+}
+
+uint64_t TimerWheel::nextExpiry() const
+{
+    if (heads[expiredList] != nil)
+        return 0;
+    return nextEvent();
+}
+
+bool TimerWheel::popExpired(uint64_t now, Callback& callback, const char*& origin)
+{
+    advanceTo(now);
+
+    uint32_t i = heads[expiredList];
+    if (i == nil)
+        return false;
+
+    Node& n = nodes[i];
+    unlink(i);
+    callback = std::move(n.callback);
+    origin = n.origin;
+    n.list = noList;
+    ++n.generation;
+    freeNodes.push_back(i);
+    --numTimers;
+    return true;
+}
+
+uint32_t TimerWheel::slotOf(int level, uint64_t tick)
+{
+    return level * slotsPerLevel + ((tick >> (level * slotBits)) & (slotsPerLevel - 1));
+}
+
+/**
+ * Returns the first tick after the current one at which a slot has to be
+ * looked at: the tick of the next non-empty slot on level 0, or else the
+ * first tick of the next non-empty slot on a higher level
+ */
+uint64_t TimerWheel::nextEvent() const
+{
+    for (int level = 0; level < levels; level++) {
+        int shift = level * slotBits;
+        unsigned from = ((current >> shift) & (slotsPerLevel - 1)) + 1;
+        for (unsigned w = from / 64; w < slotsPerLevel / 64; w++) {
+            uint64_t bits = occupied[level][w];
+            if (w == from / 64)
+                bits &= ~0ull << (from % 64);
+            if (bits == 0)
+                continue;
+
+            uint64_t slot = w * 64 + __builtin_ctzll(bits);
+            uint64_t above = current >> (shift + slotBits) << (shift + slotBits);
+            return above | (slot << shift);
+        }
+    }
+
+    if (heads[overflowList] != nil)
+        return (current | 0xffffffffull) + 1;
+    return UINT64_MAX;
+}
+
+/**
+ * Puts a node in the slot for its expiry, which is on the level of the
+ * highest byte in which it differs from the current tick. Every timer in a
+ * slot is thus due within the slot's range of the current revolution.
+ */
+void TimerWheel::insert(uint32_t i)
+{
+    uint64_t expiry = nodes[i].expiry;
+    if (expiry <= current) {
+        link(i, expiredList);
+        return;
+    }
+
+    int level = (63 - __builtin_clzll(expiry ^ current)) / slotBits;
+    link(i, level < levels ? slotOf(level, expiry) : overflowList);
+}
+
+void TimerWheel::link(uint32_t i, uint32_t list)
+{
+    Node& n = nodes[i];
+    n.list = list;
+    n.prev = nil;
+    n.next = heads[list];
+    if (n.next != nil)
+        nodes[n.next].prev = i;
+    heads[list] = i;
+
+    if (list < expiredList)
+        occupied[list / slotsPerLevel][list % slotsPerLevel / 64] |= 1ull << (list % 64);
+}
+
+void TimerWheel::unlink(uint32_t i)
+{
+    Node& n = nodes[i];
+    if (n.prev != nil)
+        nodes[n.prev].next = n.next;
+    else
+        heads[n.list] = n.next;
+    if (n.next != nil)
+        nodes[n.next].prev = n.prev;
+
+    if (n.list < expiredList && heads[n.list] == nil)
+        occupied[n.list / slotsPerLevel][n.list % slotsPerLevel / 64] &= ~(1ull << (n.list % 64));
+}
+
+/**
+ * Sorts the timers of a list in again, now that the current tick has reached
+ * its range
+ */
+void TimerWheel::spread(uint32_t list)
+{
+    uint32_t i = heads[list];
+    heads[list] = nil;
+    if (list < expiredList)
+        occupied[list / slotsPerLevel][list % slotsPerLevel / 64] &= ~(1ull << (list % 64));
+
+    while (i != nil) {
+        uint32_t next = nodes[i].next;
+        insert(i);
+        i = next;
+    }
+}
+
+/**
+ * Moves the current tick forward, stopping at every tick where a slot's
+ * range starts, and moves the timers that are due to the expired list
+ */
+void TimerWheel::advanceTo(uint64_t tick)
+{
+    while (current < tick) {
+        uint64_t next = nextEvent();
+        if (next > tick) {
+            // nothing in between, so the slots stay valid
+            current = tick;
+            return;
+        }
+
+        // from the top down, so timers can move several levels at once
+        current = next;
+        if ((current & 0xffffffffull) == 0)
+            spread(overflowList);
+        for (int level = levels - 1; level >= 0; level--) {
+            uint64_t below = (1ull << (level * slotBits)) - 1;
+            if ((current & below) == 0)
+                spread(slotOf(level, current));
+        }
+    }
+}
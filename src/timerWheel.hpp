@@ -0,0 +1,95 @@
+#pragma once
+
+#include "smallFunction.hpp"
+#include <cstdint>
+#include <vector>
+
+/**
+ * Hierarchical timer wheel: four levels of 256 slots, where level L holds the
+ * timers that are due within the current 256^(L+1) ticks. When the ticks of a
+ * slot on a higher level are reached, its timers are spread over the lower
+ * levels. Adding and cancelling a timer is O(1), and finding the next one
+ * only looks at a few bitmaps, however many timers there are.
+ *
+ * Timers more than 2^32 ticks ahead wait in an overflow list that is sorted
+ * in again whenever the top level wraps around.
+ *
+ * Not thread safe; EventLoop uses one per loop, with a tick per millisecond.
+ */
+class TimerWheel {
+public:
+    typedef uint64_t TimerId;
+    typedef SmallFunction<void()> Callback;
+
+    /**
+     * @param now  The current tick
+     */
+    TimerWheel(uint64_t now);
+
+    /**
+     * Adds a timer that is due at tick `expiry`, or the next tick if that has
+     * passed.
+     *
+     * @return an ID for `cancel()`, never 0
+     */
+    TimerId add(uint64_t expiry, Callback callback, const char* origin);
+
+    /**
+     * Removes a timer. Does nothing if it has already been popped, or for 0.
+     */
+    void cancel(TimerId id);
+
+    /**
+     * Returns the tick at which a timer might be due next, which is never
+     * later than the real one, or UINT64_MAX if there are no timers. It is
+     * 0 if a due timer is waiting to be popped.
+     */
+    uint64_t nextExpiry() const;
+
+    /**
+     * Advances to tick `now`, and takes out one timer that is due.
+     *
+     * @return false if no timer is due
+     */
+    bool popExpired(uint64_t now, Callback& callback, const char*& origin);
+
+    size_t size() const { return numTimers; }
+
+private:
+    static constexpr int levels = 4;
+    static constexpr int slotBits = 8;
+    static constexpr int slotsPerLevel = 1 << slotBits;
+
+    // lists that aren't a wheel slot
+    static constexpr uint32_t expiredList = levels * slotsPerLevel;
+    static constexpr uint32_t overflowList = expiredList + 1;
+    static constexpr uint32_t numLists = overflowList + 1;
+    static constexpr uint32_t noList = UINT32_MAX;
+    static constexpr uint32_t nil = UINT32_MAX;
+
+    // nodes are linked by index, so the vector can grow
+    struct Node {
+        Callback callback;
+        const char* origin;
+        uint64_t expiry;
+        uint32_t prev;
+        uint32_t next;
+        uint32_t list = noList;
+        uint32_t generation = 0;    // bumped when the node is reused
+    };
+
+    uint64_t current;
+    size_t numTimers = 0;
+    std::vector<Node> nodes;
+    std::vector<uint32_t> freeNodes;
+    uint32_t heads[numLists];
+    uint64_t occupied[levels][slotsPerLevel / 64];   // non-empty slots
+
+    static uint32_t slotOf(int level, uint64_t tick);
+    uint64_t nextEvent() const;
+    void insert(uint32_t i);
+    void link(uint32_t i, uint32_t list);
+    void unlink(uint32_t i);
+    void spread(uint32_t list);
+    void advanceTo(uint64_t tick);
+};
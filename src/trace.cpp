@@ -0,0 +1,191 @@
+#include "trace.hpp"
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <cstring>
+#include <cstdio>
+#include <unistd.h>
+
+bool Trace::enabled = false;
+
+namespace {
+
+struct TraceEvent {
+    const char* name;       // always a string literal
+    char phase;
+    uint64_t ts;
+    uint64_t dur;
+    const void* id;
+    char detail[64];
+};
+
+/**
+ * The events of one thread. Only that thread writes to it, and it's only read
+ * once all threads have stopped.
+ */
+struct ThreadBuffer {
+    int tid;
+    std::string name;
+    std::vector<TraceEvent> events;
+    size_t next = 0;        // where the next event goes once the buffer is full
+};
+
+std::string outPath;
+std::chrono::steady_clock::time_point startTime;
+
+// every buffer ever created, so events of exited threads are kept
+std::mutex buffersMtx;
+std::vector<ThreadBuffer*> buffers;
+
+thread_local ThreadBuffer* threadBuffer = nullptr;
+
+ThreadBuffer* getThreadBuffer()
+{
+    if (threadBuffer == nullptr) {
+        threadBuffer = new ThreadBuffer;
+        std::lock_guard lck(buffersMtx);
+        threadBuffer->tid = buffers.size() + 1;
+        buffers.push_back(threadBuffer);
+    }
+    return threadBuffer;
+}
+
+void writeEscaped(FILE* f, const char* str)
+{
+    for (; *str != '\0'; ++str) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\')
+            fprintf(f, "\\%c", c);
+        else if (c < 0x20)
+            fprintf(f, "\\u%04x", c);
+        else
+            fputc(c, f);
+    }
+}
+
+void writeEvent(FILE* f, int pid, int tid, const TraceEvent& e, bool& first)
+{
+    fprintf(f, "%s\n{\"name\":\"", first ? "" : ",");
+    first = false;
+    writeEscaped(f, e.name);
+    fprintf(f, "\",\"cat\":\"flassh\",\"ph\":\"%c\",\"ts\":%llu,\"pid\":%d,\"tid\":%d",
+            e.phase, (unsigned long long)e.ts, pid, tid);
+    if (e.phase == 'X')
+        fprintf(f, ",\"dur\":%llu", (unsigned long long)e.dur);
+    if (e.id != nullptr)
+        fprintf(f, ",\"id\":\"%p\"", e.id);
+    if (e.detail[0] != '\0') {
+        fprintf(f, ",\"args\":{\"detail\":\"");
+        writeEscaped(f, e.detail);
+        fprintf(f, "\"}");
+    }
+    fprintf(f, "}");
+}
+
+}
+
+void Trace::start(const std::string& path)
+{
+    outPath = path;
+    startTime = std::chrono::steady_clock::now();
+    enabled = true;
+}
+
+void Trace::stop()
+{
+    if (!enabled)
+        return;
+    enabled = false;
+
+    FILE* f = fopen(outPath.c_str(), "w");
+    if (f == nullptr) {
+        fprintf(stderr, "flassh: failed to write trace to %s: %s\n", outPath.c_str(), strerror(errno));
+        return;
+    }
+
+    int pid = getpid();
+    bool first = true;
+    fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+    std::lock_guard lck(buffersMtx);
+    for (auto b : buffers) {
+        if (!b->name.empty()) {
+            fprintf(f, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"",
+                    first ? "" : ",", pid, b->tid);
+            first = false;
+            writeEscaped(f, b->name.c_str());
+            fprintf(f, "\"}}");
+        }
+
+        // oldest first
+        for (size_t i = 0; i < b->events.size(); i++) {
+            writeEvent(f, pid, b->tid, b->events[(b->next + i) % b->events.size()], first);
+        }
+        delete b;
+    }
+    buffers.clear();
+
+    fprintf(f, "\n]}\n");
+    fclose(f);
+}
+
+void Trace::setThreadName(const std::string& name)
+{
+    if (enabled)
+        getThreadBuffer()->name = name;
+}
+
+uint64_t Trace::now()
+{
+    auto d = std::chrono::steady_clock::now() - startTime;
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+}
+
+void Trace::complete(const char* name, uint64_t start, const std::string& detail)
+{
+    if (enabled)
+        record('X', name, start, now() - start, nullptr, detail);
+}
+
+void Trace::asyncBegin(const char* name, const void* id, const std::string& detail)
+{
+    if (enabled)
+        record('b', name, now(), 0, id, detail);
+}
+
+void Trace::asyncInstant(const char* name, const void* id, const std::string& detail)
+{
+    if (enabled)
+        record('n', name, now(), 0, id, detail);
+}
+
+void Trace::asyncEnd(const char* name, const void* id, const std::string& detail)
+{
+    if (enabled)
+        record('e', name, now(), 0, id, detail);
+}
+
+void Trace::record(char phase, const char* name, uint64_t ts, uint64_t dur,
+                   const void* id, const std::string& detail)
+{
+    ThreadBuffer* b = getThreadBuffer();
+
+    TraceEvent* e;
+    if (b->events.size() < eventsPerThread) {
+        // grow on demand, most threads only record a handful of events
+        b->events.emplace_back();
+        e = &b->events.back();
+    }
+    else {
+        e = &b->events[b->next];
+        b->next = (b->next + 1) % eventsPerThread;
+    }
+
+    e->name = name;
+    e->phase = phase;
+    e->ts = ts;
+    e->dur = dur;
+    e->id = id;
+    strncpy(e->detail, detail.c_str(), sizeof(e->detail) - 1);
+    e->detail[sizeof(e->detail) - 1] = '\0';
+}
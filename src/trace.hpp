@@ -0,0 +1,87 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+/**
+ * Records what flassh spends its time on, and writes it as a Chrome
+ * trace-event JSON file that can be opened in chrome://tracing or Perfetto.
+ *
+ * Every thread records into its own ring buffer, so recording never takes a
+ * lock. When a buffer is full, the oldest events are overwritten. All
+ * functions do nothing unless tracing has been started.
+ */
+class Trace {
+public:
+    /**
+     * Starts recording. Must be called before any other threads are started.
+     */
+    static void start(const std::string& path);
+
+    /**
+     * Writes all recorded events to the file given to `start()`. Must be
+     * called after all other threads have stopped.
+     */
+    static void stop();
+
+    static bool isEnabled() { return enabled; }
+
+    /**
+     * Names the calling thread in the trace
+     */
+    static void setThreadName(const std::string& name);
+
+    /**
+     * Microseconds since tracing was started
+     */
+    static uint64_t now();
+
+    /**
+     * Records a span on the calling thread
+     */
+    static void complete(const char* name, uint64_t start, const std::string& detail = "");
+
+    /**
+     * Records the start, a point in time, or the end of a span that may begin
+     * and end on different threads, e.g. the lifetime of a process. Events
+     * with the same `id` belong to the same span.
+     */
+    static void asyncBegin(const char* name, const void* id, const std::string& detail = "");
+    static void asyncInstant(const char* name, const void* id, const std::string& detail = "");
+    static void asyncEnd(const char* name, const void* id, const std::string& detail = "");
+
+    static constexpr size_t eventsPerThread = 64 * 1024;
+
+private:
+    static bool enabled;
+
+    static void record(char phase, const char* name, uint64_t ts, uint64_t dur,
+                       const void* id, const std::string& detail);
+};
+
+/**
+ * Records a span from construction until the end of the scope
+ */
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const std::string& detail = "")
+        : name(name), detail(Trace::isEnabled() ? detail : std::string())
+    {
+        if (Trace::isEnabled())
+            start = Trace::now();
+    }
+
+    ~TraceSpan()
+    {
+        if (Trace::isEnabled())
+            Trace::complete(name, start, detail);
+    }
+
+    TraceSpan(const TraceSpan&) = delete;
+    TraceSpan& operator=(const TraceSpan&) = delete;
+
+private:
+    const char* name;
+    std::string detail;
+    uint64_t start = 0;
+};
@@ -0,0 +1,82 @@
+#include "units.hpp"
+#include <cctype>
+#include <algorithm>
+#include <climits>
+
+bool parseCount(const std::string& str, unsigned& out)
+{
+    // std::stoul() would take a sign or leading spaces, and wrap around "-1"
+    if (str.empty() || str.size() > 10 || !std::all_of(str.begin(), str.end(), ::isdigit))
+        return false;
+    unsigned long n = std::stoul(str);
+    if (n > UINT_MAX)
+        return false;
+    out = n;
+    return true;
+}
+
+bool parseDuration(const std::string& str, uint64_t& seconds)
+{
+    if (str.empty() || !isdigit(str[0]))
+        return false;
+
+    try {
+        size_t pos;
+        seconds = std::stoull(str, &pos);
+        if (pos == str.size())
+            return true;
+        if (pos + 1 != str.size())
+            return false;
+
+        switch (str[pos]) {
+        case 'd':
+            seconds *= 24;
+            // fall through
+        case 'h':
+            seconds *= 60;
+            // fall through
+        case 'm':
+            seconds *= 60;
+            // fall through
+        case 's':
+            return true;
+        default:
+            return false;
+        }
+    }
+    catch (...) {
+        return false;
+    }
+}
+
+bool parseSize(const std::string& str, uint64_t& out)
+{
+    if (str.empty() || !isdigit(str[0]))
+        return false;
+
+    try {
+        size_t pos;
+        out = std::stoull(str, &pos);
+        if (pos == str.size())
+            return true;
+        if (pos + 1 != str.size())
+            return false;
+
+        switch (toupper(str[pos])) {
+        case 'G':
+            out *= 1024;
+            // fall through
+        case 'M':
+            out *= 1024;
+            // fall through
+        case 'K':
+            out *= 1024;
+            return true;
+        default:
+            return false;
+        }
+    }
+    catch (...) {
+        return false;
+    }
+}
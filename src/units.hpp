@@ -0,0 +1,19 @@
+#pragma once
+
+#include <string>
+#include <cstdint>
+
+/**
+ * Parses a plain decimal number that fits in an unsigned
+ */
+bool parseCount(const std::string& str, unsigned& out);
+
+/**
+ * Parses a number of seconds with an optional s, m, h or d suffix
+ */
+bool parseDuration(const std::string& str, uint64_t& seconds);
+
+/**
+ * Parses a number with an optional K, M or G suffix
+ */
+bool parseSize(const std::string& str, uint64_t& out);
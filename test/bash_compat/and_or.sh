@@ -0,0 +1,17 @@
+# test && and ||
+true && echo 1
+false && echo 2
+false || echo 3
+true || echo 4
+false && echo 5 || echo 6
+true || echo 7 && echo 8
+echo a | grep b && echo 9
+echo a | grep a || echo 10
+true &&
+  echo 11
+false || echo 12 | tr 1 3; echo 13
+false
+false || echo $?
+false; true && echo $?
+true | false && echo yes || echo no $?
+false && echo 14 || echo $?
@@ -1,2 +1,4 @@
 # test the most basic command running functionality
 ls
+# words starting with @ are ordinary arguments after the command name
+echo @foo user@host @ "@bar"
@@ -0,0 +1,2 @@
+# a redirection without a file is a syntax error
+echo a >
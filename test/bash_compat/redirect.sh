@@ -0,0 +1,20 @@
+# test I/O redirection to local files
+echo hello > redirect_test.txt
+echo world>>redirect_test.txt
+cat < redirect_test.txt
+tr a-z A-Z < redirect_test.txt | cat >redirect_test2.txt
+cat redirect_test2.txt
+# redirections of other FDs
+echo hi 2>/dev/null
+ls /nonexistent_flassh_dir 2>redirect_test2.txt
+cat redirect_test2.txt
+ls /nonexistent_flassh_dir 2>>redirect_test2.txt 1>/dev/null
+wc -l <redirect_test2.txt
+cat 0<redirect_test.txt
+echo 2 >redirect_test2.txt
+cat redirect_test2.txt
+# an explicit local host, which bash takes as part of the file name
+echo local > ::redirect_test3.txt
+cat < ::redirect_test3.txt
+rm -f "::redirect_test3.txt" redirect_test3.txt
+rm redirect_test.txt redirect_test2.txt
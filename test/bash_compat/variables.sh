@@ -0,0 +1,20 @@
+# test variables and command substitution
+X=hello
+echo $X "${X} world" '$X' "\$X"
+Y=$(echo a; echo b)
+echo "$Y"
+EMPTY=
+echo "[$EMPTY]" $UNSET-
+false
+echo $?
+Z=$(false)
+echo $?
+echo "$(echo $(echo nested))" $ a$
+echo $(echo x | tr x y)
+X=$X-again && echo "$X"
+echo "[$(false)]" $? "$(true)" $?
+false || echo $?
+false; true && echo $?
+true | false && echo yes || echo no $?
+echo "$(false; echo $?)"
+false; echo $? "$(true; false)" $?
@@ -0,0 +1,52 @@
+#!/usr/bin/env python3
+# Measures heap allocations per command with the counter of `--stats`, which
+# needs a build configured with -DFLASSH_COUNT_ALLOCS=ON.
+#
+# Two scripts that differ only in their number of commands are run, so what
+# flassh allocates once at startup cancels out. Each is run twice and the
+# second run is counted, when the script comes from the compiled script cache.
+import json
+import os
+import re
+import sys
+import tempfile
+
+TEST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.insert(0, TEST_DIR)
+from util import runScript, FLASSH_PATH
+
+FLASSH = os.path.join(TEST_DIR, FLASSH_PATH)
+
+BASE_COMMANDS = 100
+EXTRA_COMMANDS = 1000
+
+def allocations(script):
+    for _ in range(2):
+        out = runScript([FLASSH, "--stats", script], timeout=120)
+    m = re.search(rb"allocations\s+(\d+)", out["stderr"])
+    if out["status"] != 0:
+        sys.exit("run failed: " + out["stderr"].decode(errors="replace"))
+    if m is None:
+        sys.exit("no allocation count, build flassh with -DFLASSH_COUNT_ALLOCS=ON")
+    return int(m.group(1))
+
+def main():
+    with tempfile.TemporaryDirectory() as cache:
+        # keep the compiled scripts out of the user's cache
+        os.environ["XDG_CACHE_HOME"] = cache
+        counts = []
+        for n in [BASE_COMMANDS, BASE_COMMANDS + EXTRA_COMMANDS]:
+            path = os.path.join(cache, "bench_%d.flassh" % n)
+            with open(path, "w") as f:
+                f.write("true\n" * n)
+            counts.append(allocations(path))
+
+    json.dump({
+        "commands": EXTRA_COMMANDS,
+        "allocations": counts[1] - counts[0],
+        "allocations_per_command": (counts[1] - counts[0]) / EXTRA_COMMANDS,
+    }, sys.stdout, indent=2)
+    print()
+
+if __name__ == "__main__":
+    main()
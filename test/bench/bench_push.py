@@ -0,0 +1,74 @@
+#!/usr/bin/env python3
+# Compares the bytes sent by `push` against a full copy of the same file.
+#
+# Runs against a throwaway sshd on localhost, or the host in
+# FLASSH_BENCH_HOST (see sshd.py).
+import json
+import os
+import random
+import re
+import sys
+import tempfile
+
+TEST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.insert(0, TEST_DIR)
+from util import runScript, FLASSH_PATH
+from sshd import benchHost
+
+FLASSH = os.path.join(TEST_DIR, FLASSH_PATH)
+
+FILE_SIZE = 32 * 1024 * 1024
+REMOTE_PATH = "/tmp/flassh_bench_push.bin"
+
+# fraction of the file that is modified between pushes
+CHANGE_FRACTIONS = [0.0, 0.01, 0.05, 0.25]
+
+def push(host, src):
+    with tempfile.NamedTemporaryFile("w", suffix=".sh") as script:
+        script.write("h := %s\n" % host)
+        script.write("push -v %s %s h\n" % (src, REMOTE_PATH))
+        script.flush()
+        out = runScript([FLASSH, script.name], timeout=300)
+    m = re.search(rb"sent (\d+) bytes", out["stderr"])
+    if out["status"] != 0 or m is None:
+        sys.exit("push failed: " + out["stderr"].decode(errors="replace"))
+    return int(m.group(1))
+
+def modify(data, fraction):
+    # scattered 4 KiB edits, like patched binaries or edited config files
+    data = bytearray(data)
+    for _ in range(int(len(data) * fraction / 4096)):
+        pos = random.randrange(len(data) - 4096)
+        data[pos:pos + 4096] = os.urandom(4096)
+    return bytes(data)
+
+def main():
+    random.seed(0)
+    results = []
+    with benchHost() as host:
+        with tempfile.NamedTemporaryFile(suffix=".bin") as src:
+            data = os.urandom(FILE_SIZE)
+            src.write(data)
+            src.flush()
+
+            # make sure the remote file exists and matches
+            push(host, src.name)
+
+            for fraction in CHANGE_FRACTIONS:
+                data = modify(data, fraction)
+                src.seek(0)
+                src.write(data)
+                src.flush()
+                sent = push(host, src.name)
+                results.append({
+                    "changed_fraction": fraction,
+                    "full_copy_bytes": FILE_SIZE,
+                    "delta_bytes": sent,
+                    "ratio": sent / FILE_SIZE,
+                })
+
+    json.dump(results, sys.stdout, indent=2)
+    print()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+# Measures remote -> local throughput for different compression and cipher
+# settings in the host definition.
+#
+# Runs against a throwaway sshd on localhost, or the host in
+# FLASSH_BENCH_HOST (see sshd.py).
+import json
+import os
+import sys
+import tempfile
+import time
+
+TEST_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..")
+sys.path.insert(0, TEST_DIR)
+from util import runScript, FLASSH_PATH
+from sshd import benchHost
+
+FLASSH = os.path.join(TEST_DIR, FLASSH_PATH)
+
+# `seq` output compresses about as well as typical log files
+REMOTE_CMD = "seq 1 10000000"
+EXPECTED_BYTES = len("".join("%d\n" % i for i in range(1, 10000001)))
+
+SETTINGS = [
+    "",
+    "compression=no",
+    "compression=1",
+    "compression=6",
+    "compression=9",
+    "ciphers=aes128-gcm@openssh.com",
+    "ciphers=aes256-gcm@openssh.com",
+    "ciphers=chacha20-poly1305@openssh.com",
+    "ciphers=aes128-ctr macs=hmac-sha2-256-etm@openssh.com",
+    "ciphers=aes128-ctr macs=hmac-sha1",
+]
+
+REPEAT = 3
+
+def run(host, options):
+    with tempfile.NamedTemporaryFile("w", suffix=".sh") as script:
+        script.write("h := %s %s\n" % (host, options))
+        script.write("h::%s | wc -c\n" % REMOTE_CMD)
+        script.flush()
+        start = time.monotonic()
+        out = runScript([FLASSH, script.name], timeout=300)
+        elapsed = time.monotonic() - start
+    if out["status"] != 0 or int(out["stdout"]) != EXPECTED_BYTES:
+        sys.exit("run with '%s' failed: %s" % (options, out["stderr"].decode(errors="replace")))
+    return elapsed
+
+def main():
+    results = []
+    with benchHost() as host:
+        for options in SETTINGS:
+            best = min(run(host, options) for _ in range(REPEAT))
+            results.append({
+                "options": options or "default",
+                "seconds": best,
+                "mb_per_s": EXPECTED_BYTES / best / 1e6,
+            })
+
+    json.dump(results, sys.stdout, indent=2)
+    print()
+
+if __name__ == "__main__":
+    main()
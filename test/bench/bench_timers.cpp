@@ -0,0 +1,85 @@
+// Checks that pending timers don't slow down the event loop.
+//
+// Measures adding and cancelling timers, and the round trip of a task
+// through a running loop and how often it wakes up while idle, with no
+// timers and with 100k timers pending. Prints the results as JSON.
+#include "eventLoop.hpp"
+#include "stats.hpp"
+#include <cstdio>
+#include <random>
+#include <thread>
+#include <vector>
+#include <unistd.h>
+
+static const size_t NUM_TIMERS = 100000;
+static const int ROUND_TRIPS = 10000;
+
+/**
+ * Returns the mean microseconds of a runSync() from another thread
+ */
+static double roundTripUs(EventLoop& loop)
+{
+    uint64_t start = monotonicUs();
+    for (int i = 0; i < ROUND_TRIPS; i++)
+        loop.runSync([] () {});
+    return (double)(monotonicUs() - start) / ROUND_TRIPS;
+}
+
+/**
+ * Returns the wakeups of the loop in one idle second
+ */
+static uint64_t idleWakeups(EventLoop& loop)
+{
+    uint64_t before = loop.getStats().wakeups.get();
+    sleep(1);
+    return loop.getStats().wakeups.get() - before;
+}
+
+int main()
+{
+    EventLoop loop;
+    std::thread t([&loop] () { loop.run(); });
+
+    double emptyRoundTrip = roundTripUs(loop);
+    uint64_t emptyWakeups = idleWakeups(loop);
+
+    // between a minute and a day out, like keepalives and timeouts
+    std::mt19937_64 rng(0);
+    std::vector<uint64_t> delays(NUM_TIMERS);
+    for (auto& d : delays)
+        d = 60000000 + rng() % 86400000000;
+
+    std::vector<EventLoop::TimerId> ids(NUM_TIMERS);
+    uint64_t addUs = 0;
+    loop.runSync([&] () {
+        uint64_t start = monotonicUs();
+        for (size_t i = 0; i < NUM_TIMERS; i++)
+            ids[i] = loop.addTimer(delays[i], [] () {}, "bench timer");
+        addUs = monotonicUs() - start;
+    });
+
+    double fullRoundTrip = roundTripUs(loop);
+    uint64_t fullWakeups = idleWakeups(loop);
+
+    uint64_t cancelUs = 0;
+    loop.runSync([&] () {
+        uint64_t start = monotonicUs();
+        for (auto id : ids)
+            loop.cancelTimer(id);
+        cancelUs = monotonicUs() - start;
+    });
+
+    loop.stop();
+    t.join();
+
+    printf("{\n");
+    printf("  \"timers\": %zu,\n", NUM_TIMERS);
+    printf("  \"add_ns_per_timer\": %.1f,\n", addUs * 1000.0 / NUM_TIMERS);
+    printf("  \"cancel_ns_per_timer\": %.1f,\n", cancelUs * 1000.0 / NUM_TIMERS);
+    printf("  \"round_trip_us_no_timers\": %.2f,\n", emptyRoundTrip);
+    printf("  \"round_trip_us_with_timers\": %.2f,\n", fullRoundTrip);
+    printf("  \"idle_wakeups_per_s_no_timers\": %llu,\n", (unsigned long long)emptyWakeups);
+    printf("  \"idle_wakeups_per_s_with_timers\": %llu\n", (unsigned long long)fullWakeups);
+    printf("}\n");
+    return 0;
+}
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+# End-to-end throughput and latency benchmarks against a throwaway sshd on
+# localhost (or FLASSH_BENCH_HOST, see sshd.py). Prints the results as JSON,
+# so they can be compared between releases.
+#
+#   ./run_benchmarks.py --output results.json
+import argparse
+import json
+import os
+import platform
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH_DIR = os.path.dirname(os.path.abspath(__file__))
+TEST_DIR = os.path.join(BENCH_DIR, "..")
+sys.path.insert(0, TEST_DIR)
+from util import runScript, FLASSH_PATH, FLASSHD_PATH
+from sshd import benchHost
+
+MB = 1024 * 1024
+
+class Runner:
+    def __init__(self, flassh, hostSpec, repeat):
+        self.flassh = flassh
+        self.hostSpec = hostSpec
+        self.repeat = repeat
+
+    def hostDefs(self, n):
+        return "".join("h%d := %s\n" % (i, self.hostSpec) for i in range(n))
+
+    # best wall clock time of running `body` with `numHosts` hosts defined
+    def time(self, numHosts, body, timeout=600, flags=[]):
+        with tempfile.NamedTemporaryFile("w", suffix=".sh") as script:
+            script.write(self.hostDefs(numHosts))
+            script.write(body)
+            script.flush()
+
+            best = None
+            for _ in range(self.repeat):
+                start = time.monotonic()
+                out = runScript([self.flassh] + flags + [script.name], timeout=timeout)
+                elapsed = time.monotonic() - start
+                if out["status"] != 0 or out["stderr"]:
+                    sys.exit("benchmark failed:\n%s\n%s" % (body, out["stderr"].decode(errors="replace")))
+                best = elapsed if best is None else min(best, elapsed)
+            return best
+
+def benchConnect(r, n):
+    empty = r.time(0, "")
+    withHosts = r.time(n, "")
+    return {
+        "hosts": n,
+        "startup_s": empty,
+        "per_connection_ms": (withHosts - empty) / n * 1000,
+    }
+
+def benchStartLatency(r, n):
+    setup = r.time(1, "")
+    total = r.time(1, "h0::true\n" * n)
+    return {
+        "commands": n,
+        "per_command_ms": (total - setup) / n * 1000,
+    }
+
+def benchThroughput(r, numHosts, body, size):
+    setup = r.time(numHosts, "")
+    total = r.time(numHosts, body)
+    return {
+        "bytes": size,
+        "seconds": total - setup,
+        "mb_per_s": size / MB / (total - setup),
+    }
+
+def benchFanout(r, n, size):
+    with tempfile.NamedTemporaryFile(suffix=".bin") as src:
+        src.truncate(size)
+        src.flush()
+        hosts = " ".join("h%d" % i for i in range(n))
+        res = benchThroughput(r, n, "distribute %s /dev/null %s\n" % (src.name, hosts), size * n)
+    res["hosts"] = n
+    return res
+
+# time of a whole run of a one command script, with and without flasshd
+def benchDaemon(r, flasshd):
+    body = "h0::true\n"
+    direct = r.time(1, body)
+    with tempfile.TemporaryDirectory() as tmpDir:
+        socket = os.path.join(tmpDir, "flasshd.sock")
+        daemon = subprocess.Popen([flasshd, "--socket", socket], stderr=subprocess.DEVNULL)
+        os.environ["FLASSH_SOCKET"] = socket
+        try:
+            while not os.path.exists(socket):
+                if daemon.poll() is not None:
+                    sys.exit("flasshd failed to start")
+                time.sleep(0.01)
+            r.time(1, body, flags=["--daemon"])     # connects the host
+            viaDaemon = r.time(1, body, flags=["--daemon"])
+        finally:
+            del os.environ["FLASSH_SOCKET"]
+            daemon.terminate()
+            daemon.wait()
+    return {
+        "direct_ms": direct * 1000,
+        "daemon_ms": viaDaemon * 1000,
+    }
+
+def gitRevision():
+    try:
+        return subprocess.run(["git", "describe", "--always", "--dirty"], cwd=BENCH_DIR,
+                              capture_output=True, text=True, check=True).stdout.strip()
+    except (OSError, subprocess.CalledProcessError):
+        return None
+
+def main():
+    parser = argparse.ArgumentParser(description="flassh end-to-end benchmarks")
+    parser.add_argument("--flassh", default=os.path.join(TEST_DIR, FLASSH_PATH),
+                        help="flassh executable to benchmark")
+    parser.add_argument("--flasshd", default=os.path.join(TEST_DIR, FLASSHD_PATH),
+                        help="flasshd executable to benchmark")
+    parser.add_argument("--size", type=int, default=256, help="MiB to transfer per pipe")
+    parser.add_argument("--fanout", type=int, default=16, help="number of hosts for fan-out")
+    parser.add_argument("--commands", type=int, default=200, help="commands for the start latency")
+    parser.add_argument("--repeat", type=int, default=3, help="runs per benchmark, the best is kept")
+    parser.add_argument("--output", help="write the results to this file instead of stdout")
+    args = parser.parse_args()
+
+    size = args.size * MB
+    results = {}
+    with benchHost() as hostSpec:
+        r = Runner(os.path.abspath(args.flassh), hostSpec, args.repeat)
+
+        results["connect"] = benchConnect(r, args.fanout)
+        results["start_latency"] = benchStartLatency(r, args.commands)
+        results["local_to_remote"] = benchThroughput(r, 1,
+            "head -c %d /dev/zero | h0::cat > h0::/dev/null\n" % size, size)
+        results["remote_to_local"] = benchThroughput(r, 1,
+            "h0::head -c %d /dev/zero > /dev/null\n" % size, size)
+        results["remote_to_remote"] = benchThroughput(r, 2,
+            "h0::head -c %d /dev/zero | h1::cat > h1::/dev/null\n" % size, size)
+        results["fanout"] = benchFanout(r, args.fanout, size // args.fanout)
+        results["daemon"] = benchDaemon(r, os.path.abspath(args.flasshd))
+
+    report = {
+        "revision": gitRevision(),
+        "timestamp": int(time.time()),
+        "machine": platform.machine(),
+        "cpus": os.cpu_count(),
+        "params": vars(args),
+        "results": results,
+    }
+
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(report, f, indent=2)
+            f.write("\n")
+    else:
+        json.dump(report, sys.stdout, indent=2)
+        print()
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,127 @@
+# Throwaway sshd on localhost for the benchmarks.
+#
+# Generates a host key and a client key in a temporary directory, and runs
+# sshd on a free port as the current user, so no root access or changes to
+# ~/.ssh are needed. sshd has to be installed (openssh-server).
+import contextlib
+import getpass
+import os
+import shutil
+import socket
+import subprocess
+import tempfile
+import time
+
+SSHD_CANDIDATES = ["/usr/sbin/sshd", "/usr/local/sbin/sshd", "/sbin/sshd"]
+
+def findSshd():
+    path = shutil.which("sshd")
+    if path is not None:
+        return path
+    for path in SSHD_CANDIDATES:
+        if os.access(path, os.X_OK):
+            return path
+    raise RuntimeError("sshd not found, install openssh-server")
+
+def freePort():
+    with socket.socket() as s:
+        s.bind(("127.0.0.1", 0))
+        return s.getsockname()[1]
+
+def keygen(path):
+    subprocess.run(["ssh-keygen", "-q", "-t", "ed25519", "-N", "", "-f", path],
+                   check=True, stdin=subprocess.DEVNULL)
+
+class LocalSshd:
+    def __init__(self):
+        self.dir = None
+        self.proc = None
+        self.port = None
+        self.user = getpass.getuser()
+
+    def start(self):
+        sshd = findSshd()
+        self.dir = tempfile.mkdtemp(prefix="flassh_sshd_")
+        self.hostKey = os.path.join(self.dir, "host_key")
+        self.clientKey = os.path.join(self.dir, "client_key")
+        keygen(self.hostKey)
+        keygen(self.clientKey)
+        shutil.copy(self.clientKey + ".pub", os.path.join(self.dir, "authorized_keys"))
+
+        self.port = freePort()
+        config = os.path.join(self.dir, "sshd_config")
+        with open(config, "w") as f:
+            f.write("\n".join([
+                "Port %d" % self.port,
+                "ListenAddress 127.0.0.1",
+                "HostKey %s" % self.hostKey,
+                "AuthorizedKeysFile %s" % os.path.join(self.dir, "authorized_keys"),
+                "PidFile %s" % os.path.join(self.dir, "sshd.pid"),
+                "PasswordAuthentication no",
+                "KbdInteractiveAuthentication no",
+                "UsePAM no",
+                "StrictModes no",
+                "Subsystem sftp internal-sftp",
+                # fan-out benchmarks open many sessions and channels at once
+                "MaxStartups 1000",
+                "MaxSessions 1000",
+                "LogLevel ERROR",
+                "",
+            ]))
+
+        # sshd insists on an absolute path so it can re-exec itself
+        self.proc = subprocess.Popen([sshd, "-D", "-e", "-f", config],
+                                     stdin=subprocess.DEVNULL)
+        self.waitForPort()
+
+    def waitForPort(self, timeout=10):
+        deadline = time.monotonic() + timeout
+        while time.monotonic() < deadline:
+            if self.proc.poll() is not None:
+                raise RuntimeError("sshd exited with status %d" % self.proc.returncode)
+            try:
+                with socket.create_connection(("127.0.0.1", self.port), timeout=1):
+                    return
+            except OSError:
+                time.sleep(0.05)
+        raise RuntimeError("sshd did not start listening on port %d" % self.port)
+
+    def stop(self):
+        if self.proc is not None:
+            self.proc.terminate()
+            self.proc.wait()
+            self.proc = None
+        if self.dir is not None:
+            shutil.rmtree(self.dir, ignore_errors=True)
+            self.dir = None
+
+    # kills the server side of every open connection, like a network failure
+    # would, while sshd keeps accepting new ones
+    def dropConnections(self):
+        subprocess.run(["pkill", "-KILL", "-P", str(self.proc.pid)], check=False)
+
+    # the right hand side of a flassh host definition for this server
+    def hostSpec(self):
+        return "%s@127.0.0.1:%d identity=%s" % (self.user, self.port, self.clientKey)
+
+    def __enter__(self):
+        try:
+            self.start()
+        except:
+            self.stop()
+            raise
+        return self
+
+    def __exit__(self, *exc):
+        self.stop()
+
+# Yields the right hand side of a host definition to benchmark against: the
+# host in FLASSH_BENCH_HOST if set, otherwise a LocalSshd.
+@contextlib.contextmanager
+def benchHost():
+    host = os.environ.get("FLASSH_BENCH_HOST")
+    if host is not None:
+        yield host
+        return
+    with LocalSshd() as sshd:
+        yield sshd.hostSpec()
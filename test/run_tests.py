@@ -1,7 +1,22 @@
 #!/usr/bin/env python3
 # technically these aren't unit tests, but whatever
+import json
+import os
+import re
+import socket
+import tempfile
+import time
 import unittest
-from util import FlasshTestCase, DEFAULT_PARAMS, FLASSH_PATH
+from subprocess import Popen, DEVNULL, PIPE
+from util import FlasshTestCase, DEFAULT_PARAMS, DEFAULT_TIMEOUT, FLASSH_PATH, FLASSHD_PATH, runScript, runSource
+from bench.sshd import LocalSshd, findSshd
+
+def haveSshd():
+    try:
+        findSshd()
+        return True
+    except RuntimeError:
+        return False
 
 # test bash compatibility by running the same script in flassh and bash
 class TestBashCompat(FlasshTestCase):
@@ -29,7 +44,607 @@ class TestBashCompat(FlasshTestCase):
     def test_pipe(self):
         self.assertBashCompat("bash_compat/pipe.sh")
 
-    # TODO: test I/O redirection, subshell, background processes, etc
+    def test_redirect(self):
+        self.assertBashCompat("bash_compat/redirect.sh")
+        self.assertBashCompat("bash_compat/fail_redirect.sh", False)
+
+    def test_and_or(self):
+        self.assertBashCompat("bash_compat/and_or.sh")
+
+    def test_variables(self):
+        self.assertBashCompat("bash_compat/variables.sh")
+
+    # TODO: test subshell, background processes, etc
+
+# errors in flassh's own syntax are reported like syntax errors, nothing runs
+class TestSyntaxErrors(FlasshTestCase):
+    def assertSyntaxError(self, script):
+        out = runSource(script)
+        self.assertEqual(out["status"], 2)
+        self.assertEqual(out["stdout"], b"")
+        self.assertIn(b"Syntax error", out["stderr"])
+
+    def test_bad_host(self):
+        self.assertSyntaxError("echo hi\nh := foo@bar badopt=1\n")
+        self.assertSyntaxError("h := foo@bar compression=maybe\n")
+        self.assertSyntaxError("h := foo:99999999999999999999\n")
+        self.assertSyntaxError("h := foo@bar compression=3x\n")
+        self.assertSyntaxError("h := foo@bar compression=10\n")
+        self.assertSyntaxError("h := foo@bar rekey_time=-1\n")
+        self.assertSyntaxError("h := foo@bar rekey_data=1T\n")
+        self.assertSyntaxError("h := foo@bar reconnect=-1\n")
+        self.assertSyntaxError("h := foo@bar max_channels=0\n")
+        self.assertSyntaxError("h := foo@bar max_channels=2x\n")
+        self.assertSyntaxError("h := foo@bar timeout=soon\n")
+        self.assertSyntaxError("h := foo@bar keepalive_count=0\n")
+        self.assertSyntaxError("h := foo@bar keepalive=-5\n")
+
+    # the options of host definitions are checked when they are parsed, no
+    # connection is needed
+    def test_host_options(self):
+        out = runSource("h := foo@127.0.0.1:1 compression=9 ciphers=aes128-ctr macs=hmac-sha2-256 " +
+                        "kex=curve25519-sha256 rekey_data=1G rekey_time=3600\n" +
+                        "g := foo@127.0.0.1:1 compression=no\necho ok\n")
+        self.assertEqual(out["stdout"], b"ok\n")
+        self.assertEqual(out["status"], 0)
+        self.assertNotIn(b"Syntax error", out["stderr"])
+
+    def test_bad_modifier(self):
+        self.assertSyntaxError("@bogus 1 echo hi\n")
+        self.assertSyntaxError("echo hi\n@cache xyz echo hi\n")
+        self.assertSyntaxError("@timeout 0 echo hi\n")
+        self.assertSyntaxError("@timeout 1y echo hi\n")
+        self.assertSyntaxError("@retry -1 echo hi\n")
+        self.assertSyntaxError("@retry 2x echo hi\n")
+
+    def test_bad_substitution(self):
+        self.assertSyntaxError("echo ${X\n")
+        self.assertSyntaxError("echo hi\necho \"${X Y}\"\n")
+
+# builtins that fail before they touch a host
+class TestBuiltins(FlasshTestCase):
+    def assertFails(self, script, status, message):
+        out = runSource(script)
+        self.assertEqual(out["status"], status)
+        self.assertEqual(out["stdout"], b"")
+        self.assertIn(message, out["stderr"])
+
+    def test_distribute(self):
+        self.assertFails("distribute run_tests.py /tmp\n", 2, b"usage: distribute")
+        self.assertFails("distribute /nonexistent /tmp/x h\n", 1, b"/nonexistent")
+        self.assertFails("distribute run_tests.py /tmp/x nohost\n", 1, b"nohost")
+
+    def test_push(self):
+        self.assertFails("push run_tests.py /tmp/x\n", 2, b"usage: push")
+        self.assertFails("push -b 0 run_tests.py /tmp/x h\n", 2, b"usage: push")
+        self.assertFails("push -b -5 run_tests.py /tmp/x h\n", 2, b"usage: push")
+        self.assertFails("push /nonexistent /tmp/x h\n", 1, b"/nonexistent")
+        self.assertFails("push run_tests.py /tmp/x nohost\n", 1, b"nohost")
+
+    def test_inventory(self):
+        self.assertFails("inventory\n", 2, b"usage: inventory")
+        self.assertFails("inventory /nonexistent\n", 1, b"/nonexistent")
+        with tempfile.NamedTemporaryFile("w") as inv:
+            for bad in ["a := x@127.0.0.1:1\necho hi\n", "a := x@127.0.0.1:1 badopt=1\n", "a := x@127.0.0.1:1 \"\n"]:
+                inv.seek(0)
+                inv.truncate()
+                inv.write(bad)
+                inv.flush()
+                # nothing of a bad inventory is defined
+                out = runSource("inventory %s\necho $?\ndistribute run_tests.py /tmp/x a\n" % inv.name)
+                self.assertEqual(out["stdout"], b"1\n")
+                self.assertIn(b"No host with alias a", out["stderr"])
+
+# hosts are spread over the event loops other than the main one
+class TestEventLoops(FlasshTestCase):
+    def test_sharding(self):
+        hosts = ["a", "b", "c", "d"]
+        script = "".join("%s := x@127.0.0.1:1\n" % h for h in hosts) + "".join("%s: true\n" % h for h in hosts)
+        out = runSource(script, ["--event-loops", "3", "--stats"])
+        loops = re.findall(rb"^(main|\d+) +\d+ +(\d+)", out["stderr"], re.M)
+        self.assertEqual([name for name, _ in loops], [b"main", b"1", b"2"])
+        for name, tasks in loops:
+            self.assertGreater(int(tasks), 0, name)
+
+    def test_bad_count(self):
+        for count in ["0", "-1", "x"]:
+            out = runSource("echo hi\n", ["--event-loops", count])
+            self.assertEqual(out["status"], 2)
+            self.assertIn(b"usage", out["stderr"])
+
+# the stats builtin prints to its stdout, --stats to stderr at the end
+class TestStats(FlasshTestCase):
+    def test_builtin(self):
+        out = runSource("stats | grep -c '^main '\nstats > /dev/null\n")
+        self.assertEqual(out["stdout"], b"1\n")
+        self.assertEqual(out["status"], 0)
+
+    def test_option(self):
+        out = runSource("echo hi\n", ["--stats"])
+        self.assertEqual(out["stdout"], b"hi\n")
+        self.assertRegex(out["stderr"], rb"(?m)^host +stdout +stderr +stdin")
+        self.assertRegex(out["stderr"], rb"(?m)^event loop +wakeups +tasks")
+        self.assertRegex(out["stderr"], rb"(?m)^main +\d+ +\d+")
+
+# commands for a host that can't be reached fail, the rest of the script runs
+class TestUnreachableHost(FlasshTestCase):
+    def test_dispatch(self):
+        out = runSource("h := x@127.0.0.1:1\nh: echo 1\necho local\nh: echo 2\n")
+        self.assertEqual(out["stdout"], b"local\n")
+        self.assertEqual(out["status"], 1)
+
+# --connect-rate and --bwlimit-* take a number with an optional K, M or G
+class TestLimitOptions(FlasshTestCase):
+    def test_valid(self):
+        for args in [["--connect-rate", "10"], ["--connect-rate", "0"], ["--bwlimit-up", "1M"],
+                     ["--bwlimit-down", "512K"], ["--bwlimit-up", "1G", "--bwlimit-down", "100"]]:
+            out = runSource("echo ok\n", args)
+            self.assertEqual(out["stdout"], b"ok\n", args)
+            self.assertEqual(out["status"], 0, args)
+
+    def test_invalid(self):
+        for args in [["--connect-rate", "x"], ["--connect-rate", "-1"], ["--bwlimit-up", "1T"],
+                     ["--bwlimit-down", "1.5M"], ["--bwlimit-up", "M"]]:
+            out = runSource("echo ok\n", args)
+            self.assertEqual(out["stdout"], b"", args)
+            self.assertEqual(out["status"], 2, args)
+            self.assertIn(b"usage", out["stderr"])
+
+# event loop timers fire on time, both within the first level of the timer
+# wheel (256ms) and beyond it. Connections wait for the timers of
+# --connect-rate, which lets the first `rate` through at once.
+class TestTimers(FlasshTestCase):
+    def assertConnectTime(self, rate, numHosts, seconds):
+        hosts = ["h%d" % i for i in range(numHosts)]
+        script = "".join("%s := x@127.0.0.1:1\n" % h for h in hosts) + "".join("%s: true\n" % h for h in hosts)
+        start = time.monotonic()
+        runSource(script, ["--connect-rate", str(rate)])
+        elapsed = time.monotonic() - start
+        self.assertGreaterEqual(elapsed, seconds * 0.95)
+        self.assertLess(elapsed, seconds + 1)
+
+    def test_short(self):
+        self.assertConnectTime(10, 15, 0.5)
+
+    def test_long(self):
+        self.assertConnectTime(1, 3, 2)
+
+# @timeout and the timeout= host option stop remote commands
+class TestTimeout(FlasshTestCase):
+    def test_local(self):
+        start = time.monotonic()
+        out = runSource("@timeout 1 sleep 5\n")
+        self.assertLess(time.monotonic() - start, 4)
+        self.assertEqual(out["status"], 1)
+        self.assertIn(b"@timeout only works for remote commands", out["stderr"])
+
+    def test_durations(self):
+        out = runSource("h := x@127.0.0.1:1 timeout=90s\nh: @timeout 1m true\nh: @timeout 2h true\n" +
+                        "@timeout 1d h::true\necho ok\n")
+        self.assertEqual(out["stdout"], b"ok\n")
+        self.assertEqual(out["status"], 0)
+
+# parsed scripts are cached in $XDG_CACHE_HOME/flassh, named after their MD5
+class TestScriptCache(FlasshTestCase):
+    def setUp(self):
+        self.tmpDir = tempfile.TemporaryDirectory()
+        self.oldCache = os.environ.get("XDG_CACHE_HOME")
+        os.environ["XDG_CACHE_HOME"] = self.tmpDir.name
+        self.script = os.path.join(self.tmpDir.name, "script.sh")
+
+    def tearDown(self):
+        if self.oldCache is None:
+            del os.environ["XDG_CACHE_HOME"]
+        else:
+            os.environ["XDG_CACHE_HOME"] = self.oldCache
+        self.tmpDir.cleanup()
+
+    def entries(self):
+        cache = os.path.join(self.tmpDir.name, "flassh")
+        return sorted(os.path.join(cache, e) for e in os.listdir(cache) if e.startswith("script-"))
+
+    def runCached(self, source):
+        with open(self.script, "w") as f:
+            f.write(source)
+        return runScript([FLASSH_PATH, self.script])
+
+    def test_edit(self):
+        self.assertEqual(self.runCached("echo one\n")["stdout"], b"one\n")
+        self.assertEqual(len(self.entries()), 1)
+
+        # an edited script is a new entry, not the old one
+        self.assertEqual(self.runCached("echo two\n")["stdout"], b"two\n")
+        self.assertEqual(len(self.entries()), 2)
+        self.assertEqual(self.runCached("echo two\n")["stdout"], b"two\n")
+        self.assertEqual(len(self.entries()), 2)
+        self.assertEqual(self.runCached("echo one\n")["stdout"], b"one\n")
+
+    def test_corrupt(self):
+        self.runCached("echo ok\n")
+        for garbage in [b"", b"flassh-ir", b"\x00" * 100]:
+            with open(self.entries()[0], "wb") as f:
+                f.write(garbage)
+            out = self.runCached("echo ok\n")
+            self.assertEqual(out["stdout"], b"ok\n")
+            self.assertEqual(out["status"], 0)
+        # and it is written again
+        with open(self.entries()[0], "rb") as f:
+            self.assertTrue(f.read().startswith(b"flassh-ir "))
+
+    def test_syntax_error(self):
+        out = self.runCached("echo ok\necho a >\n")
+        self.assertEqual(out["status"], 2)
+        self.assertEqual(out["stdout"], b"")
+        self.assertEqual(self.entries(), [])
+
+# --stall-threshold reports event loop callbacks that take longer
+class TestStallDetector(FlasshTestCase):
+    def test_report(self):
+        out = runSource("echo hi | cat\n", ["--stall-threshold", "0.001", "--stats"])
+        self.assertEqual(out["stdout"], b"hi\n")
+        self.assertIn(b"event loop stalled for", out["stderr"])
+        self.assertIn(b"in pipe right side finished", out["stderr"])
+        stalls = re.search(rb"(?m)^main +\d+ +\d+ +\d+ +(\d+)", out["stderr"])
+        self.assertGreater(int(stalls.group(1)), 0)
+
+    def test_quiet(self):
+        for args in [[], ["--stall-threshold", "10000"]]:
+            out = runSource("echo hi | cat\n", args)
+            self.assertEqual(out["stdout"], b"hi\n")
+            self.assertNotIn(b"stalled", out["stderr"])
+
+    def test_bad_threshold(self):
+        for threshold in ["0", "-1", "x"]:
+            out = runSource("echo hi\n", ["--stall-threshold", threshold])
+            self.assertEqual(out["status"], 2)
+            self.assertIn(b"usage", out["stderr"])
+
+# --trace writes Chrome trace events
+def runTraced(script, args = []):
+    with tempfile.TemporaryDirectory() as tmpDir:
+        path = os.path.join(tmpDir, "trace.json")
+        out = runScript([FLASSH_PATH, "--trace", path] + args + [script], timeout=60)
+        with open(path) as f:
+            return out, json.load(f)["traceEvents"]
+
+class TestTrace(FlasshTestCase):
+    def assertSpansClosed(self, events, name):
+        begins = sorted(e["id"] for e in events if e["name"] == name and e["ph"] == "b")
+        ends = sorted(e["id"] for e in events if e["name"] == name and e["ph"] == "e")
+        self.assertGreater(len(begins), 0)
+        self.assertEqual(begins, ends)
+
+    def test_local(self):
+        with tempfile.NamedTemporaryFile("w", suffix=".sh") as f:
+            f.write("echo hi | cat\n")
+            f.flush()
+            out, events = runTraced(f.name)
+        self.assertEqual(out["stdout"], b"hi\n")
+        names = [e["name"] for e in events]
+        self.assertIn("loadScript", names)
+        for name in ["fork", "exec", "waitpid"]:
+            self.assertEqual(names.count(name), 2, name)
+        self.assertSpansClosed(events, "LocalProcess")
+
+    def test_failed_connect(self):
+        with tempfile.NamedTemporaryFile("w", suffix=".sh") as f:
+            f.write("h := x@127.0.0.1:1\nh: true\n")
+            f.flush()
+            out, events = runTraced(f.name)
+        self.assertNotEqual(out["status"], 0)
+        self.assertSpansClosed(events, "Host::connect")
+
+# remote hosts on a throwaway local sshd, whose host definition is `h`
+@unittest.skipUnless(haveSshd(), "sshd not installed")
+class SshdTestCase(FlasshTestCase):
+    def setUp(self):
+        self.tmpDir = tempfile.TemporaryDirectory()
+        self.sshd = LocalSshd()
+        self.sshd.start()
+
+    def tearDown(self):
+        self.sshd.stop()
+        self.tmpDir.cleanup()
+
+    def path(self, name):
+        return os.path.join(self.tmpDir.name, name)
+
+    def writeScript(self, script):
+        with open(self.path("script.sh"), "w") as f:
+            f.write("h := %s\n%s" % (self.sshd.hostSpec(), script))
+        return self.path("script.sh")
+
+    def runRemote(self, script, args = []):
+        return runScript([FLASSH_PATH] + args + [self.writeScript(script)], timeout=60)
+
+    def writeFile(self, name, data):
+        with open(self.path(name), "wb") as f:
+            f.write(data)
+        return self.path(name)
+
+    def readFile(self, name):
+        with open(self.path(name), "rb") as f:
+            return f.read()
+
+class TestRemote(SshdTestCase):
+    def test_distribute(self):
+        data = os.urandom(3 << 20)
+        src = self.writeFile("src", data)
+        out = self.runRemote("distribute %s %s h\n" % (src, self.path("dest")))
+        self.assertEqual(out["status"], 0)
+        self.assertEqual(self.readFile("dest"), data)
+
+    # a source that can't be read leaves the destination as it was. A
+    # directory can be opened, but the first read fails.
+    def test_distribute_read_error(self):
+        self.writeFile("dest", b"old")
+        out = self.runRemote("distribute %s %s h\n" % (self.tmpDir.name, self.path("dest")))
+        self.assertEqual(out["status"], 1)
+        self.assertIn(b"Is a directory", out["stderr"])
+        self.assertEqual(self.readFile("dest"), b"old")
+        self.assertFalse(os.path.exists(self.path("dest.flassh-distribute")))
+
+    def test_event_loops(self):
+        hosts = ["g%d" % i for i in range(6)]
+        out = self.runRemote("".join("%s := %s\n" % (g, self.sshd.hostSpec()) for g in hosts) +
+                             "".join("%s: echo %s\n" % (g, g) for g in hosts), ["--event-loops", "3"])
+        self.assertEqual(out["stdout"], "".join(g + "\n" for g in hosts).encode())
+        self.assertEqual(out["status"], 0)
+
+    def test_trace(self):
+        out, events = runTraced(self.writeScript("h: echo hi\n"))
+        self.assertEqual(out["stdout"], b"hi\n")
+        names = [e["name"] for e in events]
+        for name in ["connected", "ssh_channel_open_session", "ssh_channel_request_exec", "first byte",
+                     "exit status"]:
+            self.assertIn(name, names)
+        for name in ["Host::connect", "RemoteProcess"]:
+            begins = [e["id"] for e in events if e["name"] == name and e["ph"] == "b"]
+            ends = [e["id"] for e in events if e["name"] == name and e["ph"] == "e"]
+            self.assertEqual(sorted(begins), sorted(ends))
+
+    def test_stats(self):
+        src = self.writeFile("in", b"x" * 3000)
+        out = self.runRemote("h: echo hello\nh: cat > /dev/null < ::%s\nstats\n" % src)
+        # the file goes to the remote stdin
+        self.assertRegex(out["stdout"], rb"(?m)^h +6 B +0 B +2\.9 KiB +\d+ +\d+ ")
+        self.assertEqual(out["status"], 0)
+
+    # the daemon keeps the connection of the first run for the second one
+    def test_daemon(self):
+        socket = self.path("flasshd.sock")
+        daemon = startDaemon(socket)
+        os.environ["FLASSH_SOCKET"] = socket
+        try:
+            outs = [self.runRemote("h: echo \\$SSH_CLIENT\n", ["--daemon"]) for _ in range(2)]
+        finally:
+            del os.environ["FLASSH_SOCKET"]
+            daemon.terminate()
+            daemon.wait()
+        for out in outs:
+            self.assertEqual(out["status"], 0)
+            self.assertRegex(out["stdout"], rb"^127\.0\.0\.1 \d+ \d+\n$")
+        self.assertEqual(outs[0]["stdout"], outs[1]["stdout"])
+
+    # remote commands between local ones get channels opened ahead of time,
+    # and still run in order
+    def test_dispatch(self):
+        script = "".join("h: echo %d\necho l%d\n" % (i, i) for i in range(20))
+        out = self.runRemote(script + "h: exit 3\n")
+        self.assertEqual(out["stdout"], "".join("%d\nl%d\n" % (i, i) for i in range(20)).encode())
+        self.assertEqual(out["status"], 3)
+
+    # consecutive commands share a channel, but keep their own output and
+    # status
+    def test_batch(self):
+        script = "h: echo 1\nh: false\nh: ls /nonexistent_flassh_dir\nh: exit 3\n"
+        batched = self.runRemote(script)
+        self.assertEqual(batched["stdout"], b"1\n")
+        self.assertIn(b"nonexistent_flassh_dir", batched["stderr"])
+        self.assertEqual(batched["status"], 3)
+        single = self.runRemote("g := %s batch=no\n" % self.sshd.hostSpec() + script.replace("h:", "g:"))
+        self.assertOutputEqual(batched, single)
+
+        out = self.runRemote(script, ["--stats"])
+        channels = re.search(rb"(?m)^h +\S+ \w*B +\S+ \w*B +\S+ \w*B +\d+ +\d+ +\S+ +(\d+) ", out["stderr"])
+        self.assertEqual(int(channels.group(1)), 1)
+
+    # files on the host of the command are opened by the remote shell, which
+    # gets their paths quoted, batched or not
+    def test_redirect_same_host(self):
+        path = self.path("a b")
+        script = "X=two\nh: echo one > \"%s\"\nh: echo $X >> \"%s\"\nh: cat < \"%s\"\n" % (path, path, path)
+        for host in ["h", "g"]:
+            out = self.runRemote("g := %s batch=no\n" % self.sshd.hostSpec() + script.replace("h:", host + ":"))
+            self.assertEqual(out["stdout"], b"one\ntwo\n")
+            self.assertEqual(out["status"], 0)
+            os.unlink(path)
+
+    # a server that never finishes the handshake doesn't hold up another host
+    # on the same event loop
+    def test_slow_host(self):
+        with socket.socket() as silent:
+            silent.bind(("127.0.0.1", 0))
+            silent.listen()
+            start = time.monotonic()
+            out = self.runRemote("slow := x@127.0.0.1:%d\nh: echo fast\n" % silent.getsockname()[1],
+                                 ["--event-loops", "2"])
+        self.assertEqual(out["stdout"], b"fast\n")
+        self.assertEqual(out["status"], 0)
+        self.assertLess(time.monotonic() - start, 5)
+
+    def test_inventory(self):
+        inv = self.writeFile("inventory", ("g1 := %s\ng2 := %s\n" % (self.sshd.hostSpec(), self.sshd.hostSpec())).encode())
+        out = self.runRemote("inventory %s\ng1: echo 1\ng2: echo 2\n" % inv)
+        self.assertEqual(out["stdout"], b"1\n2\n")
+        self.assertEqual(out["status"], 0)
+
+    def test_timeout(self):
+        start = time.monotonic()
+        out = self.runRemote("h: @timeout 1 sleep 30\n")
+        self.assertEqual(out["status"], 124)
+        self.assertIn(b"timed out after 1s", out["stderr"])
+        out = self.runRemote("g := %s timeout=1\ng: sleep 30\n" % self.sshd.hostSpec())
+        self.assertEqual(out["status"], 124)
+        self.assertLess(time.monotonic() - start, 15)
+
+    # event loop timers fire on time, here from beyond the first level of the
+    # timer wheel (256ms)
+    def test_timer(self):
+        start = time.monotonic()
+        out = self.runRemote("h: @timeout 2 sleep 30\n")
+        elapsed = time.monotonic() - start
+        self.assertEqual(out["status"], 124)
+        self.assertGreaterEqual(elapsed, 2)
+        self.assertLess(elapsed, 4)
+
+    def test_bwlimit(self):
+        start = time.monotonic()
+        out = self.runRemote("h: head -c 300000 /dev/zero | wc -c\n", ["--bwlimit-down", "100K"])
+        self.assertEqual(out["stdout"].strip(), b"300000")
+        # a quarter second of data may come at once
+        self.assertGreater(time.monotonic() - start, 2.5)
+
+    # commands wait for a channel instead of failing
+    def test_max_channels(self):
+        out = self.runRemote("g := %s max_channels=1\n" % self.sshd.hostSpec() +
+                             "".join("g: echo %d\necho l\n" % i for i in range(5)))
+        self.assertEqual(out["stdout"], "".join("%d\nl\n" % i for i in range(5)).encode())
+        self.assertEqual(out["status"], 0)
+
+    def test_compression(self):
+        out = self.runRemote("g := %s compression=9 ciphers=aes128-ctr rekey_data=64K\n" % self.sshd.hostSpec() +
+                             "g: head -c 1000000 /dev/zero | wc -c\n")
+        self.assertEqual(out["stdout"].strip(), b"1000000")
+        self.assertEqual(out["status"], 0)
+
+    def test_push(self):
+        data = bytearray(os.urandom(64 << 10))
+        src = self.writeFile("src", data)
+        script = "push -v -b 4096 %s %s h\n" % (src, self.path("dest"))
+        out = self.runRemote(script)
+        self.assertEqual(out["status"], 0)
+        self.assertEqual(self.readFile("dest"), data)
+
+        # only the changed block is sent again
+        data[5000] ^= 0xff
+        self.writeFile("src", data)
+        out = self.runRemote(script)
+        self.assertEqual(out["status"], 0)
+        self.assertIn(b"for 1 of 16 blocks", out["stderr"])
+        self.assertEqual(self.readFile("dest"), data)
+
+    # the local file is hashed in batches, so pushing a large unchanged file
+    # doesn't stall the event loop
+    def test_push_large(self):
+        src = self.writeFile("src", os.urandom(64 << 20))
+        out = self.runRemote("push %s %s h\n" % (src, self.path("dest")) * 2, ["--stall-threshold", "250"])
+        self.assertEqual(out["status"], 0)
+        self.assertNotIn(b"in push", out["stderr"])
+        self.assertEqual(self.readFile("dest"), self.readFile("src"))
+
+# connections to the local sshd get dropped while commands run
+class TestReconnect(SshdTestCase):
+    # runs `script` on host `h`, and drops the connection once `started` exists
+    def runDropped(self, script):
+        path = self.writeScript(script)
+        # the first run blocks until the connection is dropped, later ones don't
+        with open(self.path("step.sh"), "w") as f:
+            f.write("if [ -e %s ]; then echo done; exit 0; fi\n" % self.path("started") +
+                    "touch %s\nsleep 10\n" % self.path("started"))
+
+        p = Popen([FLASSH_PATH, path], stdout=PIPE, stderr=PIPE)
+        try:
+            deadline = time.monotonic() + DEFAULT_TIMEOUT
+            while not os.path.exists(self.path("started")):
+                self.assertIsNone(p.poll())
+                self.assertLess(time.monotonic(), deadline)
+                time.sleep(0.05)
+            self.sshd.dropConnections()
+            stdout, _ = p.communicate(timeout=60)
+        finally:
+            p.kill()
+            p.wait()
+        return p.returncode, stdout
+
+    # the command that was running fails like with ssh(1)
+    def test_lost(self):
+        status, stdout = self.runDropped("h: sh %s\n" % self.path("step.sh"))
+        self.assertEqual(stdout, b"")
+        self.assertEqual(status, 255)
+
+    def test_reconnect(self):
+        status, stdout = self.runDropped("h: echo before\n" +
+                                         "h: sh %s || echo failed\n" % self.path("step.sh") +
+                                         "h: echo after\n")
+        self.assertEqual(stdout, b"before\nfailed\nafter\n")
+        self.assertEqual(status, 0)
+
+    def test_retry(self):
+        status, stdout = self.runDropped("h: @retry 2 sh %s\n" % self.path("step.sh") +
+                                         "h: echo after\n")
+        self.assertEqual(stdout, b"done\nafter\n")
+        self.assertEqual(status, 0)
+
+    # keepalives the server answers don't drop the connection, however short
+    def test_keepalive(self):
+        out = self.runRemote("g := %s keepalive=1 keepalive_count=1\n" % self.sshd.hostSpec() +
+                             "g: sleep 3\ng: echo alive\n")
+        self.assertEqual(out["stdout"], b"alive\n")
+        self.assertEqual(out["status"], 0)
+        self.assertNotIn(b"keepalives", out["stderr"])
+
+# starts flasshd on `socket` and waits until it listens
+def startDaemon(socket):
+    daemon = Popen([FLASSHD_PATH, "--socket", socket], stderr=DEVNULL)
+    while not os.path.exists(socket):
+        if daemon.poll() is not None:
+            raise RuntimeError("flasshd exited with status %d" % daemon.returncode)
+        time.sleep(0.01)
+    return daemon
+
+# scripts run by flasshd should behave the same as when run directly
+class TestDaemon(FlasshTestCase):
+    def setUp(self):
+        self.tmpDir = tempfile.TemporaryDirectory()
+        self.socket = os.path.join(self.tmpDir.name, "flasshd.sock")
+        self.daemon = startDaemon(self.socket)
+        os.environ["FLASSH_SOCKET"] = self.socket
+
+    def tearDown(self):
+        del os.environ["FLASSH_SOCKET"]
+        self.daemon.terminate()
+        self.daemon.wait()
+        self.tmpDir.cleanup()
+
+    def test_run(self):
+        for script in ["bash_compat/basic.sh", "bash_compat/pipe.sh", "bash_compat/redirect.sh", "bash_compat/and_or.sh",
+                       "bash_compat/variables.sh"]:
+            self.assertCmdsEqual([FLASSH_PATH, script], [FLASSH_PATH, "--daemon", script])
+
+    def test_stdin(self):
+        script = os.path.join(self.tmpDir.name, "stdin.sh")
+        with open(script, "w") as f:
+            f.write("tr a-z A-Z\n")
+        self.assertCmdsEqual(["bash", script], [FLASSH_PATH, "--daemon", script], stdin=b"some input\n")
+
+    def test_syntax_error(self):
+        out = runSource("echo a\necho ${X\n", ["--daemon"])
+        self.assertEqual(out["status"], 2)
+        self.assertEqual(out["stdout"], b"")
+
+    # variables and $? of one run don't leak into the next
+    def test_fresh_state(self):
+        self.assertEqual(runSource("X=1\nfalse\n", ["--daemon"])["status"], 1)
+        out = runSource("echo \"[$X] $?\"\n", ["--daemon"])
+        self.assertEqual(out["stdout"], b"[] 0\n")
+
+    def test_unreachable(self):
+        os.environ["FLASSH_SOCKET"] = os.path.join(self.tmpDir.name, "nothing.sock")
+        out = runSource("echo hi\n", ["--daemon"])
+        self.assertEqual(out["status"], 1)
+        self.assertEqual(out["stdout"], b"")
+        self.assertIn(b"can't reach flasshd", out["stderr"])
 
 
 if __name__ == "__main__":
@@ -1,3 +1,4 @@
+import tempfile
 import unittest
 from subprocess import Popen, PIPE, TimeoutExpired
 
@@ -9,6 +10,7 @@ DEFAULT_PARAMS = ["status", "stdout", "stderr"]
 
 # location of the flassh executable
 FLASSH_PATH = "../build/flassh"
+FLASSHD_PATH = "../build/flasshd"
 
 # run a script, returns {status, stdout, stderr}
 def runScript(args, stdin = None, timeout = None):
@@ -26,6 +28,13 @@ def runScript(args, stdin = None, timeout = None):
         "stderr": output[1],
     }
 
+# run a script given as a string, from a temporary file
+def runSource(source, args = [], timeout = None):
+    with tempfile.NamedTemporaryFile("w", suffix=".sh") as f:
+        f.write(source)
+        f.flush()
+        return runScript([FLASSH_PATH] + args + [f.name], timeout=timeout)
+
 class FlasshTestCase(unittest.TestCase):
     # missing values in `params` are treated as "don't care"
     def assertOutputEqual(self, output, compare, params = DEFAULT_PARAMS):